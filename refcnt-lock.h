@@ -107,4 +107,30 @@ refcnt_dec(refcnt_t *rcnt, void  (*release)(refcnt_t *))
 	return 0;
 }
 
+/*
+ * refcnt_{inc,dec}_local: non-atomic variants
+ *  These are only valid if no other thread can access the refcount
+ *  concurrently (e.g., for objects that are private to a thread). The updates
+ *  are published to other threads by a subsequent release operation (e.g.,
+ *  unlocking the lock under which the object becomes shared).
+ */
+
+static inline void
+refcnt_inc_local(refcnt_t *rcnt)
+{
+	assert(rcnt->cnt > 0);
+	rcnt->cnt++;
+}
+
+static inline int
+refcnt_dec_local(refcnt_t *rcnt, void  (*release)(refcnt_t *))
+{
+	assert(rcnt->cnt > 0);
+	if (--rcnt->cnt == 0) {
+		release(rcnt);
+		return 1;
+	}
+	return 0;
+}
+
 #endif /* REFCNT_H_ */
@@ -15,9 +15,11 @@
 
 #include "vbpt.h"
 #include "vbpt_mtree.h"
+#include "vbpt_smtree.h"
 #include "vbpt_merge.h"
 #include "vbpt_tx.h"
 #include "vbpt_mm.h"
+#include "vbpt_epoch.h"
 
 #include "mt_lib.h"
 #include "tsc.h"
@@ -52,6 +54,7 @@ struct targ {
 
 	// vbpt-specific
 	vbpt_mtree_t      *mtree;
+	vbpt_smtree_t     *smtree; // if not NULL, use sharded transactions
 	vbpt_stats_t      vbpt_stats;
 	vbpt_mm_stats_t   vbpt_mm_stats;
 };
@@ -65,7 +68,7 @@ randf(unsigned int *seed)
 
 
 // randi(): return a random integer in [i_min, i_max] range
-static inline int
+static inline size_t
 randi(unsigned int *seed, size_t i_min, size_t i_max)
 {
 	return (rand_r(seed) % (i_max - i_min + 1)) + i_min;
@@ -88,16 +91,18 @@ randop(struct targ *targ)
 	return ret;
 }
 
+// operate either on @txt_tree, or on the shards of @stx
 static void
-do_randops(vbpt_tree_t *tree, struct targ *targ)
+do_randops(vbpt_tree_t *txt_tree, vbpt_stxtree_t *stx, struct targ *targ)
 {
 	static uint32_t cnt = 0;
 	static volatile uint64_t ret = 0;
 	uint64_t prefix = ((uint64_t)targ->tid)<<32;
-	ver_t *ver = tree->ver;
 
 	for (size_t i=0; i < targ->tx_nops; i++) {
 		size_t key = randi(&targ->seed, targ->k_min, targ->k_max);
+		vbpt_tree_t *tree = stx ? vbpt_stxt_tree(stx, key) : txt_tree;
+		ver_t *ver = tree->ver;
 		enum tree_op top = randop(targ);
 		vbpt_leaf_t *leaf;
 		switch (top) {
@@ -108,7 +113,9 @@ do_randops(vbpt_tree_t *tree, struct targ *targ)
 			break;
 
 			case TREEOP_LOOKUP:
-			leaf = vbpt_logtree_get(tree, key);
+			// read-only transactions (see vbpt_thread()) have no log
+			leaf = tree->ver ? vbpt_logtree_get(tree, key)
+			                 : vbpt_get(tree, key);
 			if (leaf)
 				ret += leaf->val;
 			break;
@@ -136,27 +143,55 @@ vbpt_thread(void *arg)
 	struct targ *targ   = arg;
 	size_t ntxs         = targ->ntxs;
 	vbpt_mtree_t *mtree = targ->mtree;
+	struct vbpt_txt_cm cm;
 
 	vbpt_stats_init();
 	vbpt_mm_init();
 	tsc_init(&targ->ticks);
+	vbpt_txt_cm_init(&cm, targ->seed);
 	pthread_barrier_wait(targ->tbar);
 
 	tsc_start(&targ->ticks);
 	for (size_t tx=0; tx < ntxs; tx++) {
+		// only lookups: use read-only transactions
+		if (targ->in_p == 0.0 && targ->dl_p == 0.0 && !targ->smtree) {
+			vbpt_tree_t rotree;
+			vbpt_rotx_begin(mtree, &rotree);
+			do_randops(&rotree, NULL, targ);
+			vbpt_rotx_end(mtree, &rotree);
+			continue;
+		}
+
+		if (targ->smtree) {
+			do {
+				seed = targ->seed;
+				vbpt_stxtree_t *stx;
+				stx = vbpt_stxtree_alloc(targ->smtree);
+				do_randops(NULL, stx, targ);
+				vbpt_stxt_finalize(stx);
+				vbpt_txt_res_t ret = vbpt_stxt_try_commit(stx);
+				if (ret == VBPT_COMMIT_OK ||
+				    ret == VBPT_COMMIT_MERGED)
+					break;
+				targ->seed = seed;
+			} while (1);
+			continue;
+		}
+
 		do {
 			seed = targ->seed; // take a snapshot of seed
-			txt = vbpt_txtree_alloc(mtree); // start transaction
+			txt = vbpt_txt_cm_begin(&cm, mtree); // start transaction
 
 			//printf("t=%d tx=%zu\n", targ->tid, tx);
-			do_randops(txt->tree, targ);
+			do_randops(txt->tree, NULL, targ);
 
 			vbpt_logtree_finalize(txt->tree); // finish transaction
-			vbpt_txt_res_t ret = vbpt_txt_try_commit(txt, mtree, 2);
-			if (ret == VBPT_COMMIT_OK || ret == VBPT_COMMIT_MERGED)
+			if (vbpt_txt_cm_commit(&cm, txt, mtree, 2))
 				break;
 
-			targ->seed = seed; // failed to commit: restore seed
+			// failed to commit (the contention manager backed off):
+			// restore seed
+			targ->seed = seed;
 		} while (1);
 	}
 	tsc_pause(&targ->ticks);
@@ -165,6 +200,7 @@ vbpt_thread(void *arg)
 
 	vbpt_stats_get(&targ->vbpt_stats);
 	vbpt_mm_stats_get(&targ->vbpt_mm_stats);
+	vbpt_epoch_thr_unregister();
 	pthread_barrier_wait(targ->tbar);
 	return NULL;
 }
@@ -182,14 +218,40 @@ vbpt_thr_print_stats(struct targ *arg)
 
 // insert a key to populate the ->root pointer
 static void
-init_vbpt(vbpt_tree_t *tree)
+init_vbpt(vbpt_tree_t *tree, uint64_t key)
 {
 	vbpt_leaf_t *leaf;
 	vbpt_stats_init();
 	vbpt_mm_init();
 	vbpt_logtree_log_init(tree);
 	leaf = vbpt_leaf_alloc(0, tree->ver);
-	vbpt_logtree_insert(tree, 0, leaf, NULL);
+	vbpt_logtree_insert(tree, key, leaf, NULL);
+}
+
+static void
+init_targs(struct targ *targs, unsigned nthreads, unsigned *cpus,
+           pthread_barrier_t *tbar, float in_p, float dl_p,
+           size_t ntxs, size_t tx_nops, size_t key_step)
+{
+	size_t key = 0;
+	bzero(targs, sizeof(struct targ)*nthreads);
+	for (int i=0; i<nthreads; i++) {
+		targs[i].tid      = i;
+		targs[i].nthreads = nthreads;
+		targs[i].core     = cpus[i];
+		targs[i].tbar     = tbar;
+
+		targs[i].k_min  = key;
+		key            += key_step;
+		targs[i].k_max  = key - 1;
+
+		targs[i].seed = 0;
+		targs[i].in_p = in_p;
+		targs[i].dl_p = dl_p;
+
+		targs[i].ntxs    = ntxs;
+		targs[i].tx_nops = tx_nops;
+	}
 }
 
 static void
@@ -217,6 +279,13 @@ do_run(char *prefix,
 		printf("T: %2u [tid:%d] ", i, targs[i].tid);
 		vbpt_thr_print_stats(targs+i);
 	}
+	// conflict heat map of all threads
+	vbpt_stats_t heat;
+	bzero(&heat, sizeof(heat));
+	for (unsigned i=0; i<nthreads; i++)
+		vbpt_merge_heat_add(&heat, &targs[i].vbpt_stats);
+	printf("  Merge conflicts per key range:\n");
+	vbpt_merge_heat_report("    ", &heat);
 	printf("---------------------------------------------------------\n\n");
 }
 
@@ -256,35 +325,51 @@ main(int argc, const char *argv[])
 	printf("nthr:%u ntxs:%zu tx_nops:%zu [nops/thr:%zu nops_all:%zu]\n",
 	       nthreads, ntxs, tx_nops, nops_per_thr, nops_all);
 
-	vbpt_tree_t  *tree0 = vbpt_tree_create();
-	init_vbpt(tree0);
-	vbpt_mtree_t *mtree = vbpt_mtree_alloc(tree0);
+	size_t key_step = ((size_t)-1) / nthreads;
+	vbpt_merge_heat_setup(key_step*nthreads - 1);
+
+	// compare the memory management modes of the mtree
+	static const char *mm_names[] = {
+		[VBPT_MTREE_MM_REFCNT]    = "refcnt",
+		[VBPT_MTREE_MM_EPOCH]     = "epoch ",
+		[VBPT_MTREE_MM_EPOCH_CAS] = "ep-cas",
+	};
+	for (int mm=VBPT_MTREE_MM_REFCNT; mm <= VBPT_MTREE_MM_EPOCH_CAS; mm++) {
+		vbpt_tree_t  *tree0 = vbpt_tree_create();
+		init_vbpt(tree0, 0);
+		vbpt_mtree_t *mtree = vbpt_mtree_alloc(tree0);
+		vbpt_mtree_setmm(mtree, mm);
+
+		init_targs(targs, nthreads, cpus, &tbar, in_p, dl_p,
+		           ntxs, tx_nops, key_step);
+		for (int i=0; i<nthreads; i++)
+			targs[i].mtree  = mtree;
+
+		char prefix[64];
+		snprintf(prefix, sizeof(prefix),
+		         "%s empty:     ", mm_names[mm]);
+		do_run(prefix, &tbar, targs, nthreads);
+		snprintf(prefix, sizeof(prefix),
+		         "%s non-empty: ", mm_names[mm]);
+		do_run(prefix, &tbar, targs, nthreads);
+
+		vbpt_mtree_dealloc(mtree, NULL);
+	}
 
-	size_t key = 0, key_step = ((size_t)-1) / nthreads;
-	bzero(targs, sizeof(targs));
+	// sharded mtree: one shard per thread key range
+	vbpt_tree_t *trees[nthreads];
 	for (int i=0; i<nthreads; i++) {
-		targs[i].tid      = i;
-		targs[i].nthreads = nthreads;
-		targs[i].core     = cpus[i];
-		targs[i].tbar     = &tbar;
-
-		targs[i].k_min  = key;
-		key            += key_step;
-		targs[i].k_max  = key - 1;
-
-		targs[i].seed = 0;
-		targs[i].in_p = in_p;
-		targs[i].dl_p = dl_p;
-
-		targs[i].ntxs    = ntxs;
-		targs[i].tx_nops = tx_nops;
-
-		targs[i].mtree  = mtree;
+		trees[i] = vbpt_tree_create();
+		init_vbpt(trees[i], i*key_step);
 	}
-
-
-	do_run("empty:     ", &tbar, targs, nthreads);
-	do_run("non-empty: ", &tbar, targs, nthreads);
+	vbpt_smtree_t *smtree = vbpt_smtree_alloc(trees, nthreads, key_step);
+	init_targs(targs, nthreads, cpus, &tbar, in_p, dl_p,
+	           ntxs, tx_nops, key_step);
+	for (int i=0; i<nthreads; i++)
+		targs[i].smtree = smtree;
+	do_run("smtree empty:     ", &tbar, targs, nthreads);
+	do_run("smtree non-empty: ", &tbar, targs, nthreads);
+	vbpt_smtree_dealloc(smtree);
 
 	free(cpus);
 	return 0;
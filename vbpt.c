@@ -31,6 +31,7 @@
 #include "misc.h"
 #include "ver.h"
 #include "refcnt.h"
+#include "vbpt_epoch.h"
 #include "vbpt.h"
 #include "vbpt_mm.h"
 #include "vbpt_stats.h"
@@ -265,6 +266,7 @@ vbpt_tree_alloc(ver_t *ver)
 	ret->ver = ver;
 	ret->root = NULL;
 	ret->height = 0;
+	ret->root_epoch = false;
 	return ret;
 }
 
@@ -281,6 +283,43 @@ vbpt_tree_branch_init(vbpt_tree_t *parent, vbpt_tree_t *ret)
 	ret->ver = ver_branch(parent->ver);
 	ret->root = vbpt_node_getref(parent->root);
 	ret->height = parent->height;
+	ret->root_epoch = false;
+}
+
+/**
+ * branch a tree, borrowing @parent's root instead of grabbing a reference
+ *  The calling thread enters an epoch (vbpt_epoch_enter()), which is exited
+ *  when the root is no longer borrowed: when it is COWed, when the tree is
+ *  destroyed, or when vbpt_tree_root_own() is called. The caller needs to make
+ *  sure that @parent is not released while this function runs (e.g., by
+ *  holding the mtree lock, or by being in an epoch), and that the old root is
+ *  released via vbpt_epoch_retire().
+ */
+void
+vbpt_tree_branch_epoch(vbpt_tree_t *parent, vbpt_tree_t *ret)
+{
+	if (parent->root == NULL) {
+		vbpt_tree_branch_init(parent, ret);
+		return;
+	}
+	vbpt_epoch_enter();
+	ret->ver = ver_branch(parent->ver);
+	ret->root = parent->root;
+	ret->height = parent->height;
+	ret->root_epoch = true;
+}
+
+/**
+ * grab a reference to @tree's root if it is borrowed, and exit the epoch
+ */
+void
+vbpt_tree_root_own(vbpt_tree_t *tree)
+{
+	if (!tree->root_epoch)
+		return;
+	vbpt_node_getref(tree->root);
+	tree->root_epoch = false;
+	vbpt_epoch_exit();
 }
 
 /**
@@ -293,6 +332,7 @@ vbpt_tree_copy(vbpt_tree_t *dst, vbpt_tree_t *src)
 	dst->ver = ver_getref(src->ver);
 	dst->root = vbpt_node_getref(src->root);
 	dst->height = src->height;
+	dst->root_epoch = false;
 }
 
 /**
@@ -314,8 +354,12 @@ void
 vbpt_tree_destroy(vbpt_tree_t *tree)
 {
 	ver_putref(tree->ver);
-	if (tree->root != NULL)
+	if (tree->root_epoch) {
+		tree->root_epoch = false;
+		vbpt_epoch_exit();
+	} else if (tree->root != NULL) {
 		vbpt_node_putref(tree->root);
+	}
 }
 
 /**
@@ -385,16 +429,47 @@ vbpt_insert_ptr(vbpt_node_t *node, uint16_t slot, uint64_t key, vbpt_hdr_t *val)
 	return insert_ptr(node, slot, key, val);
 }
 
+/**
+ * allocate a node that will be placed under a node with the tree's version
+ *  With VBPT_VREF_ELIDE, the node has a NULL vref and inherits its parent's
+ *  version.
+ */
+static inline vbpt_node_t *
+node_alloc_inherit(vbpt_tree_t *tree)
+{
+	#if defined(VBPT_VREF_ELIDE)
+	return vbpt_node_alloc(VBPT_NODE_SIZE, NULL);
+	#else
+	return vbpt_node_alloc(VBPT_NODE_SIZE, tree->ver);
+	#endif
+}
+
+/**
+ * check if @hdr is private to @tree (i.e., it has the tree's version).
+ *  This is only valid if @hdr's parent is private to @tree
+ */
+static inline bool
+hdr_private(vbpt_tree_t *tree, vbpt_hdr_t *hdr)
+{
+	vref_t vref = vref_load(&hdr->vref);
+	return vref_isnull(vref) || vref_eqver(vref, tree->ver);
+}
+
 /**
  * copy key-values in a node -- grabs new references
+ *  @src_vref is @src's version: children with a NULL vref (i.e., the same
+ *  version as @src) have their reference set, since @dst's version differs
  */
 static void
-copy_node(vbpt_node_t *dst, vbpt_node_t *src)
+copy_node(vbpt_node_t *dst, vbpt_node_t *src, vref_t src_vref)
 {
 	assert(dst->items_total >= src->items_total);
+	assert(!vref_isnull(src_vref));
 	for (unsigned i=0; i<src->items_nr; i++) {
+		vbpt_hdr_t *hdr = src->kvp[i].val;
+		vbpt_hdr_vref_set(hdr, src_vref);
 		dst->kvp[i].key = src->kvp[i].key;
-		dst->kvp[i].val = vbpt_hdr_getref(src->kvp[i].val);
+		dst->kvp[i].val = vbpt_hdr_getref(hdr);
 	}
 	dst->items_nr = src->items_nr;
 }
@@ -411,12 +486,13 @@ static vbpt_node_t *
 cow_node(vbpt_tree_t *tree, vbpt_node_t *parent, uint16_t parent_slot)
 {
 	assert(parent_slot < parent->items_nr);
-	ver_t *ver = vbpt_tree_ver(tree);
-	assert(vref_eqver(parent->n_hdr.vref, ver));
+	assert(hdr_private(tree, &parent->n_hdr));
 	uint64_t key = parent->kvp[parent_slot].key;
 	vbpt_node_t *old = hdr2node(parent->kvp[parent_slot].val);
-	vbpt_node_t *new = vbpt_node_alloc(VBPT_NODE_SIZE, ver);
-	copy_node(new, old);
+	// a node with a NULL vref is private, so it would not be COWed
+	assert(!vref_isnull(old->n_hdr.vref));
+	vbpt_node_t *new = node_alloc_inherit(tree);
+	copy_node(new, old, old->n_hdr.vref);
 	insert_ptr(parent, parent_slot, key, &new->n_hdr);
 	vbpt_node_putref(old);
 	return new;
@@ -424,15 +500,29 @@ cow_node(vbpt_tree_t *tree, vbpt_node_t *parent, uint16_t parent_slot)
 
 
 
+/**
+ * COW @tree's root
+ *  If the root is borrowed (see vbpt_tree_branch_epoch()), the new root still
+ *  grabs (atomic) references to all of the old root's children: only the root
+ *  itself is borrowed. Borrowing the children as well would only postpone
+ *  these references: a committed tree needs to own its root's children, so
+ *  vbpt_tree_root_own() would grab them at commit time.
+ */
 static vbpt_node_t *
 cow_root(vbpt_tree_t *tree)
 {
 	ver_t *ver = vbpt_tree_ver(tree);
 	vbpt_node_t *new = vbpt_node_alloc(VBPT_NODE_SIZE, ver);
 	vbpt_node_t *old = tree->root;
-	copy_node(new, old);
+	copy_node(new, old, old->n_hdr.vref);
 	tree->root = new;
-	vbpt_node_putref(old);
+	if (tree->root_epoch) {
+		// the new root holds references to the children
+		tree->root_epoch = false;
+		vbpt_epoch_exit();
+	} else {
+		vbpt_node_putref(old);
+	}
 	return new;
 }
 
@@ -534,7 +624,7 @@ delete_ptr(vbpt_tree_t *tree, vbpt_node_t *node, uint16_t slot,
 		update_highkey(node, path->slots[lvl-1], path, lvl-1);
 	} else if (node->items_nr == 0 && node == tree->root) {
 		// no more elements left in root
-		vbpt_node_putref(tree->root);
+		vbpt_hdr_putref_tree(tree, &tree->root->n_hdr);
 		tree->root = NULL;
 		tree->height = 0;
 	} else if (node->items_nr == 0) {
@@ -565,7 +655,8 @@ move_items_from_left(vbpt_tree_t *tree,
 	//   @left is left of @node
 	assert(get_left_sibling(node, path) == left);
 	//   no need to COW
-	assert(vref_eq(node->n_hdr.vref, left->n_hdr.vref));
+	assert(hdr_private(tree, &node->n_hdr));
+	assert(hdr_private(tree, &left->n_hdr));
 	//   there is enough space in node
 	assert(node->items_total - node->items_nr >= mv_items);
 	//   there are anough items in left
@@ -582,7 +673,7 @@ move_items_from_left(vbpt_tree_t *tree,
 		d = delete_ptr(tree, pnode, pnode_slot -1, path, path->height - 2);
 		assert(get_left_sibling(node, path) != left);
 		assert(d == &left->n_hdr);
-		vbpt_node_putref(left);
+		vbpt_hdr_putref_tree(tree, &left->n_hdr);
 	} else {
 		update_highkey(left, pnode_slot -1, path, path->height -2);
 	}
@@ -608,7 +699,8 @@ move_items_from_right(vbpt_tree_t *tree,
 	//   @right is right of @node
 	assert(pnode->kvp[pnode_slot +1].val == &right->n_hdr);
 	//   no need to COW
-	assert(vref_eq(node->n_hdr.vref, right->n_hdr.vref));
+	assert(hdr_private(tree, &node->n_hdr));
+	assert(hdr_private(tree, &right->n_hdr));
 	//   there is enough space in node
 	assert(node->items_total - node->items_nr >= mv_items);
 	//   there are anough items in left
@@ -624,7 +716,7 @@ move_items_from_right(vbpt_tree_t *tree,
 		vbpt_hdr_t __attribute__((unused)) *d;
 		d = delete_ptr(tree, pnode, pnode_slot +1, path, path->height - 2);
 		assert(d == &right->n_hdr);
-		vbpt_node_putref(right);
+		vbpt_hdr_putref_tree(tree, &right->n_hdr);
 	}
 
 	update_highkey(node, pnode_slot, path, path->height -2);
@@ -654,7 +746,8 @@ move_items_left(vbpt_tree_t *tree,
 	//   @left is left of @node
 	assert(pnode->kvp[pnode_slot -1].val == &left->n_hdr);
 	//   no need to COW
-	assert(vref_eq(node->n_hdr.vref, left->n_hdr.vref));
+	assert(hdr_private(tree, &node->n_hdr));
+	assert(hdr_private(tree, &left->n_hdr));
 	//   there are enough items in node
 	assert(node->items_nr >= mv_items);
 	//   there is enough space in @left
@@ -673,7 +766,7 @@ move_items_left(vbpt_tree_t *tree,
 		node->items_nr = 0;
 		d = delete_ptr(tree, pnode, pnode_slot, path, path->height - 2);
 		assert(d == &node->n_hdr);
-		vbpt_node_putref(node);
+		vbpt_hdr_putref_tree(tree, &node->n_hdr);
 	}
 	// update @path
 	if (node_slot > mv_items) { // stayed in the same node
@@ -711,7 +804,8 @@ move_items_right(vbpt_tree_t *tree,
 	//   @right is right of @node
 	assert(get_right_sibling(node, path) == right);
 	//   no need to COW
-	assert(vref_eq(node->n_hdr.vref, right->n_hdr.vref));
+	assert(hdr_private(tree, &node->n_hdr));
+	assert(hdr_private(tree, &right->n_hdr));
 	//   there are enough items in @node
 	assert(node->items_nr >= mv_items);
 	//   there is enough space in @right
@@ -736,7 +830,7 @@ move_items_right(vbpt_tree_t *tree,
 		path->slots[path->height - 2] = pnode_slot +1 - delete_node;
 	}
 	if (delete_node) // release node
-		vbpt_node_putref(node);
+		vbpt_hdr_putref_tree(tree, &node->n_hdr);
 	else            // update ancestors
 		update_highkey(node, pnode_slot, path, path->height -2);
 	assert(vbpt_path_verify(tree, path));
@@ -768,8 +862,9 @@ move_items_left_right(vbpt_tree_t *tree, vbpt_node_t  *node,
 	//   @left  is left of @node
 	assert(pnode->kvp[pnode_slot-1].val == &left->n_hdr);
 	//   no need to COW
-	assert(vref_eq(node->n_hdr.vref, left->n_hdr.vref));
-	assert(vref_eq(node->n_hdr.vref, right->n_hdr.vref));
+	assert(hdr_private(tree, &node->n_hdr));
+	assert(hdr_private(tree, &left->n_hdr));
+	assert(hdr_private(tree, &right->n_hdr));
 	//   there are enough items in @node
 	assert(node->items_nr >= right_items + left_items);
 	//   there is enough space in @right
@@ -816,7 +911,7 @@ move_items_left_right(vbpt_tree_t *tree, vbpt_node_t  *node,
 	update_highkey(left, left_slot, path, path->height - 2);
 
 	if (node_deleted)
-		vbpt_node_putref(node);
+		vbpt_hdr_putref_tree(tree, &node->n_hdr);
 	else
 		update_highkey(node, left_slot +1, path, path->height -2);
 	assert(vbpt_path_verify(tree, path));
@@ -861,9 +956,9 @@ try_balance_node_nocow(vbpt_tree_t *tree,
                        vbpt_node_t *node, vbpt_node_t *left, vbpt_node_t *right,
                        vbpt_path_t *path)
 {
-	vref_t vref = node->n_hdr.vref;
-	bool l_merge = left  && vref_eq( left->n_hdr.vref, vref);
-	bool r_merge = right && vref_eq(right->n_hdr.vref, vref);
+	assert(hdr_private(tree, &node->n_hdr));
+	bool l_merge = left  && hdr_private(tree, &left->n_hdr);
+	bool r_merge = right && hdr_private(tree, &right->n_hdr);
 	uint16_t l_rem = (l_merge) ? left->items_total  - left->items_nr  : 0;
 	uint16_t r_rem = (r_merge) ? right->items_total - right->items_nr : 0;
 	if (l_rem >= node->items_nr) {
@@ -890,7 +985,7 @@ balance_right(vbpt_tree_t *tree,
 	assert(node = path->nodes[path->height-1]);
 	vbpt_node_t *pnode = path->nodes[path->height-2];
 	uint16_t pslot     = path->slots[path->height-2];
-	if (vref_eqver(right->n_hdr.vref, tree->ver)) {
+	if (!hdr_private(tree, &right->n_hdr)) {
 		right = cow_node(tree, pnode, pslot+1);
 	}
 	uint16_t mv_items = right->items_nr / 2;
@@ -909,7 +1004,7 @@ balance_left(vbpt_tree_t *tree,
 	assert(node = path->nodes[path->height-1]);
 	vbpt_node_t *pnode = path->nodes[path->height-2];
 	uint16_t pslot     = path->slots[path->height-2];
-	if (vref_eqver(left->n_hdr.vref, tree->ver)) {
+	if (!hdr_private(tree, &left->n_hdr)) {
 		left = cow_node(tree, pnode, pslot-1);
 	}
 	uint16_t mv_items =  left->items_nr / 2;
@@ -937,7 +1032,7 @@ try_balance_level(vbpt_tree_t *tree, vbpt_path_t *path)
 	vbpt_node_t *left = get_left_sibling(node, path);
 	vbpt_node_t *right = get_right_sibling(node, path);
 	// try to balance node
-	assert(vref_eqver(node->n_hdr.vref, vbpt_tree_ver(tree)));
+	assert(hdr_private(tree, &node->n_hdr));
 	try_balance_node_nocow(tree, node, left, right, path);
 
 	// reload node
@@ -1003,8 +1098,6 @@ add_new_root(vbpt_tree_t *tree, vbpt_path_t *path)
 static void
 split_node(vbpt_tree_t *tree, vbpt_path_t *path)
 {
-	ver_t *ver = vbpt_tree_ver(tree);
-
 	#if 0
 	printf("***** BEFORE SPLIT\n");
 	vbpt_path_print(path);
@@ -1016,14 +1109,14 @@ split_node(vbpt_tree_t *tree, vbpt_path_t *path)
 	}
 
 	vbpt_node_t *node = path->nodes[path->height - 1];
-	assert(vref_eqver(node->n_hdr.vref, ver));
+	assert(hdr_private(tree, &node->n_hdr));
 	uint16_t node_slot = path->slots[path->height -1];
 
 	vbpt_node_t *parent = path->nodes[path->height - 2];
-	assert(vref_eqver(parent->n_hdr.vref, ver));
+	assert(hdr_private(tree, &parent->n_hdr));
 	uint16_t parent_slot = path->slots[path->height - 2];
 
-	vbpt_node_t *new = vbpt_node_alloc(VBPT_NODE_SIZE, ver);
+	vbpt_node_t *new = node_alloc_inherit(tree);
 	uint16_t mid = (node->items_nr + 1) / 2;
 
 	/* no need to update references, just memcpy */
@@ -1117,14 +1210,16 @@ try_decrease_height(vbpt_tree_t *tree, vbpt_path_t *path)
 	if (!vbpt_isnode(hdr_next)) // root's item should point to a node
 		return 0;
 
-	assert(vref_eqver(tree->root->n_hdr.vref, tree->ver)); // now COW needed
-	assert(vref_eqver(hdr_next->vref, tree->ver));         // now COW needed
+	assert(vref_eqver(tree->root->n_hdr.vref, tree->ver)); // no COW needed
 
+	// roots always have a version reference. If @next is not private, the
+	// caller needs to COW it.
 	vbpt_node_t *next = hdr2node(hdr_next);
+	vbpt_hdr_vref_set(hdr_next, vref_get__(tree->ver));
 	tree->root = next;
 
 	root->items_nr = 0;
-	vbpt_hdr_putref(&root->n_hdr);
+	vbpt_hdr_putref_tree(tree, &root->n_hdr);
 
 	tree->height--;
 	return 1;
@@ -1134,7 +1229,9 @@ static bool
 cow_needed(vbpt_tree_t *tree, vref_t vref, int op)
 {
 	ver_t *tver = tree->ver;
-	if (op == 0 || vref_eqver(vref, tver))
+	// NULL vrefs have the parent's version, and the parent has already been
+	// COWed if needed
+	if (op == 0 || vref_isnull(vref) || vref_eqver(vref, tver))
 		return false;
 
 	// @ver must be a child of @tver
@@ -1154,7 +1251,8 @@ cow_needed(vbpt_tree_t *tree, vref_t vref, int op)
  * create a chain of nodes, return the head, and add @last_hdr to the last
  * levels. All nodes will be inserted at the first slot using @key
  *
- * Reference of @last_hdr will not be increased
+ * Reference of @last_hdr will not be increased. @last_hdr should have a
+ * version reference (see vbpt_hdr_vref_set())
  */
 vbpt_node_t *
 vbpt_node_chain(vbpt_tree_t *tree, uint16_t levels, uint64_t key,
@@ -1164,7 +1262,7 @@ vbpt_node_chain(vbpt_tree_t *tree, uint16_t levels, uint64_t key,
 	vbpt_node_t *head, *tail;
 	head = tail = vbpt_node_alloc(VBPT_NODE_SIZE, tree->ver);
 	for  (uint16_t i=0; i<levels - 1; i++) {
-		vbpt_node_t *n = vbpt_node_alloc(VBPT_NODE_SIZE, tree->ver);
+		vbpt_node_t *n = node_alloc_inherit(tree);
 		insert_ptr_empty(tail, 0, key, &n->n_hdr);
 		tail = n;
 	}
@@ -1183,7 +1281,7 @@ build_node_chain(vbpt_tree_t *tree, vbpt_path_t *path, uint64_t key)
 	vbpt_node_t *prev = path->nodes[path->height - 1];
 	uint16_t prev_slot = path->slots[path->height - 1];
 	for (uint16_t i=0; i<levels; i++) {
-		vbpt_node_t *n = vbpt_node_alloc(VBPT_NODE_SIZE, tree->ver);
+		vbpt_node_t *n = node_alloc_inherit(tree);
 		vbpt_hdr_t *ret __attribute__((unused));
 		ret = insert_ptr(prev, prev_slot, key, &n->n_hdr);
 		assert(ret == NULL);
@@ -1221,6 +1319,8 @@ vbpt_search(vbpt_tree_t *tree, uint64_t key, int op,
 			if (try_decrease_height(tree, path) == 1) {
 				assert(lvl == 0);
 				node = tree->root;
+				if (cow_needed(tree, node->n_hdr.vref, op))
+					node = cow_root(tree);
 				continue;
 			}
 			try_balance_level(tree, path);
@@ -1260,7 +1360,7 @@ vbpt_search(vbpt_tree_t *tree, uint64_t key, int op,
 			// node with a single element. Balancing is not so good,
 			// but the old structure is maintained.
 			// Note that this can be disabled
-			if (!vref_eqver(l->vref, tree->ver)) {
+			if (!hdr_private(tree, l)) {
 				build_node_chain(tree, path, key);
 				break;
 			}
@@ -1285,12 +1385,12 @@ vbpt_search(vbpt_tree_t *tree, uint64_t key, int op,
 		}
 
 		vbpt_node_t *node_next;
-		if (!cow_needed(tree, hdr_next->vref, op)) {
+		if (!cow_needed(tree, vref_load(&hdr_next->vref), op)) {
 			node_next = hdr2node(hdr_next);
 		} else {
 			node_next = cow_node(tree, node, slot);
 		}
-		assert(!cow_needed(tree, node_next->n_hdr.vref, op));
+		assert(!cow_needed(tree, vref_load(&node_next->n_hdr.vref), op));
 		node = node_next;
 		lvl++;
 	}
@@ -1337,7 +1437,7 @@ vbpt_insert(vbpt_tree_t *tree, uint64_t key, vbpt_leaf_t *data, vbpt_leaf_t **ol
 	if (old_data)
 		*old_data = old ? hdr2leaf(old) : NULL;
 	else if (old != NULL)
-		vbpt_hdr_putref(old);
+		vbpt_hdr_putref_tree(tree, old);
 }
 
 /* a non-static wrapper for delete_ptr() */
@@ -1377,7 +1477,7 @@ end:
 	if (data)
 		*data = ret;
 	else if (ret != NULL)
-		vbpt_leaf_putref(ret);
+		vbpt_hdr_putref_tree(tree, &ret->l_hdr);
 }
 
 /**
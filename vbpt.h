@@ -14,6 +14,15 @@
 #define VBPT_LEAF_SIZE 1024
 #define VBPT_MAX_LEVEL 64
 
+/**
+ * Version reference elision
+ *  Internal nodes that have the same version as their parent are allocated
+ *  with a NULL version reference, and do not hold a version reference. Roots
+ *  and leaves always have a version reference. Use vbpt_hdr_vref() and
+ *  vbpt_path_vref() to get the (effective) version of a node.
+ */
+#define VBPT_VREF_ELIDE
+
 #include <inttypes.h>
 #include <string.h> /* memcpy, memmove */
 
@@ -87,9 +96,10 @@ struct vbpt_leaf {
 typedef struct vbpt_leaf vbpt_leaf_t;
 
 struct vbpt_tree {
-	vbpt_node_t *root; // holds a reference (if not NULL)
+	vbpt_node_t *root; // holds a reference (if not NULL and not borrowed)
 	ver_t *ver;        // holds a reference
 	uint16_t height;
+	bool root_epoch;   // root is borrowed under an epoch (see vbpt_epoch.h)
 };
 typedef struct vbpt_tree vbpt_tree_t;
 
@@ -127,6 +137,8 @@ vbpt_leaf_t *vbpt_leaf_alloc(size_t leaf_size, ver_t *ver);
 // manage trees
 vbpt_tree_t *vbpt_tree_branch(vbpt_tree_t *parent);
 void vbpt_tree_branch_init(vbpt_tree_t *parent, vbpt_tree_t *tree);
+void vbpt_tree_branch_epoch(vbpt_tree_t *parent, vbpt_tree_t *tree);
+void vbpt_tree_root_own(vbpt_tree_t *tree);
 void vbpt_tree_copy(vbpt_tree_t *dest, vbpt_tree_t *src);
 void vbpt_tree_destroy(vbpt_tree_t *dest);
 // operations
@@ -234,6 +246,24 @@ vbpt_hdr_putref(vbpt_hdr_t *hdr)
 	refcnt_dec(&hdr->h_refcnt, vbpt_hdr_release);
 }
 
+/**
+ * put a reference to @hdr, which was just unlinked from a node that is private
+ * to @tree (i.e., it has @tree's version).
+ *  If @hdr is private as well, no other thread can access its refcount before
+ *  @tree is committed, so a non-atomic decrement is sufficient. Committing
+ *  (vbpt_mtree_try_commit*()) publishes the updates when releasing the mtree
+ *  lock.
+ */
+static inline void
+vbpt_hdr_putref_tree(vbpt_tree_t *tree, vbpt_hdr_t *hdr)
+{
+	vref_t vref = vref_load(&hdr->vref);
+	if (vref_isnull(vref) || vref_eqver(vref, tree->ver))
+		refcnt_dec_local(&hdr->h_refcnt, vbpt_hdr_release);
+	else
+		refcnt_dec(&hdr->h_refcnt, vbpt_hdr_release);
+}
+
 static inline void  *
 kvpmove(vbpt_kvp_t *dst, vbpt_kvp_t *src, uint16_t items)
 {
@@ -274,6 +304,22 @@ vbpt_leaf_getref(vbpt_leaf_t *leaf)
 	return leaf;
 }
 
+/**
+ * get a reference to @leaf, to insert it in @tree
+ *  If @leaf has @tree's version, it was allocated by the (uncommitted) owner of
+ *  @tree, so a non-atomic increment is sufficient (see vbpt_hdr_putref_tree()).
+ */
+static inline vbpt_leaf_t *
+vbpt_leaf_getref_tree(vbpt_tree_t *tree, vbpt_leaf_t *leaf)
+{
+	vref_t vref = vref_load(&leaf->l_hdr.vref);
+	if (vref_eqver(vref, tree->ver))
+		refcnt_inc_local(&leaf->l_hdr.h_refcnt);
+	else
+		refcnt_inc(&leaf->l_hdr.h_refcnt);
+	return leaf;
+}
+
 static inline void
 vbpt_leaf_putref__(vbpt_hdr_t *l_hdr)
 {
@@ -303,5 +349,50 @@ vpbt_path_key(vbpt_path_t *path, uint16_t lvl)
 }
 
 
+/**
+ * version reference of @hdr, given the version reference of its parent
+ */
+static inline vref_t
+vbpt_hdr_vref(vbpt_hdr_t *hdr, vref_t parent_vref)
+{
+	vref_t ret = vref_load(&hdr->vref);
+	return vref_isnull(ret) ? parent_vref : ret;
+}
+
+/**
+ * version reference of the node at level @lvl of @path
+ *  nodes with a NULL vref inherit the version of their parent
+ */
+static inline vref_t
+vbpt_path_vref(const vbpt_path_t *path, uint16_t lvl)
+{
+	assert(lvl < path->height);
+	for (;;) {
+		vref_t ret = vref_load(&path->nodes[lvl]->n_hdr.vref);
+		if (!vref_isnull(ret) || lvl == 0) {
+			assert(!vref_isnull(ret));
+			return ret;
+		}
+		lvl--;
+	}
+}
+
+/**
+ * materialize the version reference of @hdr (if it is NULL) to @vref
+ *  This needs to happen before @hdr can be reached via a parent of a different
+ *  version (e.g., when its parent is copied, or when @hdr is moved to another
+ *  tree). It might happen concurrently, see vref_set_null().
+ */
+static inline void
+vbpt_hdr_vref_set(vbpt_hdr_t *hdr, vref_t vref)
+{
+	#if defined(VBPT_VREF_ELIDE)
+	if (!vref_isnull(vref_load(&hdr->vref)))
+		return;
+	vref = vref_dup(vref);
+	if (!vref_set_null(&hdr->vref, vref))
+		vref_put(vref);
+	#endif
+}
 
 #endif /* VBPT_H_ */
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include "misc.h"
+#include "vbpt_epoch.h"
+#include "vbpt_stats.h"
+
+/* epoch-based reclamation (see vbpt_epoch.h) */
+
+struct vbpt_epoch_item {
+	void                  (*ei_fn)(void *);
+	void                   *ei_arg;
+	uint64_t                ei_epoch;
+	struct vbpt_epoch_item *ei_next;
+};
+
+volatile uint64_t VbptEpoch = 0;
+__thread struct vbpt_epoch_thr *VbptEpochThr = NULL;
+
+// retire/reclaim happens once per commit, so a single lock is sufficient
+static pthread_mutex_t         epochLock  = PTHREAD_MUTEX_INITIALIZER;
+static struct vbpt_epoch_thr  *epochThrs  = NULL; // registered threads
+static struct vbpt_epoch_item *epochLimbo = NULL; // retired, newest first
+
+struct vbpt_epoch_thr *
+vbpt_epoch_thr_register(void)
+{
+	struct vbpt_epoch_thr *thr;
+	if (posix_memalign((void **)&thr, sizeof(*thr), sizeof(*thr)) != 0) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	memset(thr, 0, sizeof(*thr));
+
+	pthread_mutex_lock(&epochLock);
+	thr->et_next = epochThrs;
+	epochThrs = thr;
+	pthread_mutex_unlock(&epochLock);
+
+	VbptEpochThr = thr;
+	return thr;
+}
+
+void
+vbpt_epoch_thr_unregister(void)
+{
+	struct vbpt_epoch_thr *thr = VbptEpochThr;
+	if (thr == NULL)
+		return;
+	assert(thr->et_active == 0);
+
+	pthread_mutex_lock(&epochLock);
+	struct vbpt_epoch_thr **tp;
+	for (tp = &epochThrs; *tp != thr; tp = &(*tp)->et_next)
+		assert(*tp != NULL);
+	*tp = thr->et_next;
+	pthread_mutex_unlock(&epochLock);
+
+	free(thr);
+	VbptEpochThr = NULL;
+}
+
+/**
+ * try to advance the global epoch: all active threads need to have observed
+ * the current epoch.
+ *  called with epochLock held
+ */
+static bool
+epoch_try_advance(void)
+{
+	uint64_t e = VbptEpoch;
+	__sync_synchronize();
+	for (struct vbpt_epoch_thr *thr = epochThrs; thr; thr = thr->et_next) {
+		if (thr->et_active && thr->et_epoch != e)
+			return false;
+	}
+	VbptEpoch = e + 1;
+	return true;
+}
+
+/**
+ * detach the retired items that can be released
+ *  called with epochLock held
+ */
+static struct vbpt_epoch_item *
+epoch_collect(void)
+{
+	uint64_t e = VbptEpoch;
+	struct vbpt_epoch_item **ip = &epochLimbo, *ret;
+	while (*ip != NULL && (*ip)->ei_epoch + 2 > e)
+		ip = &(*ip)->ei_next;
+	ret = *ip;
+	*ip = NULL;
+	return ret;
+}
+
+// release items (without holding the lock, since callbacks might retire)
+static void
+epoch_release(struct vbpt_epoch_item *item)
+{
+	while (item != NULL) {
+		struct vbpt_epoch_item *next = item->ei_next;
+		item->ei_fn(item->ei_arg);
+		free(item);
+		VBPT_INC_COUNTER(epoch_reclaimed);
+		item = next;
+	}
+}
+
+/**
+ * retire an object: @fn(@arg) will be called after a grace period
+ */
+void
+vbpt_epoch_retire(void (*fn)(void *), void *arg)
+{
+	struct vbpt_epoch_item *item, *rel;
+	item = xmalloc(sizeof(*item));
+	item->ei_fn = fn;
+	item->ei_arg = arg;
+
+	pthread_mutex_lock(&epochLock);
+	item->ei_epoch = VbptEpoch;
+	item->ei_next = epochLimbo;
+	epochLimbo = item;
+	epoch_try_advance();
+	rel = epoch_collect();
+	pthread_mutex_unlock(&epochLock);
+
+	VBPT_INC_COUNTER(epoch_retired);
+	epoch_release(rel);
+}
+
+/**
+ * release all retired objects, waiting for grace periods as needed
+ *  caller should not be in an epoch
+ */
+void
+vbpt_epoch_drain(void)
+{
+	assert(!vbpt_epoch_active());
+	for (;;) {
+		struct vbpt_epoch_item *rel = NULL;
+		bool empty;
+
+		pthread_mutex_lock(&epochLock);
+		empty = (epochLimbo == NULL);
+		if (!empty) {
+			epoch_try_advance();
+			rel = epoch_collect();
+		}
+		pthread_mutex_unlock(&epochLock);
+
+		if (empty)
+			break;
+		else if (rel)
+			epoch_release(rel);
+		else
+			sched_yield();
+	}
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#ifndef VBPT_EPOCH_H__
+#define VBPT_EPOCH_H__
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <assert.h>
+
+/**
+ * Epoch-based reclamation
+ *
+ * Tree nodes are reference counted. Branching a tree from an mtree, however,
+ * grabs a reference on the root node, and releasing the tree (or COWing the
+ * root) drops it. With many threads, these atomic operations bounce the cache
+ * lines of the root between cores, even though the root is immutable.
+ *
+ * Instead, a thread can borrow the root of a tree by entering an epoch
+ * (vbpt_epoch_enter()), without grabbing a reference. The borrowed root
+ * remains valid until the thread exits the epoch (vbpt_epoch_exit()). A real
+ * reference is only needed when ownership changes: when the root is COWed
+ * (the new root grabs references to the children) and when the tree is
+ * committed. When the mtree tree is replaced, the old tree is not released
+ * directly, but retired via vbpt_epoch_retire(). Retired objects are released
+ * after all threads that were in an epoch when they were retired have exited
+ * it (i.e., after a grace period).
+ *
+ * We use the typical three-epoch scheme: a global epoch, and a local epoch for
+ * each thread, set when entering an epoch. The global epoch is advanced if all
+ * active threads have observed it. Objects retired at epoch e can be released
+ * when the global epoch reaches e + 2.
+ *
+ * Epochs nest (e.g., a thread with two borrowed trees), and they are entered
+ * and exited by the same thread.
+ */
+
+struct vbpt_epoch_thr {
+	volatile uint64_t      et_epoch;  // local epoch
+	volatile unsigned      et_active; // nesting level (0: inactive)
+	struct vbpt_epoch_thr *et_next;
+} __attribute__((aligned(128)));
+
+extern __thread struct vbpt_epoch_thr *VbptEpochThr;
+extern volatile uint64_t VbptEpoch;
+
+struct vbpt_epoch_thr *vbpt_epoch_thr_register(void);
+
+static inline void
+vbpt_epoch_enter(void)
+{
+	struct vbpt_epoch_thr *thr = VbptEpochThr;
+	if (thr == NULL)
+		thr = vbpt_epoch_thr_register();
+
+	if (thr->et_active++ == 0) {
+		thr->et_epoch = VbptEpoch;
+		// the local epoch needs to be visible before we read pointers
+		__sync_synchronize();
+	}
+}
+
+static inline void
+vbpt_epoch_exit(void)
+{
+	struct vbpt_epoch_thr *thr = VbptEpochThr;
+	assert(thr && thr->et_active > 0);
+	// reads need to complete before the thread is seen inactive
+	__asm__ __volatile__("" ::: "memory");
+	thr->et_active--;
+}
+
+static inline bool
+vbpt_epoch_active(void)
+{
+	return VbptEpochThr && VbptEpochThr->et_active > 0;
+}
+
+void vbpt_epoch_retire(void (*fn)(void *), void *arg);
+void vbpt_epoch_drain(void);
+void vbpt_epoch_thr_unregister(void);
+
+#endif /* VBPT_EPOCH_H__ */
@@ -130,6 +130,60 @@ vbpt_logtree_kv_insert(vbpt_tree_t *tree, uint64_t kv_key, uint64_t kv_val)
 }
 
 
+/**
+ * delta operators
+ */
+
+static uint64_t kv_op_add(uint64_t val, uint64_t arg) { return val + arg; }
+static uint64_t kv_op_max(uint64_t val, uint64_t arg) { return val > arg ? val : arg; }
+static uint64_t kv_op_min(uint64_t val, uint64_t arg) { return val < arg ? val : arg; }
+static uint64_t kv_op_or(uint64_t val, uint64_t arg)  { return val | arg; }
+
+static vbpt_kv_op_fn_t kv_ops[VBPT_KV_OPS_MAX] = {
+	[VBPT_KV_OP_ADD] = kv_op_add,
+	[VBPT_KV_OP_MAX] = kv_op_max,
+	[VBPT_KV_OP_MIN] = kv_op_min,
+	[VBPT_KV_OP_OR]  = kv_op_or,
+};
+static unsigned kv_ops_nr = VBPT_KV_OPS_BUILTIN;
+
+int
+vbpt_kv_op_register(vbpt_kv_op_fn_t fn)
+{
+	if (kv_ops_nr == VBPT_KV_OPS_MAX)
+		return -1;
+	kv_ops[kv_ops_nr] = fn;
+	return kv_ops_nr++;
+}
+
+void
+vbpt_kv_delta_apply(vbpt_leaf_t *leaf, const struct vbpt_log_delta *d)
+{
+	assert(d->op < kv_ops_nr && d->idx < vals_per_leaf());
+	uint64_t *val = (uint64_t *)leaf->data + d->idx;
+	*val = kv_ops[d->op](*val, d->arg);
+}
+
+// the leaf is not read, so it is not added to the read set
+void
+vbpt_logtree_kv_delta(vbpt_tree_t *tree, uint64_t kv_key,
+                      uint32_t op, uint64_t arg)
+{
+	uint64_t key = kv_key / vals_per_leaf();
+	uint64_t idx = kv_key % vals_per_leaf();
+
+	vbpt_leaf_t *leaf = vbpt_get(tree, key);
+	vbpt_leaf_t *new  = cow_leaf_maybe(tree->ver, leaf);
+	if (new != leaf) {
+		vbpt_logtree_insert(tree, key, new, NULL);
+		leaf = new;
+	}
+
+	vbpt_log_t *log = vbpt_tree_log(tree);
+	vbpt_log_delta(log, key, idx, op, arg);
+	vbpt_kv_delta_apply(leaf, log->deltas.d + log->deltas.nr - 1);
+}
+
 uint64_t
 vbpt_logtree_kv_get(vbpt_tree_t *tree, uint64_t kv_key)
 {
@@ -32,4 +32,37 @@ uint64_t vbpt_logtree_kv_get(vbpt_tree_t *tree, uint64_t key);
 void     vbpt_logtree_kv_insert(vbpt_tree_t *tree,
                                 uint64_t kv_key, uint64_t kv_val);
 
+/**
+ * Delta operators
+ *
+ * A delta updates a value as val = op(val, arg), without the transaction
+ * reading it. Operators need to be commutative, so that concurrent deltas on
+ * the same value can be merged by applying them in any order (see
+ * do_merge()). Besides the builtin operators, custom ones can be registered
+ * (before any transactions are started).
+ *
+ * Deltas should not be mixed with blind writes (vbpt_logtree_insert() without
+ * getting the old value) on the same leaf within a transaction.
+ */
+enum {
+	VBPT_KV_OP_ADD = 0,
+	VBPT_KV_OP_MAX,
+	VBPT_KV_OP_MIN,
+	VBPT_KV_OP_OR,
+	VBPT_KV_OPS_BUILTIN
+};
+#define VBPT_KV_OPS_MAX 16
+
+typedef uint64_t (*vbpt_kv_op_fn_t)(uint64_t val, uint64_t arg);
+
+// returns the id of the operator, or -1 if there is no more room
+int  vbpt_kv_op_register(vbpt_kv_op_fn_t fn);
+
+void vbpt_logtree_kv_delta(vbpt_tree_t *tree,
+                           uint64_t kv_key, uint32_t op, uint64_t arg);
+
+// apply delta @d on @leaf
+struct vbpt_log_delta;
+void vbpt_kv_delta_apply(vbpt_leaf_t *leaf, const struct vbpt_log_delta *d);
+
 #endif
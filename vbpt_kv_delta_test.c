@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "ver.h"
+#include "vbpt.h"
+#include "vbpt_mm.h"
+#include "vbpt_log.h"
+#include "vbpt_kv.h"
+#include "vbpt_mtree.h"
+#include "vbpt_tx.h"
+#include "vbpt_stats.h"
+#include "vbpt_test.h"
+
+// test delta merging: concurrent transactions apply deltas on the same
+// counters. All of them should commit, and the counters should have the
+// combined result. A transaction that reads a counter should still conflict.
+
+#define NTXS      8
+#define NCOUNTERS 4
+
+int main(int argc, const char *argv[])
+{
+	vbpt_mm_init();
+	vbpt_stats_init();
+
+	vbpt_tree_t *tree = vbpt_tree_create();
+	for (uint64_t k=0; k<=NCOUNTERS; k++) // NCOUNTERS is the max value
+		vbpt_kv_insert(tree, k, 0);
+	vbpt_mtree_t *mtree = vbpt_mtree_alloc(tree);
+
+	// all transactions branch off the same version before any commits
+	vbpt_txtree_t *txs[NTXS];
+	for (unsigned i=0; i<NTXS; i++) {
+		txs[i] = vbpt_txtree_alloc(mtree);
+		for (uint64_t k=0; k<NCOUNTERS; k++)
+			vbpt_logtree_kv_delta(txs[i]->tree, k, VBPT_KV_OP_ADD, k+1);
+		vbpt_logtree_kv_delta(txs[i]->tree, NCOUNTERS, VBPT_KV_OP_MAX, i);
+		vbpt_logtree_finalize(txs[i]->tree);
+	}
+	for (unsigned i=0; i<NTXS; i++) {
+		vbpt_txt_res_t ret = vbpt_txt_try_commit(txs[i], mtree, 1);
+		if (ret != (i == 0 ? VBPT_COMMIT_OK : VBPT_COMMIT_MERGED)) {
+			fprintf(stderr, "tx %u: %s\n", i, vbpt_txt_res2str[ret]);
+			abort();
+		}
+	}
+
+	for (uint64_t k=0; k<NCOUNTERS; k++) {
+		uint64_t val = vbpt_mtree_kv_get(mtree, k);
+		if (val != NTXS*(k+1)) {
+			fprintf(stderr, "counter %" PRIu64 ": %" PRIu64
+			        " expected:%" PRIu64 "\n", k, val, NTXS*(k+1));
+			abort();
+		}
+	}
+	if (vbpt_mtree_kv_get(mtree, NCOUNTERS) != NTXS - 1) {
+		fprintf(stderr, "max: %" PRIu64 "\n",
+		        vbpt_mtree_kv_get(mtree, NCOUNTERS));
+		abort();
+	}
+
+	// reading the counter should conflict
+	vbpt_txtree_t *txa = vbpt_txtree_alloc(mtree);
+	vbpt_txtree_t *txb = vbpt_txtree_alloc(mtree);
+	vbpt_logtree_kv_delta(txa->tree, 0, VBPT_KV_OP_ADD, 1);
+	uint64_t v = vbpt_logtree_kv_get(txb->tree, 0);
+	vbpt_logtree_kv_insert(txb->tree, 0, v + 1);
+	vbpt_logtree_finalize(txa->tree);
+	vbpt_logtree_finalize(txb->tree);
+	if (vbpt_txt_try_commit(txa, mtree, 0) != VBPT_COMMIT_OK)
+		abort();
+	if (vbpt_txt_try_commit(txb, mtree, 1) != VBPT_COMMIT_MERGE_FAILED) {
+		fprintf(stderr, "read of a counter did not conflict\n");
+		abort();
+	}
+
+	vbpt_mtree_dealloc(mtree, &tree);
+	vbpt_tree_dealloc(tree);
+	printf("DONE\n");
+	return 0;
+}
@@ -67,6 +67,8 @@ vbpt_log_init(vbpt_log_t *log)
 	pset_init(&log->rd_set, 8);
 	pset_init(&log->rm_set, 8);
 	phash_init(&log->wr_set, 8);
+	vbpt_log_deltas_init(&log->deltas);
+	log->iso = VBPT_LOG_ISO_SERIALIZABLE;
 }
 
 vbpt_log_t *
@@ -92,6 +94,7 @@ vbpt_log_destroy(vbpt_log_t *log)
 	pset_tfree(&log->rd_set);
 	pset_tfree(&log->rm_set);
 	phash_tfree(&log->wr_set);
+	vbpt_log_deltas_destroy(&log->deltas);
 }
 
 void
@@ -141,16 +144,27 @@ vbpt_log_delete(vbpt_log_t *log, uint64_t key)
  * perform queries on logs
  */
 
-static inline size_t
-vbpt_log_rd_size(vbpt_log_t *log)
+size_t
+vbpt_log_rd_size(vbpt_log_t *log, unsigned depth)
 {
-	return pset_elements(&log->rd_set);
+	size_t ret = 0;
+	for (unsigned i=0; i<depth; i++) {
+		ret += pset_elements(&log->rd_set);
+		log = vbpt_log_parent(log);
+	}
+	return ret;
 }
 
-static inline size_t
-vbpt_log_wr_size(vbpt_log_t *log)
+size_t
+vbpt_log_wr_size(vbpt_log_t *log, unsigned depth)
 {
-	return phash_elements(&log->wr_set);
+	size_t ret = 0;
+	for (unsigned i=0; i<depth; i++) {
+		ret += phash_elements(&log->wr_set);
+		ret += pset_elements(&log->rm_set);
+		log = vbpt_log_parent(log);
+	}
+	return ret;
 }
 
 bool
@@ -226,11 +240,8 @@ vbpt_log_ds_range_exists(vbpt_log_t *log, vbpt_range_t *r, unsigned depth)
 
 bool
 vbpt_log_conflict(vbpt_log_t *log1_rd, unsigned depth1,
-                  vbpt_log_t *log2_wr, unsigned depth2)
+                  vbpt_log_t *log2_wr, unsigned depth2, uint64_t *key_ret)
 {
-	if (vbpt_log_wr_size(log2_wr) == 0 || vbpt_log_rd_size(log1_rd) == 0)
-		return false;
-
 	for (unsigned i=0; i<depth1; i++) {
 		pset_t *rd_set = &log1_rd->rd_set;
 		pset_iter_t pi;
@@ -238,8 +249,12 @@ vbpt_log_conflict(vbpt_log_t *log1_rd, unsigned depth1,
 		while (true) {
 			ul_t key;
 			if (pset_iterate(rd_set, &pi, &key)) {
-				if (!vbpt_log_ws_key_exists(log2_wr, key, depth2))
+				if (vbpt_log_ws_key_exists(log2_wr, key, depth2) ||
+				    vbpt_log_ds_key_exists(log2_wr, key, depth2)) {
+					if (key_ret)
+						*key_ret = key;
 					return true;
+				}
 			} else break;
 		}
 		log1_rd = vbpt_log_parent(log1_rd);
@@ -248,10 +263,17 @@ vbpt_log_conflict(vbpt_log_t *log1_rd, unsigned depth1,
 	return false;
 }
 
+bool
+vbpt_log_replayable(vbpt_log_t *log, unsigned depth)
+{
+	// replaying the leafs of deltas would overwrite concurrent deltas
+	return !vbpt_log_deltas_exist(log, depth);
+}
+
 void
 vbpt_log_replay__(vbpt_tree_t *tree, vbpt_log_t *log)
 {
-	if (vbpt_log_wr_size(log) == 0)
+	if (phash_elements(&log->wr_set) == 0)
 		return;
 
 	phash_t *wr_set = &log->wr_set;
@@ -264,9 +286,10 @@ vbpt_log_replay__(vbpt_tree_t *tree, vbpt_log_t *log)
 			vbpt_leaf_t *leaf = (vbpt_leaf_t *)val;
 			assert(leaf == NULL || leaf->l_hdr.type == VBPT_LEAF);
 			if (leaf)
-				vbpt_logtree_insert(tree, key, leaf, NULL);
+				vbpt_insert(tree, key,
+				            vbpt_leaf_getref_tree(tree, leaf), NULL);
 			else
-				vbpt_logtree_delete(tree, key, NULL);
+				vbpt_delete(tree, key, NULL);
 		} else
 			break;
 	}
@@ -39,6 +39,22 @@ void vbpt_log_finalize(vbpt_log_t *log);
 void vbpt_log_destroy(vbpt_log_t *log); // destroy a log (pairs with _init)
 void vbpt_log_dealloc(vbpt_log_t *log); // deallocate a log (pairs with _alloc)
 
+// set the isolation level of a (started) log: should be called before any
+// operation is recorded
+static inline void
+vbpt_log_set_iso(vbpt_log_t *log, unsigned iso)
+{
+	assert(log->state == VBPT_LOG_STARTED);
+	log->iso = iso;
+}
+
+// does the log record a snapshot isolation transaction (no reads are logged)?
+static inline bool
+vbpt_log_si(const vbpt_log_t *log)
+{
+	return log->iso == VBPT_LOG_ISO_SNAPSHOT;
+}
+
 // query the log:
 //  to allow for different implementations for the logs, we specify that query
 //  functions can return false positives (e.g., so that they can be implemented
@@ -55,6 +71,70 @@ bool vbpt_log_ws_range_exists(vbpt_log_t *log, vbpt_range_t *r, unsigned depth);
 bool vbpt_log_ds_key_exists(vbpt_log_t *log, uint64_t key, unsigned depth);
 bool vbpt_log_ds_range_exists(vbpt_log_t *log, vbpt_range_t *r, unsigned depth);
 
+// size of the read set, and of the write set (including deletions), for the
+// @depth logs. Similarly to the checks, these can be over-estimations.
+size_t vbpt_log_rd_size(vbpt_log_t *log, unsigned depth);
+size_t vbpt_log_wr_size(vbpt_log_t *log, unsigned depth);
+
+/*
+ * deltas (common for all log implementations)
+ */
+
+static inline void
+vbpt_log_deltas_init(struct vbpt_log_deltas *ds)
+{
+	ds->nr = ds->size = 0;
+	ds->d = NULL;
+}
+
+static inline void
+vbpt_log_deltas_destroy(struct vbpt_log_deltas *ds)
+{
+	free(ds->d);
+	ds->d = NULL;
+}
+
+// record a delta (@op, @arg) for the @idx value of the leaf at @key
+static inline void
+vbpt_log_delta(vbpt_log_t *log, uint64_t key, uint32_t idx,
+               uint32_t op, uint64_t arg)
+{
+	struct vbpt_log_deltas *ds = &log->deltas;
+	assert(log->state == VBPT_LOG_STARTED);
+	if (ds->nr == ds->size) {
+		ds->size = ds->size ? 2*ds->size : 8;
+		ds->d = xrealloc(ds->d, ds->size*sizeof(struct vbpt_log_delta));
+	}
+	struct vbpt_log_delta *d = ds->d + ds->nr++;
+	d->key = key;
+	d->idx = idx;
+	d->op  = op;
+	d->arg = arg;
+}
+
+static inline bool
+vbpt_log_deltas_exist(vbpt_log_t *log, unsigned depth)
+{
+	for (unsigned i=0; i<depth; i++) {
+		if (log->deltas.nr > 0)
+			return true;
+		log = vbpt_log_parent(log);
+	}
+	return false;
+}
+
+static inline bool
+vbpt_log_deltas_key_exists(vbpt_log_t *log, uint64_t key, unsigned depth)
+{
+	for (unsigned i=0; i<depth; i++) {
+		for (uint32_t j=0; j<log->deltas.nr; j++)
+			if (log->deltas.d[j].key == key)
+				return true;
+		log = vbpt_log_parent(log);
+	}
+	return false;
+}
+
 /*
  * logtree: operations on trees that are recorded on logs
  *  The functions are just wrappers that use "hidden" log on version.
@@ -113,7 +193,7 @@ vbpt_logtree_insert(vbpt_tree_t *t,  uint64_t k, vbpt_leaf_t *l, vbpt_leaf_t **o
 {
 	VBPT_START_TIMER(logtree_insert);
 	vbpt_log_t *log = vbpt_tree_log(t);
-	if (o)
+	if (o && !vbpt_log_si(log))
 		vbpt_log_read(log, k);
 	vbpt_log_write(log, k, l);
 	vbpt_insert(t, k, l, o);
@@ -124,7 +204,7 @@ static inline void
 vbpt_logtree_delete(vbpt_tree_t *t, uint64_t k, vbpt_leaf_t **o)
 {
 	vbpt_log_t *log = vbpt_tree_log(t);
-	if (o)
+	if (o && !vbpt_log_si(log))
 		vbpt_log_read(log, k);
 	vbpt_log_delete(log, k);
 	vbpt_delete(t, k, o);
@@ -135,7 +215,8 @@ vbpt_logtree_get(vbpt_tree_t  *t, uint64_t k)
 {
 	VBPT_START_TIMER(logtree_get);
 	vbpt_log_t *log = vbpt_tree_log(t);
-	vbpt_log_read(log, k);
+	if (!vbpt_log_si(log))
+		vbpt_log_read(log, k);
 	vbpt_leaf_t *ret = vbpt_get(t, k);
 	VBPT_STOP_TIMER(logtree_get);
 	return ret;
@@ -147,10 +228,16 @@ vbpt_logtree_get(vbpt_tree_t  *t, uint64_t k)
  * high-level operations
  */
 
+// do the reads of @log1_rd conflict with the writes/deletes of @log2_wr?
+//  if @key is not NULL, it is set to a conflicting key (for backends that keep
+//  ranges, the first key of the conflicting read range)
 bool vbpt_log_conflict(vbpt_log_t *log1_rd, unsigned depth1,
-                       vbpt_log_t *log2_wr, unsigned depth2);
+                       vbpt_log_t *log2_wr, unsigned depth2, uint64_t *key);
 
-void vbpt_log_replay(vbpt_tree_t *txt, vbpt_log_t *log, unsigned log_depth);
+// can the operations of the log be replayed?
+bool vbpt_log_replayable(vbpt_log_t *log, unsigned log_depth);
+// replay the log's operations on @tree
+void vbpt_log_replay(vbpt_tree_t *tree, vbpt_log_t *log, unsigned log_depth);
 
 
 #endif
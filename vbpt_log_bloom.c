@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h> /* uintptr_t */
+
+#include "vbpt_log.h"
+#include "vbpt_merge.h" // vbpt_range_t
+
+#include "misc.h"
+
+#if !defined(VBPT_LOG_BLOOM)
+#error ""
+#endif
+
+// for short ranges, probe the filter for each key
+#define VBPT_LOG_BLOOM_PROBE 16
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+void
+vbpt_log_init(vbpt_log_t *log)
+{
+	assert(log->state == VBPT_LOG_UNINITIALIZED);
+	log->state = VBPT_LOG_STARTED;
+	memset(&log->rd_set, 0, sizeof(log->rd_set));
+	memset(&log->rm_set, 0, sizeof(log->rm_set));
+	memset(&log->wr_set, 0, sizeof(log->wr_set));
+	vbpt_log_deltas_init(&log->deltas);
+	log->iso = VBPT_LOG_ISO_SERIALIZABLE;
+}
+
+vbpt_log_t *
+vbpt_log_alloc(void)
+{
+	vbpt_log_t *ret = xmalloc(sizeof(vbpt_log_t));
+	ret->state = VBPT_LOG_UNINITIALIZED;
+	vbpt_log_init(ret);
+	return ret;
+}
+
+void
+vbpt_log_finalize(vbpt_log_t *log)
+{
+	assert(log->state == VBPT_LOG_STARTED);
+	log->state = VBPT_LOG_FINALIZED;
+}
+
+void
+vbpt_log_destroy(vbpt_log_t *log)
+{
+	assert(log->state == VBPT_LOG_FINALIZED);
+	vbpt_log_deltas_destroy(&log->deltas);
+}
+
+void
+vbpt_log_dealloc(vbpt_log_t *log)
+{
+	vbpt_log_destroy(log);
+	free(log);
+}
+
+/*
+ * bloom sets
+ */
+
+// mix the key bits (splitmix64 finalizer)
+static inline uint64_t
+vbpt_log_bset_hash(uint64_t key)
+{
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebULL;
+	key ^= key >> 31;
+	return key;
+}
+
+/**
+ * compute the word and the bit mask of @key
+ *  the word is taken from the high bits of the hash, and the bits from 6-bit
+ *  chunks of it. Chunks that collide are skipped (rehashing if needed), so that
+ *  each key sets exactly K distinct bits (see vbpt_log_bset_intersects_bset()).
+ */
+static inline uint64_t
+vbpt_log_bset_mask(uint64_t key, unsigned *word)
+{
+	uint64_t h = vbpt_log_bset_hash(key);
+	*word = (h >> 32) % VBPT_LOG_BLOOM_WORDS;
+
+	uint64_t mask = 0;
+	for (unsigned i=0; __builtin_popcountll(mask) < VBPT_LOG_BLOOM_K; i++) {
+		// a hash has 10 6-bit chunks. The hash of 0 is 0, so add the
+		// (splitmix64) increment before rehashing.
+		if (i > 0 && i % 10 == 0)
+			h = vbpt_log_bset_hash(h + 0x9e3779b97f4a7c15ULL);
+		mask |= 1ULL << ((h >> (6*(i % 10))) & 63);
+	}
+	return mask;
+}
+
+static inline bool
+vbpt_log_bset_probe(const struct vbpt_log_bset *s, uint64_t key)
+{
+	unsigned w;
+	uint64_t mask = vbpt_log_bset_mask(key, &w);
+	return (s->bits[w] & mask) == mask;
+}
+
+static void
+vbpt_log_bset_add(struct vbpt_log_bset *s, uint64_t key)
+{
+	unsigned w;
+	uint64_t mask = vbpt_log_bset_mask(key, &w);
+	// even if the bits of @key are already set, the summary range needs to
+	// include it, since it is checked before the filter
+	s->bits[w] |= mask;
+	if (s->nr++ == 0) {
+		s->first = s->last = key;
+	} else {
+		s->first = MIN(s->first, key);
+		s->last  = MAX(s->last, key);
+	}
+}
+
+static inline bool
+vbpt_log_bset_contains(const struct vbpt_log_bset *s, uint64_t key)
+{
+	if (s->nr == 0 || key < s->first || key > s->last)
+		return false;
+	return vbpt_log_bset_probe(s, key);
+}
+
+static bool
+vbpt_log_bset_intersects(const struct vbpt_log_bset *s, const vbpt_range_t *r)
+{
+	assert(r->len > 0);
+	if (s->nr == 0)
+		return false;
+
+	uint64_t first = MAX(s->first, r->key);
+	uint64_t last  = MIN(s->last, r->key + r->len - 1);
+	if (first > last)
+		return false;
+	if (last - first >= VBPT_LOG_BLOOM_PROBE)
+		return true;
+
+	for (uint64_t k = first; ; k++) {
+		if (vbpt_log_bset_probe(s, k))
+			return true;
+		if (k == last)
+			break;
+	}
+	return false;
+}
+
+/**
+ * check if two sets (might) have a common key
+ *  A common key sets the same K (distinct) bits on the same word of both
+ *  filters. The filters do not keep the keys, so if @key is not NULL it is set
+ *  to the first key of the common range of the two sets.
+ */
+static bool
+vbpt_log_bset_intersects_bset(const struct vbpt_log_bset *s1,
+                              const struct vbpt_log_bset *s2, uint64_t *key)
+{
+	if (s1->nr == 0 || s2->nr == 0)
+		return false;
+	if (s1->last < s2->first || s2->last < s1->first)
+		return false;
+
+	bool ret = false;
+	for (unsigned i=0; i<VBPT_LOG_BLOOM_WORDS; i++)
+		ret |= __builtin_popcountll(s1->bits[i] & s2->bits[i])
+		       >= VBPT_LOG_BLOOM_K;
+	if (ret && key)
+		*key = MAX(s1->first, s2->first);
+	return ret;
+}
+
+/*
+ * log actions
+ */
+void
+vbpt_log_write(vbpt_log_t *log, uint64_t key, vbpt_leaf_t *leaf)
+{
+	assert(log->state == VBPT_LOG_STARTED);
+	vbpt_log_bset_add(&log->wr_set, key);
+}
+
+void
+vbpt_log_read(vbpt_log_t *log, uint64_t key)
+{
+	assert(log->state == VBPT_LOG_STARTED);
+	vbpt_log_bset_add(&log->rd_set, key);
+}
+
+void
+vbpt_log_delete(vbpt_log_t *log, uint64_t key)
+{
+	assert(log->state == VBPT_LOG_STARTED);
+	vbpt_log_bset_add(&log->rm_set, key);
+}
+
+/*
+ * perform queries on logs
+ */
+
+// write set (ws) checks
+bool
+vbpt_log_ws_key_exists(vbpt_log_t *log, uint64_t key, unsigned depth)
+{
+	for (unsigned i=0; i<depth; i++) {
+		if (vbpt_log_bset_contains(&log->wr_set, key))
+			return true;
+		log = vbpt_log_parent(log);
+		assert(log != NULL);
+	}
+	return false;
+}
+
+bool
+vbpt_log_ws_range_exists(vbpt_log_t *log, vbpt_range_t *r, unsigned depth)
+{
+	for (unsigned i=0; i<depth; i++) {
+		if (vbpt_log_bset_intersects(&log->wr_set, r))
+			return true;
+		log = vbpt_log_parent(log);
+		assert(log != NULL);
+	}
+	return false;
+}
+
+// read set (rs) checks
+bool
+vbpt_log_rs_key_exists(vbpt_log_t *log, uint64_t key, unsigned depth)
+{
+	for (unsigned i=0; i<depth; i++) {
+		if (vbpt_log_bset_contains(&log->rd_set, key))
+			return true;
+		log = vbpt_log_parent(log);
+		assert(log != NULL);
+	}
+	return false;
+}
+
+bool
+vbpt_log_rs_range_exists(vbpt_log_t *log, vbpt_range_t *r, unsigned depth)
+{
+	for (unsigned i=0; i<depth; i++) {
+		if (vbpt_log_bset_intersects(&log->rd_set, r))
+			return true;
+		log = vbpt_log_parent(log);
+		assert(log != NULL);
+	}
+	return false;
+}
+
+// delete set (ds) checks
+bool
+vbpt_log_ds_key_exists(vbpt_log_t *log, uint64_t key, unsigned depth)
+{
+	for (unsigned i=0; i<depth; i++) {
+		if (vbpt_log_bset_contains(&log->rm_set, key))
+			return true;
+		log = vbpt_log_parent(log);
+		assert(log != NULL);
+	}
+	return false;
+}
+
+bool
+vbpt_log_ds_range_exists(vbpt_log_t *log, vbpt_range_t *r, unsigned depth)
+{
+	for (unsigned i=0; i<depth; i++) {
+		if (vbpt_log_bset_intersects(&log->rm_set, r))
+			return true;
+		log = vbpt_log_parent(log);
+		assert(log != NULL);
+	}
+	return false;
+}
+
+// sizes
+size_t
+vbpt_log_rd_size(vbpt_log_t *log, unsigned depth)
+{
+	size_t ret = 0;
+	for (unsigned i=0; i<depth; i++) {
+		ret += log->rd_set.nr;
+		log = vbpt_log_parent(log);
+	}
+	return ret;
+}
+
+size_t
+vbpt_log_wr_size(vbpt_log_t *log, unsigned depth)
+{
+	size_t ret = 0;
+	for (unsigned i=0; i<depth; i++) {
+		ret += log->wr_set.nr + log->rm_set.nr;
+		log = vbpt_log_parent(log);
+	}
+	return ret;
+}
+
+/*
+ * log replay functions
+ */
+
+bool
+vbpt_log_conflict(vbpt_log_t *log1_rd, unsigned depth1,
+                  vbpt_log_t *log2_wr, unsigned depth2, uint64_t *key)
+{
+	for (unsigned i=0; i<depth1; i++) {
+		const struct vbpt_log_bset *rd = &log1_rd->rd_set;
+		vbpt_log_t *log2 = log2_wr;
+		for (unsigned j=0; rd->nr > 0 && j<depth2; j++) {
+			if (vbpt_log_bset_intersects_bset(rd, &log2->wr_set, key) ||
+			    vbpt_log_bset_intersects_bset(rd, &log2->rm_set, key))
+				return true;
+			log2 = vbpt_log_parent(log2);
+			assert(log2 != NULL);
+		}
+		log1_rd = vbpt_log_parent(log1_rd);
+		assert(log1_rd != NULL);
+	}
+	return false;
+}
+
+// the filters do not keep the keys, so there is nothing to replay
+bool
+vbpt_log_replayable(vbpt_log_t *log, unsigned depth)
+{
+	return false;
+}
+
+void
+vbpt_log_replay(vbpt_tree_t *tree, vbpt_log_t *log, unsigned depth)
+{
+	fprintf(stderr, "%s: bloom logs cannot be replayed\n", __FUNCTION__);
+	abort();
+}
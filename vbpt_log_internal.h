@@ -32,6 +32,35 @@ enum {
 	VBPT_LOG_FINALIZED     = 2,
 };
 
+/**
+ * Isolation levels (vbpt_log_set_iso()). Under snapshot isolation, reads are
+ * not logged, and the merge only detects write-write and write-delete
+ * conflicts (see do_merge()).
+ */
+enum {
+	VBPT_LOG_ISO_SERIALIZABLE = 0,
+	VBPT_LOG_ISO_SNAPSHOT     = 1,
+};
+
+/**
+ * Deltas: commutative updates (e.g., counter increments) on the values of
+ * key-value leafs (see vbpt_logtree_kv_delta()). Deltas are kept by all log
+ * implementations. A transaction that only applies deltas on a leaf, without
+ * reading it, does not conflict with concurrent changes of the leaf: the merge
+ * re-applies the deltas on the global leaf instead (see do_merge()).
+ */
+struct vbpt_log_delta {
+	uint64_t key;  // tree key of the leaf
+	uint64_t arg;
+	uint32_t idx;  // index of the value in the leaf
+	uint32_t op;   // operator (see vbpt_kv.h)
+};
+
+struct vbpt_log_deltas {
+	uint32_t              nr, size;
+	struct vbpt_log_delta *d; // allocated on the first delta
+};
+
 #if defined(VBPT_LOG_PHASH)
 /**
  * vbpt_log: log for changes in an object
@@ -39,17 +68,84 @@ enum {
 #include "phash.h"
 struct vbpt_log {
 	unsigned state;
+	unsigned iso;
 	pset_t   rd_set;
 	pset_t   rm_set;
 	phash_t  wr_set;
+	struct vbpt_log_deltas deltas;
 };
 #elif defined(VBPT_LOG_RANGE)
 #include "vbpt_range.h"
+
+/**
+ * Each set is described by (at most) VBPT_LOG_RSET_MAX disjoint key intervals,
+ * sorted by key. When a key does not fit in the existing intervals and there is
+ * no room for a new one, the two neighbouring intervals with the smallest gap
+ * are merged. Intervals are kept in a struct of arrays, with inclusive bounds,
+ * so that checks can be done with simple loops over the arrays (which the
+ * compiler can vectorize). VBPT_LOG_RSET_MAX = 1 is a single [min, max] range.
+ */
+#define VBPT_LOG_RSET_MAX 8
+
+struct vbpt_log_rset {
+	uint16_t nr;
+	uint64_t first[VBPT_LOG_RSET_MAX];
+	uint64_t last[VBPT_LOG_RSET_MAX];
+};
+
+/**
+ * Besides the ranges, the log keeps the write/delete operations (one per key,
+ * the last one), so that small transactions can be replayed (see
+ * vbpt_log_replay()). If more than VBPT_LOG_OPS_MAX keys are modified, the
+ * operations are dropped (ops_nr = VBPT_LOG_OPS_NONE) and the log can't be
+ * replayed. Setting VBPT_LOG_OPS_MAX to 0 disables keeping operations.
+ *
+ * Leafs are not referenced: they are valid as long as the log's tree is.
+ */
+#define VBPT_LOG_OPS_MAX  32
+#define VBPT_LOG_OPS_NONE ((uint16_t)~0)
+
+struct vbpt_log_op {
+	uint64_t         key;
+	struct vbpt_leaf *leaf; // NULL for deletions
+};
+
+struct vbpt_log {
+	unsigned state;
+	unsigned iso;
+	struct vbpt_log_rset rd_set;
+	struct vbpt_log_rset rm_set;
+	struct vbpt_log_rset wr_set;
+	uint16_t           ops_nr;
+	struct vbpt_log_op *ops; // allocated on the first operation
+	struct vbpt_log_deltas deltas;
+};
+#elif defined(VBPT_LOG_BLOOM)
+
+/**
+ * Hybrid log: each set is a blocked bloom filter, combined with a summary
+ * range ([first, last]) of its keys. A key maps to VBPT_LOG_BLOOM_K bits of a
+ * single 64-bit word of the filter, so checking a key is a single memory
+ * access. Range checks use the summary, and, for short ranges, probe the filter
+ * for each key. The log has a fixed size, independently of the number of keys,
+ * at the cost of more false positives for large transactions.
+ */
+#define VBPT_LOG_BLOOM_WORDS 32 // 2048 bits per set
+#define VBPT_LOG_BLOOM_K     3
+
+struct vbpt_log_bset {
+	uint64_t first, last;
+	uint64_t nr;  // (approximate) number of keys, 0 if the set is empty
+	uint64_t bits[VBPT_LOG_BLOOM_WORDS];
+};
+
 struct vbpt_log {
 	unsigned state;
-	vbpt_range_t rd_range;
-	vbpt_range_t rm_range;
-	vbpt_range_t wr_range;
+	unsigned iso;
+	struct vbpt_log_bset rd_set;
+	struct vbpt_log_bset rm_set;
+	struct vbpt_log_bset wr_set;
+	struct vbpt_log_deltas deltas;
 };
 #endif
 
@@ -9,6 +9,7 @@
  */
 
 #include <stdbool.h>
+#include <string.h>
 #include <inttypes.h> /* uintptr_t */
 
 #include "vbpt_range.h"
@@ -22,10 +23,8 @@
 #endif
 
 /**
- * NB: We are using vbpt_range for maintaining log sets. vbpt_range.h cod
- * assumes non-empty ranges, but here a log set described by a range with ->len
- * = 0 is considered empty. Hence we have to check if a log is empty before
- * passing it to a vbpt_range function.
+ * NB: Log sets are interval sets (struct vbpt_log_rset), while queries use
+ * vbpt_range (key, len). Query ranges are assumed to be non-empty.
  */
 
 void
@@ -33,7 +32,11 @@ vbpt_log_init(vbpt_log_t *log)
 {
 	assert(log->state == VBPT_LOG_UNINITIALIZED);
 	log->state = VBPT_LOG_STARTED;
-	log->rd_range.len = log->rm_range.len = log->wr_range.len = 0;
+	log->rd_set.nr = log->rm_set.nr = log->wr_set.nr = 0;
+	log->ops_nr = 0;
+	log->ops = NULL;
+	vbpt_log_deltas_init(&log->deltas);
+	log->iso = VBPT_LOG_ISO_SERIALIZABLE;
 }
 
 vbpt_log_t *
@@ -56,31 +59,186 @@ void
 vbpt_log_destroy(vbpt_log_t *log)
 {
 	assert(log->state == VBPT_LOG_FINALIZED);
+	free(log->ops);
+	log->ops = NULL;
+	vbpt_log_deltas_destroy(&log->deltas);
 }
 
 void
 vbpt_log_dealloc(vbpt_log_t *log)
 {
+	vbpt_log_destroy(log);
 	free(log);
 }
 
 
+/*
+ * interval sets
+ */
+
+static void
+vbpt_log_rset_remove(struct vbpt_log_rset *s, uint16_t i)
+{
+	size_t n = s->nr - i - 1;
+	memmove(s->first + i, s->first + i + 1, n*sizeof(uint64_t));
+	memmove(s->last + i,  s->last + i + 1,  n*sizeof(uint64_t));
+	s->nr--;
+}
+
+/**
+ * find the two neighbouring intervals with the smallest gap
+ *  returns the index of the first, and sets @gap
+ */
+static uint16_t
+vbpt_log_rset_closest(const struct vbpt_log_rset *s, uint64_t *gap)
+{
+	uint16_t j_min = 0;
+	uint64_t gap_min = UINT64_MAX;
+	for (uint16_t j=0; j+1 < s->nr; j++) {
+		uint64_t g = s->first[j+1] - s->last[j];
+		if (g < gap_min) {
+			gap_min = g;
+			j_min = j;
+		}
+	}
+	*gap = gap_min;
+	return j_min;
+}
+
 static void
-vbpt_range_add(vbpt_range_t *range, uint64_t key)
+vbpt_log_rset_add(struct vbpt_log_rset *s, uint64_t key)
 {
-	if (range->len == 0) {
-		range->key = key;
-		range->len = 1;
+	uint16_t i;
+	// find the first interval that ends at, or after, @key
+	for (i=0; i < s->nr && s->last[i] < key; i++)
+		;
+	if (i < s->nr && s->first[i] <= key)
+		return;
+
+	// NB: no overflows: if i > 0, last[i-1] < key, if i < nr, first[i] > key
+	bool adj_l = (i > 0)     && (s->last[i-1] + 1 == key);
+	bool adj_r = (i < s->nr) && (s->first[i] - 1 == key);
+	if (adj_l && adj_r) {
+		s->last[i-1] = s->last[i];
+		vbpt_log_rset_remove(s, i);
+		return;
+	} else if (adj_l) {
+		s->last[i-1] = key;
+		return;
+	} else if (adj_r) {
+		s->first[i] = key;
 		return;
 	}
 
-	if (key < range->key) {
-		uint64_t d = range->key - key;
-		range->len += d;
-		range->key = key;
-	} else if (key >= range->key + range->len) {
-		range->len += key - (range->key + range->len - 1);
+	if (s->nr == VBPT_LOG_RSET_MAX) {
+		// no room: either extend a neighbour to @key, or merge the two
+		// closest intervals to make room, whatever adds fewer keys
+		uint64_t gap_l = (i > 0)     ? key - s->last[i-1] : UINT64_MAX;
+		uint64_t gap_r = (i < s->nr) ? s->first[i] - key  : UINT64_MAX;
+		uint64_t gap_m;
+		uint16_t j = vbpt_log_rset_closest(s, &gap_m);
+		if (gap_l <= gap_r && gap_l <= gap_m) {
+			s->last[i-1] = key;
+			return;
+		} else if (gap_r <= gap_m) {
+			s->first[i] = key;
+			return;
+		}
+		// merge intervals j, j+1. @key lies outside them, since its
+		// gaps are larger.
+		s->last[j] = s->last[j+1];
+		vbpt_log_rset_remove(s, j + 1);
+		if (i > j)
+			i--;
+	}
+
+	size_t n = s->nr - i;
+	memmove(s->first + i + 1, s->first + i, n*sizeof(uint64_t));
+	memmove(s->last + i + 1,  s->last + i,  n*sizeof(uint64_t));
+	s->first[i] = s->last[i] = key;
+	s->nr++;
+}
+
+// the checks below are branch-free over the intervals, so they can be
+// vectorized
+
+static inline bool
+vbpt_log_rset_contains(const struct vbpt_log_rset *s, uint64_t key)
+{
+	bool ret = false;
+	for (uint16_t i=0; i < s->nr; i++)
+		ret |= (key - s->first[i] <= s->last[i] - s->first[i]);
+	return ret;
+}
+
+static inline bool
+vbpt_log_rset_intersects__(const struct vbpt_log_rset *s,
+                           uint64_t first, uint64_t last)
+{
+	bool ret = false;
+	for (uint16_t i=0; i < s->nr; i++)
+		ret |= (s->first[i] <= last) & (first <= s->last[i]);
+	return ret;
+}
+
+static inline bool
+vbpt_log_rset_intersects(const struct vbpt_log_rset *s, const vbpt_range_t *r)
+{
+	assert(r->len > 0);
+	return vbpt_log_rset_intersects__(s, r->key, r->key + r->len - 1);
+}
+
+// if not NULL, @key is set to the first key of the range of @s1 that intersects
+static bool
+vbpt_log_rset_intersects_rset(const struct vbpt_log_rset *s1,
+                              const struct vbpt_log_rset *s2, uint64_t *key)
+{
+	for (uint16_t i=0; i < s1->nr; i++) {
+		if (vbpt_log_rset_intersects__(s2, s1->first[i], s1->last[i])) {
+			if (key)
+				*key = s1->first[i];
+			return true;
+		}
 	}
+	return false;
+}
+
+static size_t
+vbpt_log_rset_size(const struct vbpt_log_rset *s)
+{
+	size_t ret = 0;
+	for (uint16_t i=0; i < s->nr; i++)
+		ret += s->last[i] - s->first[i] + 1;
+	return ret;
+}
+
+/**
+ * record an operation for replay
+ *  if @key already has an operation, it is replaced
+ */
+static void
+vbpt_log_op_add(vbpt_log_t *log, uint64_t key, vbpt_leaf_t *leaf)
+{
+	if (log->ops_nr == VBPT_LOG_OPS_NONE)
+		return;
+
+	for (uint16_t i=0; i<log->ops_nr; i++) {
+		if (log->ops[i].key == key) {
+			log->ops[i].leaf = leaf;
+			return;
+		}
+	}
+
+	if (log->ops_nr == VBPT_LOG_OPS_MAX) {
+		log->ops_nr = VBPT_LOG_OPS_NONE;
+		return;
+	}
+
+	if (log->ops == NULL)
+		log->ops = xmalloc(VBPT_LOG_OPS_MAX*sizeof(struct vbpt_log_op));
+	log->ops[log->ops_nr].key  = key;
+	log->ops[log->ops_nr].leaf = leaf;
+	log->ops_nr++;
 }
 
 /*
@@ -90,48 +248,46 @@ void
 vbpt_log_write(vbpt_log_t *log, uint64_t key, vbpt_leaf_t *leaf)
 {
 	assert(log->state == VBPT_LOG_STARTED);
-	vbpt_range_add(&log->wr_range, key);
+	vbpt_log_rset_add(&log->wr_set, key);
+	vbpt_log_op_add(log, key, leaf);
 }
 
 void
 vbpt_log_read(vbpt_log_t *log, uint64_t key)
 {
 	assert(log->state == VBPT_LOG_STARTED);
-	vbpt_range_add(&log->rd_range, key);
+	vbpt_log_rset_add(&log->rd_set, key);
 }
 
 void
 vbpt_log_delete(vbpt_log_t *log, uint64_t key)
 {
 	assert(log->state == VBPT_LOG_STARTED);
-	vbpt_range_add(&log->rm_range, key);
+	vbpt_log_rset_add(&log->rm_set, key);
+	vbpt_log_op_add(log, key, NULL);
 }
 
 /*
  * perform queries on logs
  */
 
-static bool
-vbpt_log_range_contains(const vbpt_range_t *r1, uint64_t key)
-{
-	if (r1->len == 0)
-		return false;
-	return vbpt_range_contains(r1, key);
-}
-
-static inline bool
-vbpt_log_range_intersects(const vbpt_range_t *r1, const vbpt_range_t *r2)
+bool
+vbpt_log_ws_key_exists(vbpt_log_t *log, uint64_t key, unsigned depth)
 {
-	if (r1->len == 0 || r2->len == 0)
-		return false;
-	return vbpt_range_intersects(r1, r2);
+	for (unsigned i=0; i<depth; i++) {
+		if (vbpt_log_rset_contains(&log->wr_set, key))
+			return true;
+		log = vbpt_log_parent(log);
+		assert(log != NULL);
+	}
+	return false;
 }
 
 bool
-vbpt_log_ws_key_exists(vbpt_log_t *log, uint64_t key, unsigned depth)
+vbpt_log_ws_range_exists(vbpt_log_t *log, vbpt_range_t *r, unsigned depth)
 {
 	for (unsigned i=0; i<depth; i++) {
-		if (vbpt_log_range_contains(&log->wr_range, key))
+		if (vbpt_log_rset_intersects(&log->wr_set, r))
 			return true;
 		log = vbpt_log_parent(log);
 		assert(log != NULL);
@@ -140,12 +296,39 @@ vbpt_log_ws_key_exists(vbpt_log_t *log, uint64_t key, unsigned depth)
 }
 
 
+// sizes: if the operations are not kept, we use the intervals' lengths
+size_t
+vbpt_log_rd_size(vbpt_log_t *log, unsigned depth)
+{
+	size_t ret = 0;
+	for (unsigned i=0; i<depth; i++) {
+		ret += vbpt_log_rset_size(&log->rd_set);
+		log = vbpt_log_parent(log);
+	}
+	return ret;
+}
+
+size_t
+vbpt_log_wr_size(vbpt_log_t *log, unsigned depth)
+{
+	size_t ret = 0;
+	for (unsigned i=0; i<depth; i++) {
+		if (log->ops_nr != VBPT_LOG_OPS_NONE)
+			ret += log->ops_nr;
+		else
+			ret += vbpt_log_rset_size(&log->wr_set)
+			       + vbpt_log_rset_size(&log->rm_set);
+		log = vbpt_log_parent(log);
+	}
+	return ret;
+}
+
 // read set (rs) checks
 bool
 vbpt_log_rs_key_exists(vbpt_log_t *log, uint64_t key, unsigned depth)
 {
 	for (unsigned i=0; i<depth; i++) {
-		if (vbpt_log_range_contains(&log->rd_range, key))
+		if (vbpt_log_rset_contains(&log->rd_set, key))
 			return true;
 		log = vbpt_log_parent(log);
 		assert(log != NULL);
@@ -157,7 +340,7 @@ bool
 vbpt_log_rs_range_exists(vbpt_log_t *log, vbpt_range_t *r, unsigned depth)
 {
 	for (unsigned i=0; i<depth; i++) {
-		if (vbpt_log_range_intersects(&log->rd_range, r))
+		if (vbpt_log_rset_intersects(&log->rd_set, r))
 			return true;
 		log = vbpt_log_parent(log);
 		assert(log != NULL);
@@ -170,7 +353,7 @@ bool
 vbpt_log_ds_key_exists(vbpt_log_t *log, uint64_t key, unsigned depth)
 {
 	for (unsigned i=0; i<depth; i++) {
-		if (vbpt_log_range_contains(&log->rm_range, key))
+		if (vbpt_log_rset_contains(&log->rm_set, key))
 			return true;
 		log = vbpt_log_parent(log);
 		assert(log != NULL);
@@ -182,7 +365,7 @@ bool
 vbpt_log_ds_range_exists(vbpt_log_t *log, vbpt_range_t *r, unsigned depth)
 {
 	for (unsigned i=0; i<depth; i++) {
-		if (vbpt_log_range_intersects(&log->rm_range, r))
+		if (vbpt_log_rset_intersects(&log->rm_set, r))
 			return true;
 		log = vbpt_log_parent(log);
 		assert(log != NULL);
@@ -196,17 +379,80 @@ vbpt_log_ds_range_exists(vbpt_log_t *log, vbpt_range_t *r, unsigned depth)
  * log replay functions
  */
 
+/**
+ * check if the reads of @log1_rd conflict with the writes (or deletes) of
+ * @log2_wr
+ */
 bool
 vbpt_log_conflict(vbpt_log_t *log1_rd, unsigned depth1,
-                  vbpt_log_t *log2_wr, unsigned depth2)
+                  vbpt_log_t *log2_wr, unsigned depth2, uint64_t *key)
+{
+	for (unsigned i=0; i<depth1; i++) {
+		const struct vbpt_log_rset *rd = &log1_rd->rd_set;
+		vbpt_log_t *log2 = log2_wr;
+		for (unsigned j=0; rd->nr > 0 && j<depth2; j++) {
+			if (vbpt_log_rset_intersects_rset(rd, &log2->wr_set, key) ||
+			    vbpt_log_rset_intersects_rset(rd, &log2->rm_set, key))
+				return true;
+			log2 = vbpt_log_parent(log2);
+			assert(log2 != NULL);
+		}
+		log1_rd = vbpt_log_parent(log1_rd);
+		assert(log1_rd != NULL);
+	}
+	return false;
+}
+
+// replaying the leafs of deltas would overwrite concurrent deltas
+bool
+vbpt_log_replayable(vbpt_log_t *log, unsigned depth)
+{
+	for (unsigned i=0; i<depth; i++) {
+		if (log->ops_nr == VBPT_LOG_OPS_NONE || log->deltas.nr > 0)
+			return false;
+		log = vbpt_log_parent(log);
+		assert(log != NULL);
+	}
+	return true;
+}
+
+static void
+vbpt_log_replay__(vbpt_tree_t *tree, struct vbpt_log_op *op)
 {
-	fprintf(stderr, ":%s NOT SUPPORTED\n", __FUNCTION__);
-	exit(1);
+	if (op->leaf)
+		vbpt_insert(tree, op->key, vbpt_leaf_getref_tree(tree, op->leaf),
+		            NULL);
+	else
+		vbpt_delete(tree, op->key, NULL);
 }
 
+/**
+ * apply the operations of @log (and its @depth - 1 ancestors) to @tree
+ *  The leafs are those of the log's tree, so it should be still valid.
+ *  If a key was modified in multiple logs, only the newest operation is
+ *  applied (older leafs might no longer be valid).
+ */
 void
 vbpt_log_replay(vbpt_tree_t *tree, vbpt_log_t *log, unsigned depth)
 {
-	fprintf(stderr, ":%s NOT SUPPORTED\n", __FUNCTION__);
-	exit(1);
+	assert(vbpt_log_replayable(log, depth));
+	assert(depth <= VER_JOIN_LIMIT);
+	uint64_t keys[depth*VBPT_LOG_OPS_MAX];
+	unsigned keys_nr = 0;
+
+	for (unsigned i=0; i<depth; i++) {
+		for (uint16_t j=0; j<log->ops_nr; j++) {
+			struct vbpt_log_op *op = log->ops + j;
+			bool newer = false;
+			for (unsigned k=0; k<keys_nr && !newer; k++)
+				newer = (keys[k] == op->key);
+			if (newer)
+				continue;
+			vbpt_log_replay__(tree, op);
+			// no need to remember the keys of the oldest log
+			if (i + 1 < depth)
+				keys[keys_nr++] = op->key;
+		}
+		log = vbpt_log_parent(log);
+	}
 }
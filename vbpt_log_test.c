@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "ver.h"
+#include "vbpt.h"
+#include "vbpt_mm.h"
+#include "vbpt_log.h"
+#include "vbpt_mtree.h"
+#include "vbpt_tx.h"
+#include "vbpt_stats.h"
+#include "vbpt_test.h"
+
+// test the log backends for false negatives: a read of a key that a
+// concurrent transaction wrote should always be detected, both when
+// validating and when merging. Approximate logs (e.g., VBPT_LOG_BLOOM) are
+// allowed false positives, but not false negatives. The reads of the
+// transactions include a range of other keys, so that the bits of the
+// checked key might already be set in the filter.
+
+#define NKEYS       2048
+#define RANGE_START 1000
+#define RANGE_LEN   100
+#define WRITE_KEY   (NKEYS - 1)
+
+static vbpt_txtree_t *
+reader_tx(vbpt_mtree_t *mtree, uint64_t key)
+{
+	vbpt_txtree_t *txt = vbpt_txtree_alloc(mtree);
+	for (uint64_t k=RANGE_START; k<RANGE_START + RANGE_LEN; k++)
+		vbpt_logtree_get(txt->tree, k);
+	vbpt_logtree_get(txt->tree, key);
+	vbpt_txt_write_val(txt, WRITE_KEY, key);
+	return txt;
+}
+
+static void
+writer_tx(vbpt_mtree_t *mtree, uint64_t key)
+{
+	vbpt_txtree_t *txt = vbpt_txtree_alloc(mtree);
+	vbpt_txt_write_val(txt, key, key + 1);
+	vbpt_txt_commit_expect(txt, mtree, 0, VBPT_COMMIT_OK);
+}
+
+int main(int argc, const char *argv[])
+{
+	vbpt_mm_init();
+	vbpt_stats_init();
+
+	vbpt_tree_t *tree = vbpt_tree_create_seq(NKEYS);
+	vbpt_mtree_t *mtree = vbpt_mtree_alloc(tree);
+
+	for (uint64_t key=0; key<RANGE_START; key++) {
+		vbpt_txtree_t *txt = reader_tx(mtree, key);
+		writer_tx(mtree, key);
+		// vbpt_log_conflict()
+		if (vbpt_txt_validate(txt, mtree)) {
+			fprintf(stderr, "validation: conflict on key %" PRIu64
+			        " not detected\n", key);
+			abort();
+		}
+		// read set checks of the merge
+		vbpt_txt_commit_expect(txt, mtree, 1, VBPT_COMMIT_MERGE_FAILED);
+	}
+
+	vbpt_mtree_dealloc(mtree, NULL);
+	printf("DONE\n");
+	return 0;
+}
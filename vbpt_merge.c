@@ -12,12 +12,18 @@
 #include "vbpt.h"
 #include "vbpt_merge.h"
 #include "vbpt_log.h"
+#include "vbpt_mm.h"
 #include "vbpt_tx.h"
+#include "vbpt_kv.h"
 
 #include "misc.h"
 #include "tsc.h"
 
+#include <pthread.h>
+#include <string.h>
+
 #define VBPT_KEY_MAX UINT64_MAX
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
 
 //#define XDEBUG_MERGE
 
@@ -134,6 +140,8 @@ vbpt_cur_free(vbpt_cur_t *cur)
  *  Note that NULL areas have the vref of the last node in the tree. This is a
  *  bit conservative because we can't distinguish if the NULL range was there
  *  before the last node's version or not.
+ *
+ *  Nodes with a NULL vref have the version of their parent (VBPT_VREF_ELIDE)
  */
 vref_t
 vbpt_cur_vref(const vbpt_cur_t *cur)
@@ -142,11 +150,13 @@ vbpt_cur_vref(const vbpt_cur_t *cur)
 	const vbpt_tree_t *tree = cur->tree;
 	if (path->height == 0) {
 		return vref_get__(tree->ver);
-	} else if (!vbpt_cur_null(cur)) {
-		return vbpt_cur_hdr((vbpt_cur_t *)cur)->vref;
+	}
+
+	vref_t pvref = vbpt_path_vref(path, path->height - 1);
+	if (!vbpt_cur_null(cur)) {
+		return vbpt_hdr_vref(vbpt_cur_hdr((vbpt_cur_t *)cur), pvref);
 	} else { // cursor points to NULL, return the version of the last node
-		vbpt_node_t *pnode = path->nodes[path->height -1];
-		return pnode->n_hdr.vref;
+		return pvref;
 	}
 }
 
@@ -528,7 +538,7 @@ vbpt_cur_mark_delete(vbpt_cur_t *c, ver_t *jv, uint16_t p_dist)
 
 	// Is COW needed? (parent has to be strictly after jv)
 	// TODO: verify this is correct via a test/better rationale
-	vref_t pvref = pnode->n_hdr.vref;
+	vref_t pvref = vbpt_path_vref(path, path->height - 1);
 	if (vref_ancestor_limit(pvref, jv, p_dist)) {
 		return -1;
 	}
@@ -605,6 +615,42 @@ struct vbpt_merge {
 	uint16_t g_dist;
 };
 
+/**
+ * set up @join for merging @pt with @gt, given their join point @vj and the
+ * distances from it. Only @p_dist versions are walked, to find ->hpver. If the
+ * distances are not consistent with @vj, ->vj is set to VER_JOIN_FAIL.
+ */
+static void
+merge_join_vj(struct vbpt_merge *join,
+              const vbpt_tree_t *gt, const vbpt_tree_t *pt,
+              ver_t *vj, uint16_t g_dist, uint16_t p_dist)
+{
+	join->gver   = gt->ver;
+	join->pver   = pt->ver;
+	join->vj     = vj;
+	join->g_dist = g_dist;
+	join->p_dist = p_dist;
+
+	join->hpver = join->pver;
+	for (uint16_t i=1; i<p_dist && join->hpver != NULL; i++)
+		join->hpver = join->hpver->parent;
+
+	if (g_dist == 0 || g_dist == VER_DIST_FAIL || p_dist == 0 ||
+	    join->hpver == NULL || join->hpver->parent != vj) {
+		join->vj = VER_JOIN_FAIL;
+	}
+
+	#if !defined(NDEBUG)
+	if (join->vj != VER_JOIN_FAIL) {
+		ver_t *hpver;
+		uint16_t gd, pd;
+		ver_t *vj_ = ver_join(join->gver, join->pver, &hpver, &gd, &pd);
+		assert(vj_ == vj && hpver == join->hpver);
+		assert(gd == g_dist && pd == p_dist);
+	}
+	#endif
+}
+
 /**
  * try to replace node pointed by @pc with node pointed by @gc, knowing that @gc
  * does not point to null
@@ -645,20 +691,27 @@ vbpt_cur_do_replace(vbpt_cur_t *pc, const vbpt_cur_t *gc,
 
 	vbpt_node_t *p_pnode;
 	uint16_t     p_pslot;
+	vref_t       p_pvref;
 	if (pc->path.height == 0) {
-		// we are at the end, we need to add a new item to the root node
+		// we are past the last key of the root: add a new item at the
+		// end of the root node, if @g_hdr can be placed directly under
+		// it (i.e., without a new root, or a chain of nodes)
+		assert(vbpt_cur_null(pc));
+		if (g_height + 1 != p_height)
+			return false;
 		p_pnode = pc->tree->root;
-		p_pslot = pc->tree->root->items_nr;
-		p_height = 0;
+		p_pslot = p_pnode->items_nr;
+		p_pvref = p_pnode->n_hdr.vref;
+		p_height = g_height;
 	} else {
 		p_pnode = pc->path.nodes[pc->path.height - 1];
 		p_pslot = pc->path.slots[pc->path.height - 1];
+		p_pvref = vbpt_path_vref(&pc->path, pc->path.height - 1);
 	}
 
 	// we are going to modify p_pnode, check if COW is needed
 	// (parent has to be strictly after vj)
 	// TODO: verify this is correct via a test/better rationale
-	vref_t p_pvref = p_pnode->n_hdr.vref;
 	if (!vref_ancestor_limit(p_pvref, merge.pver, merge.p_dist-1)) {
 		return false;
 	}
@@ -672,7 +725,7 @@ vbpt_cur_do_replace(vbpt_cur_t *pc, const vbpt_cur_t *gc,
 			return false;
 		}
 		// slot should be OK
-	} else if (pc->path.height != 0) {
+	} else {
 		p_hdr = vbpt_cur_hdr(pc);
 	}
 
@@ -689,6 +742,8 @@ vbpt_cur_do_replace(vbpt_cur_t *pc, const vbpt_cur_t *gc,
 	#endif
 
 	assert(g_hdr != p_hdr);
+	// @g_hdr is going to be placed under a node of a different version
+	vbpt_hdr_vref_set(g_hdr, vbpt_cur_vref(gc));
 	vbpt_hdr_t *new_hdr = vbpt_hdr_getref(g_hdr);
 	if (p_height > g_height) { // add a sufficiently large chain of nodes
 		uint16_t levels = p_height - g_height;
@@ -706,12 +761,12 @@ vbpt_cur_do_replace(vbpt_cur_t *pc, const vbpt_cur_t *gc,
 		//VBPT_MERGE_STOP_TIMER(cur_do_replace_putref);
 	} else {
 		assert(vbpt_cur_null(pc));
-		if (pc->path.height != 0) {
-			pc->null_maxkey = 0;
-			pc->flags.null = 0;
-		} else {
-			assert(false && "Need to fix the path?");
-			abort();
+		pc->null_maxkey = 0;
+		pc->flags.null = 0;
+		if (pc->path.height == 0) { // point to the new item of the root
+			pc->path.nodes[0] = p_pnode;
+			pc->path.slots[0] = p_pslot;
+			pc->path.height = 1;
 		}
 	}
 
@@ -760,28 +815,136 @@ vbpt_cmp(vbpt_tree_t *t1, vbpt_tree_t *t2)
 	return ret;
 }
 
+// record a conflict of @range in the heat map, and return -1
+static inline int
+merge_conflict(const vbpt_range_t *range, enum vbpt_merge_conflict reason)
+{
+	VBPT_MERGE_HEAT_INC(range->key, reason);
+	return -1;
+}
+
 /**
- * merge @ptree with @gtree -> result in @ptree
+ * perform the log merge (see vbpt_log_merge())
+ *  @join: the join information
  */
-bool
-vbpt_log_merge(vbpt_tree_t *gtree, vbpt_tree_t *ptree)
+static bool
+log_merge_run(const vbpt_tree_t *gtree, vbpt_tree_t *ptree, ver_t **vbase,
+              const struct vbpt_merge *join)
 {
-	vbpt_log_t *g_log = vbpt_tree_log(gtree);
+	ver_t *gver = join->gver;
+	ver_t *hpver = join->hpver;
+	uint16_t g_dist = join->g_dist, p_dist = join->p_dist;
+	vbpt_log_t *g_log = vbpt_tree_log((vbpt_tree_t *)gtree);
 	vbpt_log_t *p_log = vbpt_tree_log(ptree);
 
-	uint16_t g_dist, p_dist;
-	ver_t *hpver = NULL; // initialize to shut the compiler up
-	ver_join(gtree->ver, ptree->ver, &hpver, &g_dist, &p_dist);
+	uint64_t key;
+	if (join->vj == VER_JOIN_FAIL) {
+		VBPT_MERGE_INC_COUNTER(join_failed);
+		goto fail;
+	}
+	if (vbpt_log_si(p_log) || !vbpt_log_replayable(p_log, p_dist))
+		goto fail;
+	if (vbpt_log_conflict(p_log, p_dist, g_log, g_dist, &key)) {
+		merge_conflict(&(vbpt_range_t){.key = key, .len = 1},
+		               VBPT_MERGE_CONFLICT_LOG);
+		goto fail;
+	}
+
+	// @pold keeps the leafs referenced by the log alive during replay
+	vbpt_tree_t pold = *ptree;
+	ptree->root = gtree->root ? vbpt_node_getref(gtree->root) : NULL;
+	ptree->height = gtree->height;
+	ptree->root_epoch = false;
+	vbpt_log_replay(ptree, p_log, p_dist);
+	ver_getref(pold.ver); // vbpt_tree_destroy() puts a version reference
+	vbpt_tree_destroy(&pold);
+
+	assert(!ver_chain_has_branch(join->pver, hpver));
+	ver_rebase_commit(hpver, gver);
+	if (vbase)
+		*vbase = gver;
+	return true;
+fail:
+	ver_rebase_abort(gver);
+	return false;
+}
+
+/**
+ * merge @ptree with @gtree -> result in @ptree, by replaying @ptree's log
+ *
+ * Instead of walking the two trees (see vbpt_merge()), @ptree's contents are
+ * replaced with @gtree's, and the operations of the logs from @pver to the join
+ * point are replayed on top. This is cheap for small transactions, but
+ * requires that the logs have kept their operations (vbpt_log_replayable()).
+ *
+ * There is a conflict if @ptree read something that @gtree changed after the
+ * join point. Snapshot isolation logs are not supported, since they have no
+ * reads to check. Same as vbpt_merge(), versions are rebased on success, and
+ * @ptree is invalid on failure.
+ */
+bool
+vbpt_log_merge(const vbpt_tree_t *gtree, vbpt_tree_t *ptree, ver_t **vbase)
+{
+	struct vbpt_merge join;
+	join.gver = gtree->ver;
+	join.pver = ptree->ver;
+	join.hpver = NULL; // initialize to shut the compiler up
+	join.vj = ver_join(join.gver, join.pver, &join.hpver,
+	                   &join.g_dist, &join.p_dist);
+	return log_merge_run(gtree, ptree, vbase, &join);
+}
+
+/**
+ * same as vbpt_log_merge(), when the join point is already known
+ *  (see vbpt_merge_vj())
+ */
+bool
+vbpt_log_merge_vj(const vbpt_tree_t *gtree, vbpt_tree_t *ptree, ver_t **vbase,
+                  ver_t *vj, uint16_t g_dist, uint16_t p_dist)
+{
+	struct vbpt_merge join;
+	merge_join_vj(&join, gtree, ptree, vj, g_dist, p_dist);
+	return log_merge_run(gtree, ptree, vbase, &join);
+}
+
+/**
+ * merge the leaf pointed by @pc, on which the private tree applied deltas, with
+ * the leaf pointed by @gc: copy @gc's values, and re-apply the deltas of the
+ * private logs on them (oldest first)
+ *  @pc's leaf was created by the private tree, so we modify it in-place
+ */
+static bool
+vbpt_cur_merge_deltas(vbpt_cur_t *pc, const vbpt_cur_t *gc,
+                      struct vbpt_merge merge)
+{
+	vbpt_hdr_t *p_hdr = vbpt_cur_hdr(pc);
+	vbpt_hdr_t *g_hdr = vbpt_cur_hdr((vbpt_cur_t *)gc);
+	if (p_hdr->type != VBPT_LEAF || g_hdr->type != VBPT_LEAF)
+		return false;
 
-	if (vbpt_log_conflict(g_log, g_dist, p_log, p_dist)) {
-		printf("%s => CONFLICT\n", __FUNCTION__);
+	vbpt_leaf_t *p_leaf = hdr2leaf(p_hdr);
+	vbpt_leaf_t *g_leaf = hdr2leaf(g_hdr);
+	if (refcnt_get(&p_hdr->h_refcnt) != 1 ||
+	    p_leaf->d_total_len != g_leaf->d_total_len)
 		return false;
+	memcpy(p_leaf->data, g_leaf->data, p_leaf->d_total_len);
+
+	vbpt_log_t *logs[merge.p_dist];
+	logs[0] = vbpt_tree_log(pc->tree);
+	for (uint16_t i=1; i<merge.p_dist; i++)
+		logs[i] = vbpt_log_parent(logs[i-1]);
+
+	uint64_t key = pc->range.key;
+	for (uint16_t i=merge.p_dist; i-- > 0; ) {
+		struct vbpt_log_deltas *ds = &logs[i]->deltas;
+		for (uint32_t j=0; j<ds->nr; j++)
+			if (ds->d[j].key == key)
+				vbpt_kv_delta_apply(p_leaf, ds->d + j);
 	}
-	vbpt_log_replay(ptree, g_log, g_dist);
+	VBPT_MERGE_INC_COUNTER(deltas_merged);
 	return true;
 }
 
-
 /**
  * helper function for merging when cursors are at the same range
  *  see vbpt_merge() for more details
@@ -807,6 +970,14 @@ do_merge(const vbpt_cur_t *gc, vbpt_cur_t *pc,
 	#endif
 	assert(merge.g_dist > 0);
 	assert(merge.p_dist > 0);
+
+	// the two trees share the node: none of them changed it
+	if (!vbpt_cur_null(gc) && !vbpt_cur_null(pc) && pc->path.height > 0 &&
+	    vbpt_cur_hdr((vbpt_cur_t *)gc) == vbpt_cur_hdr(pc)) {
+		VBPT_MERGE_INC_COUNTER(gc_old);
+		return 1;
+	}
+
 	vbpt_log_t *plog = vbpt_tree_log(ptree);
 	vbpt_log_t *glog = vbpt_tree_log((vbpt_tree_t *)gtree);
 	vbpt_range_t *range = &pc->range;
@@ -846,12 +1017,15 @@ do_merge(const vbpt_cur_t *gc, vbpt_cur_t *pc,
 		// current (changed in the global tree) range. If it did,
 		// it would read an older value, so we need to abort.
 		if (vbpt_log_rs_range_exists(plog, range, merge.p_dist)) {
-			return -1;
+			return merge_conflict(range, VBPT_MERGE_CONFLICT_RS);
 		}
 		//assert(pc_v != gc_v);
 		// we need to effectively replace the node pointed by @pv with
 		// the node pointed by @gc
-		return vbpt_cur_replace(pc, gc, merge) ? 1: -1;
+		if (!vbpt_cur_replace(pc, gc, merge))
+			return merge_conflict(range,
+			                      VBPT_MERGE_CONFLICT_REPLACE);
+		return 1;
 	}
 
 	/*
@@ -883,9 +1057,10 @@ do_merge(const vbpt_cur_t *gc, vbpt_cur_t *pc,
 		// read an item from the previous state, which may not have been
 		// NULL.  We could also check whether @glog contains a delete to
 		// that range.
-		return vbpt_log_rs_range_exists(plog,
-		                                range,
-		                                merge.p_dist) ? -1 : 1;
+		if (vbpt_log_rs_range_exists(plog, range, merge.p_dist))
+			return merge_conflict(range,
+			                      VBPT_MERGE_CONFLICT_BOTH_NULL);
+		return 1;
 	} else if (vbpt_cur_null(pc)) {
 		VBPT_MERGE_INC_COUNTER(pc_null);
 		#if defined(XDEBUG_MERGE)
@@ -893,12 +1068,15 @@ do_merge(const vbpt_cur_t *gc, vbpt_cur_t *pc,
 		#endif
 		// @pc points to NULL, but @gc does not. If @pv did not read or
 		// delete anything in that range, we can replace @pc with @gc.
-		if (vbpt_log_rs_range_exists(plog, range, merge.p_dist))
-			return -1;
-		if (vbpt_log_ds_range_exists(plog, range, merge.p_dist))
-			return -1;
+		if (vbpt_log_rs_range_exists(plog, range, merge.p_dist) ||
+		    vbpt_log_ds_range_exists(plog, range, merge.p_dist))
+			return merge_conflict(range,
+			                      VBPT_MERGE_CONFLICT_PC_NULL);
 		//printf("trying to replace pc with gc\n");
-		return vbpt_cur_replace(pc, gc, merge) ? 1: -1;
+		if (!vbpt_cur_replace(pc, gc, merge))
+			return merge_conflict(range,
+			                      VBPT_MERGE_CONFLICT_REPLACE);
+		return 1;
 	} else if (vbpt_cur_null(gc)) {
 		VBPT_MERGE_INC_COUNTER(gc_null);
 		#if defined(XDEBUG_MERGE)
@@ -918,26 +1096,179 @@ do_merge(const vbpt_cur_t *gc, vbpt_cur_t *pc,
 		}
 
 		// special case: this is a leaf that we now has changed after
-		// @vj -- we just keep it similarly to leaf checks
-		if (range->len == 1 &&
+		// @vj -- we just keep it similarly to leaf checks. Under
+		// snapshot isolation, this is a write-delete conflict.
+		if (range->len == 1 && !vbpt_log_si(plog) &&
 		    !vbpt_log_rs_key_exists(plog, range->key, merge.p_dist))
 			return 1;
 
 		//printf("gc is null, I ran out of options\n");
-		return -1;
+		return merge_conflict(range, VBPT_MERGE_CONFLICT_GC_NULL);
 	}
 
 	assert(!vbpt_cur_null(gc) && !vbpt_cur_null(pc));
 	if (range->len == 1) {
-		return vbpt_log_rs_key_exists(plog,
-		                              range->key,
-		                              merge.p_dist) ? -1 : 1;
+		if (vbpt_log_rs_key_exists(plog, range->key, merge.p_dist))
+			return merge_conflict(range,
+			                      VBPT_MERGE_CONFLICT_LEAF_RS);
+		// the private tree did not read the leaf: if it applied deltas
+		// on it, combine them with the global leaf's changes
+		if (vbpt_log_deltas_key_exists(plog, range->key, merge.p_dist))
+			return vbpt_cur_merge_deltas(pc, gc, merge) ? 1 :
+			       merge_conflict(range,
+			                      VBPT_MERGE_CONFLICT_DELTAS);
+		// under snapshot isolation, both trees writing the leaf is a
+		// (write-write) conflict
+		if (vbpt_log_si(plog))
+			return merge_conflict(range, VBPT_MERGE_CONFLICT_WW);
+		return 1;
 	}
 
 	/* we need to go deeper */
 	return 0;
 }
 
+/**
+ * Subtree swap
+ *
+ * When the two trees changed disjoint subtrees (e.g., transactions that modify
+ * different key ranges), merging amounts to placing the subtrees that changed
+ * in @gtree into @ptree. merge_swap() does this top-down, before the cursor
+ * walk of merge_run(): it visits only node pairs that both trees changed, and
+ * compares their child pointers directly, applying the rules of do_merge()
+ * without the cursor machinery (vbpt_cur_sync(), vbpt_cur_next()). It
+ * descends only into node pairs with the same keys. Children it can not
+ * handle (node pairs with different keys, leafs with deltas) are left for the
+ * cursor walk, which skips the subtrees that merge_swap() has already
+ * swapped, since they are shared by the two trees.
+ */
+enum {
+	MERGE_SWAP_CONFLICT = -1,  // as merge_conflict() returns
+	MERGE_SWAP_DONE,           // merge completed
+	MERGE_SWAP_PARTIAL,        // the cursor walk completes the merge
+};
+
+/**
+ * swap the children of @pn that changed only in @gn
+ *  @g_vref, @p_vref: version references of @gn, @pn
+ *  @key, @end:       the range of the two nodes is [@key, @end)
+ */
+static int
+merge_swap_node(const vbpt_node_t *gn, vbpt_node_t *pn,
+                vref_t g_vref, vref_t p_vref, uint64_t key, uint64_t end,
+                vbpt_log_t *plog, const struct vbpt_merge *merge)
+{
+	uint16_t nr = pn->items_nr;
+	if (nr == 0 || gn->items_nr != nr)
+		return MERGE_SWAP_PARTIAL;
+	for (uint16_t i=0; i<nr; i++) {
+		if (gn->kvp[i].key != pn->kvp[i].key)
+			return MERGE_SWAP_PARTIAL;
+	}
+	// we are going to modify @pn in-place (see vbpt_cur_do_replace())
+	if (!vref_ancestor_limit(p_vref, merge->pver, merge->p_dist - 1))
+		return MERGE_SWAP_PARTIAL;
+	assert(refcnt_get(&pn->n_hdr.h_refcnt) == 1);
+
+	bool last_level = vbpt_isleaf(pn->kvp[0].val);
+	int ret = MERGE_SWAP_DONE;
+	for (uint16_t i=0; i<nr; i++) {
+		uint64_t k = pn->kvp[i].key;
+		vbpt_range_t range = {.key = key, .len = k - key + 1};
+		if (last_level) {
+			// NULL area before the leaf: both trees point to NULL
+			vbpt_range_t null_range = {.key = key, .len = k - key};
+			if (null_range.len > 0 &&
+			    vbpt_log_rs_range_exists(plog, &null_range,
+			                             merge->p_dist))
+				return merge_conflict(&null_range,
+					VBPT_MERGE_CONFLICT_BOTH_NULL);
+			range.key = k;
+			range.len = 1;
+		}
+		key = k + 1;
+
+		vbpt_hdr_t *g_hdr = gn->kvp[i].val;
+		vbpt_hdr_t *p_hdr = pn->kvp[i].val;
+		if (g_hdr == p_hdr)
+			continue;
+
+		vref_t gv = vbpt_hdr_vref(g_hdr, g_vref);
+		vref_t pv = vbpt_hdr_vref(p_hdr, p_vref);
+		if (!vref_ancestor_limit(gv, merge->gver, merge->g_dist - 1))
+			continue;
+
+		if (!vref_ancestor_limit(pv, merge->pver, merge->p_dist - 1)) {
+			if (vbpt_log_rs_range_exists(plog, &range,
+			                             merge->p_dist))
+				return merge_conflict(&range,
+				                      VBPT_MERGE_CONFLICT_RS);
+			// @g_hdr is going to be placed under a node of a
+			// different version
+			vbpt_hdr_vref_set(g_hdr, gv);
+			pn->kvp[i].val = vbpt_hdr_getref(g_hdr);
+			vbpt_hdr_putref(p_hdr);
+			continue;
+		}
+
+		// both changed
+		if (last_level) {
+			if (vbpt_log_rs_key_exists(plog, k, merge->p_dist))
+				return merge_conflict(&range,
+					VBPT_MERGE_CONFLICT_LEAF_RS);
+			if (vbpt_log_deltas_key_exists(plog, k, merge->p_dist))
+				ret = MERGE_SWAP_PARTIAL;
+			else if (vbpt_log_si(plog))
+				return merge_conflict(&range,
+				                      VBPT_MERGE_CONFLICT_WW);
+			continue;
+		}
+
+		if (k == VBPT_KEY_MAX) {
+			ret = MERGE_SWAP_PARTIAL;
+			continue;
+		}
+		int r = merge_swap_node(hdr2node(g_hdr), hdr2node(p_hdr),
+		                        gv, pv, range.key, k + 1, plog, merge);
+		if (r == MERGE_SWAP_CONFLICT)
+			return r;
+		else if (r == MERGE_SWAP_PARTIAL)
+			ret = MERGE_SWAP_PARTIAL;
+	}
+
+	// NULL area after the last item (again, same in both trees)
+	if (key < end) {
+		vbpt_range_t null_range = {.key = key, .len = end - key};
+		if (vbpt_log_rs_range_exists(plog, &null_range, merge->p_dist))
+			return merge_conflict(&null_range,
+			                      VBPT_MERGE_CONFLICT_BOTH_NULL);
+	}
+
+	return ret;
+}
+
+static int
+merge_swap(const vbpt_tree_t *gt, vbpt_tree_t *pt,
+           const struct vbpt_merge *merge)
+{
+	if (gt->root == NULL || pt->root == NULL || gt->height != pt->height)
+		return MERGE_SWAP_PARTIAL;
+	if (gt->root == pt->root)
+		return MERGE_SWAP_DONE;
+
+	// the root range ends at VBPT_KEY_MAX (see vbpt_range_full)
+	int ret = merge_swap_node(gt->root, pt->root,
+	                          vref_load(&gt->root->n_hdr.vref),
+	                          vref_load(&pt->root->n_hdr.vref),
+	                          0, VBPT_KEY_MAX,
+	                          vbpt_tree_log(pt), merge);
+	if (ret == MERGE_SWAP_DONE)
+		VBPT_MERGE_INC_COUNTER(swap_done);
+	else if (ret == MERGE_SWAP_PARTIAL)
+		VBPT_MERGE_INC_COUNTER(swap_partial);
+	return ret;
+}
+
 /**
  * merge @ptree with @gtree -> result in @ptree
  *  @gtree: globally viewable version of the tree
@@ -981,12 +1312,244 @@ do_merge(const vbpt_cur_t *gc, vbpt_cur_t *pc,
  * future versions.
  * Hence, we choose to restrict merging so that all refcounts of versions from
  * @mver to @vj are 1. Note that this translates to requiring that a transaction
- * commits only after all of its nested transactions have comitted.
+ * commits only after all of its nested transactions have comitted (see
+ * vbpt_txt_begin_nested()).
  *
  * TODO: check for invalid merges (e.g., when no merge is needed)
  */
+struct vbpt_merge_par;
+static bool merge_run(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t **vbase,
+                      const struct vbpt_merge *join,
+                      struct vbpt_merge_par *par);
+
 bool
 vbpt_merge(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t  **vbase)
+{
+	return merge_run(gt, pt, vbase, NULL, NULL);
+}
+
+/**
+ * merge @ptree with @gtree, when the join point is already known
+ *  @vj:     the join point of the two versions (e.g., the base version of a
+ *           transaction, which the global version was committed on)
+ *  @g_dist: distance of @gtree's version from @vj
+ *  @p_dist: distance of @ptree's version from @vj
+ *
+ * Same as vbpt_merge(), but without searching for the join point: ver_join()
+ * is quadratic on the distances, while here we only walk @p_dist versions to
+ * find @hpver. Retries of a transaction commit (see vbpt_txt_try_commit())
+ * know the join point: it is the transaction's base version, which is updated
+ * to @gtree's version after each successful merge.
+ *
+ * If the distances are not consistent with @vj, the merge fails.
+ */
+bool
+vbpt_merge_vj(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t **vbase,
+              ver_t *vj, uint16_t g_dist, uint16_t p_dist)
+{
+	struct vbpt_merge join;
+	merge_join_vj(&join, gt, pt, vj, g_dist, p_dist);
+	return merge_run(gt, pt, vbase, &join, NULL);
+}
+
+/**
+ * Parallel merge
+ *
+ * do_merge() decisions for a range depend only on the nodes of the range (and
+ * the versions of their parents), and the logs. Furthermore, merging never
+ * COWs: vbpt_cur_replace() modifies the (already private) parent of the
+ * replaced node in-place. Hence, ranges for which do_merge() returns 0 (i.e.,
+ * we need to go deeper) can be merged independently, as long as each merge
+ * remains within the subtree of its range.
+ *
+ * The merge is performed in two phases:
+ *  - The calling thread walks the top levels of the trees (up to
+ *    ->split_height of @ptree), as vbpt_merge() does. Instead of descending
+ *    ranges at ->split_height, it records them as tasks, and moves on.
+ *  - Tasks are merged by the workers (and the calling thread). Each task stops
+ *    when its cursors reach the last key of its range, without ascending.
+ *
+ * Modifications in the first phase happen at levels above the tasks' nodes,
+ * and only shift the items after the current cursor position. Hence, the paths
+ * of the recorded tasks remain valid. The result, and the conflicts detected,
+ * are the same as vbpt_merge()'s.
+ */
+struct vbpt_merge_task {
+	vbpt_cur_t gc, pc;
+};
+
+struct vbpt_merge_par {
+	const vbpt_tree_t      *gt;
+	vbpt_tree_t            *pt;
+	struct vbpt_merge      merge;
+	unsigned               nthreads;
+	uint16_t               split_height;
+	struct vbpt_merge_task *tasks;
+	unsigned               tasks_nr, tasks_size;
+	volatile unsigned      tasks_next;
+	volatile bool          failed;
+	vbpt_stats_t           *wstats;     // heat maps of the workers
+	spinlock_t             wstats_lock;
+};
+
+// target number of tasks per thread, used to select ->split_height
+#define VBPT_MERGE_PAR_TASKS 4
+
+static void
+merge_par_init(struct vbpt_merge_par *par, vbpt_tree_t *pt, unsigned nthreads)
+{
+	par->nthreads = nthreads;
+	par->tasks = NULL;
+	par->tasks_nr = par->tasks_size = 0;
+	par->tasks_next = 0;
+	par->failed = false;
+
+	// estimate the number of nodes at each level, based on the root and an
+	// average occupancy of half of the node
+	uint64_t nodes = pt->root ? pt->root->items_nr : 0;
+	uint16_t h = 1;
+	while (nodes < VBPT_MERGE_PAR_TASKS*nthreads && h + 1 < pt->height) {
+		nodes *= pt->root->items_total / 2;
+		h++;
+	}
+	par->split_height = h;
+}
+
+static void
+merge_par_add(struct vbpt_merge_par *par,
+              const vbpt_cur_t *gc, const vbpt_cur_t *pc)
+{
+	if (par->tasks_nr == par->tasks_size) {
+		par->tasks_size = par->tasks_size ? 2*par->tasks_size : 64;
+		par->tasks = xrealloc(par->tasks,
+		                      par->tasks_size*sizeof(*par->tasks));
+	}
+	struct vbpt_merge_task *task = par->tasks + par->tasks_nr++;
+	task->gc = *gc;
+	task->pc = *pc;
+	VBPT_MERGE_INC_COUNTER(par_tasks);
+}
+
+/**
+ * merge the range of a task
+ *  do_merge() has already returned 0 for the range
+ */
+static bool
+merge_task(struct vbpt_merge_par *par, struct vbpt_merge_task *task)
+{
+	vbpt_cur_t *gc = &task->gc, *pc = &task->pc;
+	uint64_t last_key = pc->range.key + pc->range.len - 1;
+
+	vbpt_cur_down(gc);
+	vbpt_cur_down(pc);
+	while (!par->failed) {
+		vbpt_cur_sync(gc, pc);
+		int ret = do_merge(gc, pc, par->gt, par->pt, par->merge);
+		if (ret == -1) {
+			return false;
+		} else if (ret == 0) {
+			vbpt_cur_down(gc);
+			vbpt_cur_down(pc);
+		} else if (pc->range.key + pc->range.len - 1 == last_key) {
+			// the last node of the range is the rightmost item of
+			// its parent, so it can't be marked for deletion
+			assert(!pc->flags.deleteme);
+			return true;
+		} else {
+			vbpt_cur_next(gc);
+			vbpt_cur_next(pc);
+		}
+	}
+
+	return false;
+}
+
+static void
+merge_par_work(struct vbpt_merge_par *par)
+{
+	while (!par->failed) {
+		unsigned i = __sync_fetch_and_add(&par->tasks_next, 1);
+		if (i >= par->tasks_nr)
+			break;
+		if (!merge_task(par, par->tasks + i))
+			par->failed = true;
+	}
+}
+
+static void *
+merge_par_worker(void *arg)
+{
+	struct vbpt_merge_par *par = arg;
+	merge_par_work(par);
+	// nodes released by the worker are in its cache
+	vbpt_mm_shut();
+	// and the conflicts it found are in its heat map
+	#if defined(VBPT_STATS)
+	spin_lock(&par->wstats_lock);
+	vbpt_merge_heat_add(par->wstats, &VbptStats);
+	spin_unlock(&par->wstats_lock);
+	#endif
+	return NULL;
+}
+
+static bool
+merge_par_run(struct vbpt_merge_par *par)
+{
+	unsigned workers_nr = MIN(par->nthreads, par->tasks_nr);
+	workers_nr = workers_nr > 0 ? workers_nr - 1 : 0;
+
+	#if defined(VBPT_STATS)
+	vbpt_stats_t wstats;
+	memset(&wstats, 0, sizeof(wstats));
+	par->wstats = &wstats;
+	spinlock_init(&par->wstats_lock);
+	#endif
+
+	pthread_t tids[workers_nr];
+	for (unsigned i=0; i<workers_nr; i++) {
+		int err = pthread_create(tids + i, NULL, merge_par_worker, par);
+		if (err != 0) {
+			workers_nr = i;
+			break;
+		}
+	}
+	merge_par_work(par);
+	for (unsigned i=0; i<workers_nr; i++)
+		pthread_join(tids[i], NULL);
+
+	// add the workers' conflicts to the caller's heat map
+	#if defined(VBPT_STATS)
+	vbpt_merge_heat_add(&VbptStats, &wstats);
+	#endif
+	return !par->failed;
+}
+
+/**
+ * parallel version of vbpt_merge(), using (up to) @nthreads threads
+ */
+bool
+vbpt_merge_par(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t **vbase,
+               unsigned nthreads)
+{
+	if (nthreads <= 1)
+		return merge_run(gt, pt, vbase, NULL, NULL);
+
+	struct vbpt_merge_par par;
+	merge_par_init(&par, pt, nthreads);
+	bool ret = merge_run(gt, pt, vbase, NULL, &par);
+	free(par.tasks);
+	return ret;
+}
+
+/**
+ * perform the merge
+ *  @join: if not NULL, the join information is taken from here, instead of
+ *         calling ver_join()
+ */
+static bool
+merge_run(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t **vbase,
+          const struct vbpt_merge *join,
+          struct vbpt_merge_par *par)
 {
 	VBPT_MERGE_START_TIMER(vbpt_merge);
 
@@ -1003,13 +1566,17 @@ vbpt_merge(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t  **vbase)
 	//VBPT_MERGE_STOP_TIMER(cur_init);
 
 	struct vbpt_merge merge;
-	merge.gver = gt->ver;
-	merge.pver = pt->ver;
-	//VBPT_MERGE_START_TIMER(ver_join);
-	merge.vj = ver_join(merge.gver, merge.pver,
-	                    &merge.hpver,
-	                    &merge.g_dist, &merge.p_dist);
-	//VBPT_MERGE_STOP_TIMER(ver_join);
+	if (join) {
+		merge = *join;
+	} else {
+		merge.gver = gt->ver;
+		merge.pver = pt->ver;
+		//VBPT_MERGE_START_TIMER(ver_join);
+		merge.vj = ver_join(merge.gver, merge.pver,
+		                    &merge.hpver,
+		                    &merge.g_dist, &merge.p_dist);
+		//VBPT_MERGE_STOP_TIMER(ver_join);
+	}
 	if (merge.vj == VER_JOIN_FAIL) {
 		VBPT_MERGE_INC_COUNTER(join_failed);
 		goto fail;
@@ -1020,6 +1587,12 @@ vbpt_merge(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t  **vbase)
 	      merge.g_dist, merge.p_dist);
 	#endif
 
+	int swap = merge_swap(gt, pt, &merge);
+	if (swap == MERGE_SWAP_CONFLICT)
+		goto fail;
+	else if (swap == MERGE_SWAP_DONE)
+		goto success;
+
 	//unsigned steps = 0;
 	while (!(vbpt_cur_end(&gc) && vbpt_cur_end(&pc))) {
 		//VBPT_MERGE_START_TIMER(cur_sync);
@@ -1033,6 +1606,11 @@ vbpt_merge(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t  **vbase)
 		VBPT_MERGE_STOP_TIMER(do_merge);
 		if (ret == -1) {
 			goto fail;
+		} else if (ret == 0 && par &&
+		           pc.path.height >= par->split_height) {
+			merge_par_add(par, &gc, &pc);
+			vbpt_cur_next(&gc);
+			vbpt_cur_next(&pc);
 		} else if (ret == 0) {
 			//VBPT_MERGE_START_TIMER(cur_down);
 			vbpt_cur_down(&gc);
@@ -1053,6 +1631,15 @@ vbpt_merge(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t  **vbase)
 		*/
 	}
 
+	if (par) {
+		par->gt = gt;
+		par->pt = pt;
+		par->merge = merge;
+		if (!merge_par_run(par))
+			goto fail;
+	}
+
+success:
 	/* success: fix version tree */
 	merge_ok = true;
 	//VBPT_MERGE_START_TIMER(ver_rebase);
@@ -45,7 +45,13 @@ bool vbpt_cmp(vbpt_tree_t *t1, vbpt_tree_t *t2);
  */
 
 bool vbpt_merge(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t **vbase);
-bool vbpt_log_merge(vbpt_tree_t *gtree, vbpt_tree_t *ptree);
+bool vbpt_merge_vj(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t **vbase,
+                   ver_t *vj, uint16_t g_dist, uint16_t p_dist);
+bool vbpt_merge_par(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t **vbase,
+                    unsigned nthreads);
+bool vbpt_log_merge(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t **vbase);
+bool vbpt_log_merge_vj(const vbpt_tree_t *gt, vbpt_tree_t *pt, ver_t **vbase,
+                       ver_t *vj, uint16_t g_dist, uint16_t p_dist);
 
 /**
  * Implementation
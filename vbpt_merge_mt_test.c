@@ -45,6 +45,11 @@
 }
 
 #define DO_VERIFY // verify results
+// use combining commits (vbpt_txt_try_commit_fc()), see vbpt_merge_mt_test-fc
+//#define COMMIT_FC
+// use a committer thread (vbpt_txt_commit_async()), see
+// vbpt_merge_mt_test-async
+//#define COMMIT_ASYNC
 
 // test parameters
 struct params {
@@ -174,7 +179,15 @@ merge_test_thr(void *arg_)
 			vbpt_txt_res_t ret;
 			TSC_UPDATE(&arg->stats.commit, {
 				//ret = vbpt_txt_try_commit(txt, mtree, 4);
+				#if defined(COMMIT_FC)
+				ret = vbpt_txt_try_commit_fc(txt, mtree);
+				#elif defined(COMMIT_ASYNC)
+				vbpt_txt_handle_t *h;
+				h = vbpt_txt_commit_async(txt, mtree);
+				ret = vbpt_txt_async_wait(h, mtree);
+				#else
 				ret = vbpt_txt_try_commit2(txt, mtree);
+				#endif
 			})
 			//tmsg("RET:%s\n", vbpt_txt_res2str[ret]);
 			if (ret == VBPT_COMMIT_FAILED) {
@@ -239,6 +252,9 @@ vbpt_mt_merge_test(unsigned nthreads, unsigned *cpus,
 
 
 	vbpt_mtree_t *mtree = vbpt_mtree_alloc(tree);
+	#if defined(COMMIT_ASYNC)
+	vbpt_txt_committer_t *committer = vbpt_txt_committer_start(mtree);
+	#endif
 
 	if (pthread_barrier_init(&barrier, NULL, nthreads+1) != 0)
 		assert(false && "failed to initialize barrier");
@@ -269,6 +285,9 @@ vbpt_mt_merge_test(unsigned nthreads, unsigned *cpus,
 	for (unsigned i=0; i<nthreads; i++) {
 		pthread_join(tids[i], NULL);
 	}
+	#if defined(COMMIT_ASYNC)
+	vbpt_txt_committer_stop(committer);
+	#endif
 
 	#if defined(DO_VERIFY)
 	for (unsigned i=0; i < nthreads; i++) {
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "ver.h"
+#include "vbpt.h"
+#include "vbpt_mm.h"
+#include "vbpt_log.h"
+#include "vbpt_merge.h"
+#include "vbpt_mtree.h"
+#include "vbpt_tx.h"
+#include "vbpt_stats.h"
+#include "vbpt_test.h"
+
+// test parallel merge: two transactions branch off the same tree and perform
+// blind writes on interleaved keys. The first one commits, and the second is
+// merged using vbpt_merge_par(). The result should be the same as the one of
+// the serial merge. A conflict should be detected, and recorded in the
+// caller's heat map, even if a worker thread finds it.
+
+#define NKEYS    (64*1024)
+#define NTHREADS 4
+
+// expected value for @key after both transactions committed
+static uint64_t
+key_val(uint64_t key)
+{
+	switch (key % 4) {
+		case 0:  return key + 1; // written by the first transaction
+		case 1:  return key + 2; // written by the second transaction
+		default: return key;
+	}
+}
+
+/**
+ * returns the resulting tree, or NULL if the merge failed
+ */
+static vbpt_tree_t *
+merge_test(unsigned nthreads, bool conflict)
+{
+	vbpt_tree_t *tree = vbpt_tree_create_seq(NKEYS);
+	vbpt_mtree_t *mtree = vbpt_mtree_alloc(tree);
+
+	vbpt_txtree_t *txa = vbpt_txtree_alloc(mtree);
+	vbpt_txtree_t *txb = vbpt_txtree_alloc(mtree);
+	for (uint64_t k=0; k<NKEYS; k += 4) {
+		vbpt_txt_write_val(txa, k, k + 1);
+		vbpt_txt_write_val(txb, k + 1, k + 3);
+	}
+	// read a key written by the first transaction
+	if (conflict)
+		vbpt_logtree_get(txb->tree, NKEYS/2);
+	vbpt_logtree_finalize(txa->tree);
+	vbpt_logtree_finalize(txb->tree);
+
+	if (vbpt_txt_try_commit(txa, mtree, 0) != VBPT_COMMIT_OK)
+		abort();
+
+	vbpt_tree_t gtree;
+	ver_t *bver = txb->bver;
+	if (vbpt_mtree_try_commit(mtree, txb->tree, bver, &gtree))
+		abort();
+	bool merged = vbpt_merge_par(&gtree, txb->tree, &bver, nthreads);
+	vbpt_tree_destroy(&gtree);
+	if (merged) {
+		if (!vbpt_mtree_try_commit(mtree, txb->tree, bver, NULL))
+			abort();
+	} else {
+		ver_detach(txb->tree->ver);
+		vbpt_tree_dealloc(txb->tree);
+	}
+	free(txb);
+
+	vbpt_mtree_dealloc(mtree, &tree);
+	if (!merged) {
+		vbpt_tree_dealloc(tree);
+		return NULL;
+	}
+
+	for (uint64_t k=0; k<NKEYS; k++) {
+		vbpt_leaf_t *leaf = vbpt_get(tree, k);
+		if (leaf == NULL || leaf->val != key_val(k)) {
+			fprintf(stderr, "threads:%u key:%" PRIu64 " val:%" PRIu64
+			        " expected:%" PRIu64 "\n", nthreads, k,
+			        leaf ? leaf->val : UINT64_MAX, key_val(k));
+			abort();
+		}
+	}
+	return tree;
+}
+
+int main(int argc, const char *argv[])
+{
+	vbpt_mm_init();
+	vbpt_stats_init();
+
+	vbpt_tree_t *t_ser = merge_test(1, false);
+	vbpt_tree_t *t_par = merge_test(NTHREADS, false);
+	if (t_ser == NULL || t_par == NULL) {
+		fprintf(stderr, "merge failed\n");
+		abort();
+	}
+	if (!vbpt_cmp(t_ser, t_par)) {
+		fprintf(stderr, "serial and parallel merge results differ\n");
+		abort();
+	}
+	vbpt_tree_dealloc(t_ser);
+	vbpt_tree_dealloc(t_par);
+
+	if (merge_test(NTHREADS, true) != NULL) {
+		fprintf(stderr, "parallel merge did not detect conflict\n");
+		abort();
+	}
+	#if defined(VBPT_STATS)
+	uint64_t conflicts = 0;
+	for (unsigned b=0; b<VBPT_MERGE_HEAT_BUCKETS; b++)
+		for (unsigned r=0; r<VBPT_MERGE_CONFLICT_NR; r++)
+			conflicts += VbptStats.m.heat[b][r];
+	if (conflicts == 0) {
+		fprintf(stderr, "conflict not recorded in the heat map\n");
+		abort();
+	}
+	#endif
+
+	printf("DONE\n");
+	return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "ver.h"
+#include "vbpt.h"
+#include "vbpt_mm.h"
+#include "vbpt_log.h"
+#include "vbpt_merge.h"
+#include "vbpt_test.h"
+
+// test merging a subtree past the last key of the private tree's root: the
+// global tree appends keys after the last key of the base tree (which adds a
+// new node under the root), while the private tree writes an existing key. The
+// merge needs to add the new node at the end of the private root.
+
+#define NKEYS 64
+#define NNEW  16
+
+int main(int argc, const char *argv[])
+{
+	vbpt_mm_init();
+
+	vbpt_tree_t *t = vbpt_tree_create();
+	for (uint64_t k=0; k<NKEYS; k++) {
+		vbpt_leaf_t *leaf = vbpt_leaf_alloc(VBPT_LEAF_SIZE, t->ver);
+		vbpt_insert(t, k, leaf, NULL);
+	}
+
+	vbpt_tree_t *gt = vbpt_logtree_branch(t);
+	for (uint64_t k=2*NKEYS; k<2*NKEYS + NNEW; k++) {
+		vbpt_leaf_t *leaf = vbpt_leaf_alloc(VBPT_LEAF_SIZE, gt->ver);
+		vbpt_logtree_insert(gt, k, leaf, NULL);
+	}
+	vbpt_tree_t *pt = vbpt_logtree_branch(t);
+	vbpt_leaf_t *pleaf = vbpt_leaf_alloc(VBPT_LEAF_SIZE, pt->ver);
+	vbpt_logtree_insert(pt, 3, pleaf, NULL);
+	vbpt_logtree_finalize(gt);
+	vbpt_logtree_finalize(pt);
+
+	// the merge rebases (or, on failure, releases) a reference to @gt's
+	// version
+	ver_rebase_prepare(gt->ver);
+	if (!vbpt_merge(gt, pt, NULL)) {
+		fprintf(stderr, "merge failed\n");
+		abort();
+	}
+
+	for (uint64_t k=0; k<2*NKEYS + NNEW; k++) {
+		bool exists = (k < NKEYS || k >= 2*NKEYS);
+		vbpt_leaf_t *leaf = vbpt_get(pt, k);
+		if ((leaf != NULL) != exists) {
+			fprintf(stderr, "key %" PRIu64 ": %s\n", k,
+			        exists ? "missing" : "unexpected");
+			abort();
+		}
+	}
+	if (vbpt_get(pt, 3) != pleaf) {
+		fprintf(stderr, "private write lost\n");
+		abort();
+	}
+
+	// the logs are destroyed with their versions
+	vbpt_tree_dealloc(pt);
+	vbpt_tree_dealloc(gt);
+	vbpt_tree_dealloc(t);
+	printf("DONE\n");
+	return 0;
+}
@@ -41,15 +41,24 @@ vbpt_merge_test(vbpt_tree_t *t,
 		vbpt_logtree_insert_bulk(logt2_b, ins2, ins2_len);
 	})
 
+	vbpt_logtree_finalize(logt1);
+	vbpt_logtree_finalize(logt2_a);
+	vbpt_logtree_finalize(logt2_b);
+
 	#if 0
 	dmsg("PARENT: "); vbpt_tree_print(t, true);
 	dmsg("T1:     "); vbpt_tree_print(logt1, true);
 	dmsg("T2:     "); vbpt_tree_print(logt2_a, true);
 	#endif
 
+	// the merges rebase (or, on failure, release) a reference to the
+	// global version
+	ver_rebase_prepare(logt1->ver);
+	ver_rebase_prepare(logt1->ver);
+
 	unsigned log_ret;
 	TSC_MEASURE_TICKS(t_merge_log, {
-		log_ret = vbpt_log_merge(logt1, logt2_a);
+		log_ret = vbpt_log_merge(logt1, logt2_a, NULL);
 	})
 
 	unsigned mer_ret;
@@ -116,6 +125,11 @@ vbpt_merge_test(vbpt_tree_t *t,
 	}
 	#undef print_ticks
 
+	// the logs are destroyed with their versions
+	vbpt_tree_dealloc(logt2_b);
+	vbpt_tree_dealloc(logt2_a);
+	vbpt_tree_dealloc(logt1);
+	vbpt_tree_dealloc(t);
 	return success;
 }
 
@@ -130,7 +144,11 @@ test_merge_rand(struct xdist_desc *d0, struct xdist_desc *d1, struct xdist_desc
 	vbpt_tree_t *t = vbpt_tree_create();
 	vbpt_tree_insert_bulk(t, data0, d0->nr);
 
-	return vbpt_merge_test(t, data1, d1->nr, data2, d2->nr);
+	bool ret = vbpt_merge_test(t, data1, d1->nr, data2, d2->nr);
+	free(data0);
+	free(data1);
+	free(data2);
+	return ret;
 }
 
 
@@ -157,10 +175,11 @@ do_serial_test(void)
 	// VBPT_NODE_SIZE=128: ------> Count: 16384 Successes: 14513
 	// VBPT_NODE_SIZE=512: ------> Count: 16384 Successes: 2489
 	// need to investigate more
-	const int xsize = 128;
+	// (the numbers above are for 128x128 tests)
+	const int xsize = 16;
 	for (unsigned i=0; i<xsize; i++)
 		for (unsigned j=0; j<xsize; j++)
-			for (unsigned k=0; j<xsize; j++)
+			for (unsigned k=0; k<xsize; k++)
 				do_test(i, j, k);
 	printf("------> Count: %u Successes: %u\n", count, successes);
 }
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "ver.h"
+#include "vbpt.h"
+#include "vbpt_mm.h"
+#include "vbpt_log.h"
+#include "vbpt_mtree.h"
+#include "vbpt_tx.h"
+#include "vbpt_stats.h"
+#include "vbpt_test.h"
+
+// test merges of trees that changed disjoint subtrees (subtree swap): writes
+// to disjoint key ranges should merge, a read of a range that the concurrent
+// commit changed should conflict, and merges that change the structure of the
+// tree (inserts of new keys) should still produce the right values.
+
+#define NKEYS 65536
+#define RANGE 128
+
+int main(int argc, const char *argv[])
+{
+	vbpt_mm_init();
+	vbpt_stats_init();
+
+	vbpt_tree_t *tree = vbpt_tree_create_seq(NKEYS);
+	vbpt_mtree_t *mtree = vbpt_mtree_alloc(tree);
+
+	// disjoint ranges
+	vbpt_txtree_t *txa = vbpt_txtree_alloc(mtree);
+	vbpt_txtree_t *txb = vbpt_txtree_alloc(mtree);
+	for (uint64_t k=0; k<RANGE; k++) {
+		vbpt_txt_write_val(txa, k, 2*k);
+		vbpt_txt_write_val(txb, NKEYS/2 + k, 2*(NKEYS/2 + k));
+	}
+	// same leaf, blind writes: the private tree's value is kept
+	vbpt_txt_write_val(txa, NKEYS - 1, 100);
+	vbpt_txt_write_val(txb, NKEYS - 1, 101);
+	vbpt_txt_commit_expect(txb, mtree, 1, VBPT_COMMIT_OK);
+	vbpt_txt_commit_expect(txa, mtree, 1, VBPT_COMMIT_MERGED);
+	#if defined(VBPT_STATS)
+	if (VbptStats.m.swap_done == 0) {
+		fprintf(stderr, "disjoint merge did not swap subtrees\n");
+		abort();
+	}
+	#endif
+
+	// read of a range written by a concurrent commit
+	vbpt_txtree_t *txc = vbpt_txtree_alloc(mtree);
+	vbpt_txtree_t *txd = vbpt_txtree_alloc(mtree);
+	vbpt_logtree_get(txc->tree, NKEYS/4);
+	vbpt_txt_write_val(txc, 1, 1);
+	vbpt_txt_write_val(txd, NKEYS/4, 0);
+	vbpt_txt_commit_expect(txd, mtree, 1, VBPT_COMMIT_OK);
+	vbpt_txt_commit_expect(txc, mtree, 1, VBPT_COMMIT_MERGE_FAILED);
+
+	// new keys change the structure of the private tree
+	vbpt_txtree_t *txe = vbpt_txtree_alloc(mtree);
+	vbpt_txtree_t *txf = vbpt_txtree_alloc(mtree);
+	for (uint64_t k=0; k<RANGE; k++)
+		vbpt_txt_write_val(txe, NKEYS + k, k);
+	vbpt_txt_write_val(txf, 2, 1000);
+	vbpt_txt_commit_expect(txf, mtree, 1, VBPT_COMMIT_OK);
+	vbpt_txt_commit_expect(txe, mtree, 1, VBPT_COMMIT_MERGED);
+
+	for (uint64_t k=0; k<NKEYS + RANGE; k++) {
+		uint64_t expected;
+		if (k == 2)
+			expected = 1000;
+		else if (k < RANGE || (k >= NKEYS/2 && k < NKEYS/2 + RANGE))
+			expected = 2*k;
+		else if (k == NKEYS/4)
+			expected = 0;
+		else if (k == NKEYS - 1)
+			expected = 100;
+		else if (k >= NKEYS)
+			expected = k - NKEYS;
+		else
+			expected = k;
+		if (vbpt_mtree_get_val(mtree, k) != expected) {
+			fprintf(stderr, "unexpected value for key %" PRIu64 "\n",
+			        k);
+			abort();
+		}
+	}
+
+	vbpt_mtree_dealloc(mtree, NULL);
+	printf("DONE\n");
+	return 0;
+}
@@ -17,21 +17,30 @@
 /*
  * initialize a header
  *  Version's refcount will be increased
+ *  If @ver is NULL, the header has the version of its parent (VBPT_VREF_ELIDE)
  */
 static inline void
 vbpt_hdr_init(vbpt_hdr_t *hdr, ver_t *ver, enum vbpt_type type)
 {
-	hdr->vref = vref_get(ver);
+	hdr->vref = (ver != NULL) ? vref_get(ver) : vref_null();
 	refcnt_init(&hdr->h_refcnt, 1);
 	hdr->type = type;
 }
 
 /**
- * we maintain two list of nodes:
+ * we maintain three list of nodes:
+ *  - mm_nodes: free nodes, ready to be reused
+ *  - mm_dead:  freed nodes, whose children's references have not yet been
+ *              released. Releasing the children happens lazily, either when
+ *              the node is reused, or via vbpt_mm_reclaim() with a bounded
+ *              budget, so that releasing a large tree does not stall the caller
+ *  - mm_leafs: free leafs
  */
 static __thread struct {
 	vbpt_node_t          *mm_nodes;
 	size_t                mm_nodes_nr;
+	vbpt_node_t          *mm_dead;
+	size_t                mm_dead_nr;
 	vbpt_leaf_t          *mm_leafs;
 	size_t                mm_leafs_nr;
 	struct vbpt_mm_stats  mm_stats;
@@ -67,25 +76,15 @@ vbpt_cache_prealloc(void)
 	#endif
 }
 
-static vbpt_node_t *
-vbpt_cache_get_node(size_t node_size)
+/**
+ * release the references of a dead node's children
+ *  NB: vbpt_hdr_putref() might end up calling vbpt_node_dealloc(), which adds
+ *  more nodes to the dead queue. We are using per-thread queues, so it should
+ *  be OK.
+ */
+static void
+vbpt_node_release_children(vbpt_node_t *node)
 {
-	VBPT_START_TIMER(vbpt_cache_get_node);
-	assert(node_size == VBPT_NODE_SIZE); // only one size for now
-	vbpt_node_t *node;
-	if (vbptCache.mm_nodes_nr == 0) {
-		node = xmalloc(node_size);
-		vbptCache.mm_stats.nodes_allocated++;
-		goto end;
-	}
-	// pop a node
-	node = vbptCache.mm_nodes;
-	vbptCache.mm_nodes = node->mm_next;
-	vbptCache.mm_nodes_nr--;
-	// release children references
-	// NB: vbpt_hdr_putref() might end up calling vbpt_node_dealloc(),
-	//     which adds more nodes to the queue. We are using per-thread queues,
-	//     so it should be OK.
 	if (node->items_nr != 0) {
 		vbpt_kvp_t *kvp = node->kvp;
 		if (kvp[0].val->type == VBPT_NODE) {
@@ -99,7 +98,37 @@ vbpt_cache_get_node(size_t node_size)
 		} else assert(false);
 	}
 	node->items_nr = 0;
-end:
+}
+
+static vbpt_node_t *
+vbpt_cache_pop_dead(void)
+{
+	vbpt_node_t *node = vbptCache.mm_dead;
+	vbptCache.mm_dead = node->mm_next;
+	vbptCache.mm_dead_nr--;
+	vbpt_node_release_children(node);
+	return node;
+}
+
+static vbpt_node_t *
+vbpt_cache_get_node(size_t node_size)
+{
+	VBPT_START_TIMER(vbpt_cache_get_node);
+	assert(node_size == VBPT_NODE_SIZE); // only one size for now
+	vbpt_node_t *node;
+	if (vbptCache.mm_nodes_nr != 0) {
+		// pop a free node
+		node = vbptCache.mm_nodes;
+		vbptCache.mm_nodes = node->mm_next;
+		vbptCache.mm_nodes_nr--;
+		assert(node->items_nr == 0);
+	} else if (vbptCache.mm_dead_nr != 0) {
+		node = vbpt_cache_pop_dead();
+	} else {
+		node = xmalloc(node_size);
+		vbptCache.mm_stats.nodes_allocated++;
+	}
+
 	//memset(node, 0, node_size);
 	VBPT_STOP_TIMER(vbpt_cache_get_node);
 	return node;
@@ -131,15 +160,39 @@ vbpt_mm_init(void)
 	vbpt_cache_prealloc();
 }
 
+/**
+ * release this thread's cached nodes and leafs
+ *  (threads that free nodes, but exit before reusing them, need to call this
+ *  to release the references of dead nodes' children)
+ */
 void
 vbpt_mm_shut(void)
 {
+	vbpt_mm_reclaim(SIZE_MAX);
+	assert(vbptCache.mm_dead_nr == 0);
+
+	while (vbptCache.mm_nodes_nr > 0) {
+		vbpt_node_t *node = vbptCache.mm_nodes;
+		vbptCache.mm_nodes = node->mm_next;
+		vbptCache.mm_nodes_nr--;
+		free(node);
+	}
+
+	while (vbptCache.mm_leafs_nr > 0) {
+		vbpt_leaf_t *leaf = vbptCache.mm_leafs;
+		vbptCache.mm_leafs = leaf->mm_next;
+		vbptCache.mm_leafs_nr--;
+		if (leaf->d_total_len > 0)
+			free(leaf->data);
+		free(leaf);
+	}
 }
 
 
 /*
  * allocate a new node
  *  Version's refcount will be increased
+ *  @ver can be NULL for nodes that have the same version as their parent
  */
 vbpt_node_t *
 vbpt_node_alloc(size_t node_size, ver_t *ver)
@@ -155,16 +208,39 @@ vbpt_node_alloc(size_t node_size, ver_t *ver)
 /**
  * free a node
  *  version's refcount will be decreased
- *  children's refcount will be decrased
+ *  children's refcount will be decrased (lazily, see vbpt_mm_reclaim())
  */
 void
 vbpt_node_dealloc(vbpt_node_t *node)
 {
 	vref_put(node->n_hdr.vref);
-	// add node to list
-	node->mm_next = vbptCache.mm_nodes;
-	vbptCache.mm_nodes = node;
-	vbptCache.mm_nodes_nr++;
+	// add node to the appropriate list
+	if (node->items_nr == 0) {
+		node->mm_next = vbptCache.mm_nodes;
+		vbptCache.mm_nodes = node;
+		vbptCache.mm_nodes_nr++;
+	} else {
+		node->mm_next = vbptCache.mm_dead;
+		vbptCache.mm_dead = node;
+		vbptCache.mm_dead_nr++;
+	}
+}
+
+/**
+ * release children references of (at most) @budget dead nodes of this thread
+ *  returns the number of nodes that are still dead
+ */
+size_t
+vbpt_mm_reclaim(size_t budget)
+{
+	for (size_t i=0; i < budget && vbptCache.mm_dead_nr > 0; i++) {
+		vbpt_node_t *node = vbpt_cache_pop_dead();
+		node->mm_next = vbptCache.mm_nodes;
+		vbptCache.mm_nodes = node;
+		vbptCache.mm_nodes_nr++;
+		vbptCache.mm_stats.nodes_reclaimed++;
+	}
+	return vbptCache.mm_dead_nr;
 }
 
 
@@ -211,4 +287,5 @@ vbpt_mm_stats_report(char *prefix, vbpt_mm_stats_t *st)
 	pr_cnt(leafs_preallocated);
 	pr_cnt(leafs_requested);
 	pr_cnt(leafs_released);
+	pr_cnt(nodes_reclaimed);
 }
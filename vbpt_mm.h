@@ -23,6 +23,10 @@ void         vbpt_node_dealloc(vbpt_node_t *node);
 vbpt_leaf_t *vbpt_leaf_alloc(size_t leaf_size, ver_t *ver);
 void         vbpt_leaf_dealloc(vbpt_leaf_t *leaf);
 
+// number of dead nodes released per vbpt_mm_reclaim() call on the commit path
+#define VBPT_MM_RECLAIM_BUDGET 32
+size_t       vbpt_mm_reclaim(size_t budget);
+
 struct vbpt_mm_stats {
 	size_t   nodes_allocated;
 	size_t   leafs_allocated;
@@ -30,6 +34,7 @@ struct vbpt_mm_stats {
 	size_t   leafs_preallocated;
 	size_t   leafs_requested;
 	size_t   leafs_released;
+	size_t   nodes_reclaimed;
 	#if 0
 	uint64_t node_alloc_ticks;
 	uint64_t node_dealloc_ticks;
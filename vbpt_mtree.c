@@ -8,8 +8,11 @@
  * http://opensource.org/licenses/GPL-2.0
  */
 
+#include <string.h>
+
 #include "vbpt.h"
 #include "vbpt_mtree.h"
+#include "vbpt_epoch.h"
 
 /*  mutable tree objects on top of immutable versioned trees */
 
@@ -28,16 +31,105 @@ vbpt_mtree_alloc(vbpt_tree_t *tree)
 	spinlock_init(&ret->mt_lock);
 	spinlock_init(&ret->gc_lock);
 	spinlock_init(&ret->tx_lock);
+	ret->mt_commits = 0;
+	spinlock_init(&ret->snap_lock);
+	ret->mt_snaps = NULL;
+	ret->mt_snaps_nr = 0;
+	bzero(&ret->mt_snap_policy, sizeof(ret->mt_snap_policy));
+	ret->mt_mm = VBPT_MTREE_MM_REFCNT;
+	ret->mt_fc = NULL;
+	ret->mt_irrevocable = NULL;
+	ret->mt_abort_rate = 0;
+	ret->mt_iso = VBPT_LOG_ISO_SERIALIZABLE;
 	ver_pin(ret->mt_tree->ver, NULL);
 	return ret;
 }
 
+/**
+ * set the memory management mode of @mtree
+ *  should be called before the mtree is used by other threads
+ */
+void
+vbpt_mtree_setmm(vbpt_mtree_t *mtree, enum vbpt_mtree_mm mm)
+{
+	mtree->mt_mm = mm;
+}
+
+/**
+ * set the default isolation level of @mtree's transactions
+ *  should be called before the mtree is used by other threads
+ */
+void
+vbpt_mtree_setiso(vbpt_mtree_t *mtree, unsigned iso)
+{
+	mtree->mt_iso = iso;
+}
+
+static void
+vbpt_mtree_tree_dealloc_cb(void *tree)
+{
+	vbpt_tree_dealloc(tree);
+}
+
+/**
+ * release a tree that was replaced on @mtree by a commit
+ *  In epoch mode, other threads might have borrowed its root, so it is retired
+ */
+void
+vbpt_mtree_tree_release(vbpt_mtree_t *mtree, vbpt_tree_t *tree)
+{
+	if (vbpt_mtree_epoch(mtree))
+		vbpt_epoch_retire(vbpt_mtree_tree_dealloc_cb, tree);
+	else
+		vbpt_tree_dealloc(tree);
+}
+
+/**
+ * take the irrevocable token of @mtree for @tree
+ *  Until @tree is committed (or vbpt_mtree_irrevocable_end() is called), all
+ *  other commits wait (see vbpt_mtree_commit_lock()). Hence, if @tree is
+ *  branched after this function returns, it is guaranteed to commit without a
+ *  merge.
+ *
+ *  Lock-free commits (VBPT_MTREE_MM_EPOCH_CAS) do not check the token, so this
+ *  is not supported in that mode.
+ */
+void
+vbpt_mtree_irrevocable_begin(vbpt_mtree_t *mtree, vbpt_tree_t *tree)
+{
+	assert(mtree->mt_mm != VBPT_MTREE_MM_EPOCH_CAS);
+	vbpt_tree_t * volatile *irr = &mtree->mt_irrevocable;
+	while (!__sync_bool_compare_and_swap(irr, NULL, tree))
+		sched_yield();
+	// wait for commits that passed vbpt_mtree_commit_lock() before we took
+	// the token
+	spin_lock(&mtree->mt_lock);
+	spin_unlock(&mtree->mt_lock);
+}
+
+/**
+ * release the irrevocable token, if @tree still holds it (i.e., it was not
+ * committed)
+ */
+void
+vbpt_mtree_irrevocable_end(vbpt_mtree_t *mtree, vbpt_tree_t *tree)
+{
+	__sync_bool_compare_and_swap(&mtree->mt_irrevocable, tree, NULL);
+}
+
+static void vbpt_msnap_release(vbpt_mtree_t *mtree, vbpt_msnap_t *snaps);
+
 
 void
 vbpt_mtree_dealloc(vbpt_mtree_t *mtree, vbpt_tree_t **tree_ptr)
 {
 	vbpt_tree_t *tree = mtree->mt_tree;
 
+	// release retired trees and drop snapshots, so that their versions can
+	// be collected
+	if (vbpt_mtree_epoch(mtree))
+		vbpt_epoch_drain();
+	vbpt_msnap_release(mtree, mtree->mt_snaps);
 	free(mtree);
 
 	if (tree_ptr) {
@@ -80,23 +172,39 @@ vbpt_mtree_dealloc(vbpt_mtree_t *mtree, vbpt_tree_t **tree_ptr)
  * @tree's refcount is not increased
  * if @mt_tree_dst is not NULL, caller is responisble for releasing the tree
  * using vbpt_tree_dealloc().
+ *
+ * In VBPT_MTREE_MM_EPOCH_CAS mode, vbpt_mtree_try_commit_cas() is used.
  */
 bool
 vbpt_mtree_try_commit(vbpt_mtree_t *mtree, vbpt_tree_t *tree,
                       ver_t *b_ver, vbpt_tree_t *mt_tree_dst)
 {
+	if (mtree->mt_mm == VBPT_MTREE_MM_EPOCH_CAS)
+		return vbpt_mtree_try_commit_cas(mtree, tree, b_ver,
+		                                 mt_tree_dst);
+
 	VBPT_START_TIMER(mtree_try_commit);
 	bool committed = false;
 	vbpt_tree_t *mt_tree;
+	// once the lock is released, @tree might be replaced and released by
+	// another commit, so we keep its version
+	ver_t *ver_new = tree->ver;
 
-	spin_lock(&mtree->mt_lock);
+	vbpt_mtree_commit_lock(mtree, tree);
 	ver_t *cur_ver = (mt_tree = mtree->mt_tree)->ver;
 	//tmsg("trying to commit ver:%zd to cur_ver:%zd\n",
 	//      tree->ver->v_id, cur_ver->v_id);
 	if (ver_eq(cur_ver, b_ver)) {
 		//tmsg("commited ver:%zd to previous:%zd\n",
 		//     tree->ver->v_id, cur_ver->v_id);
+		// NB: refcount updates on @tree's private nodes might have
+		// been non-atomic (see vbpt_hdr_putref_tree()). Releasing
+		// ->mt_lock publishes them.
+		vbpt_tree_root_own(tree);
 		mtree->mt_tree = tree;
+		mtree->mt_commits++;
+		if (mtree->mt_irrevocable == tree)
+			mtree->mt_irrevocable = NULL;
 		committed = true;
 	} else if (mt_tree_dst) {
 		// failure: copy tree to mt_tree_dst, so that caller can try to
@@ -108,22 +216,74 @@ vbpt_mtree_try_commit(vbpt_mtree_t *mtree, vbpt_tree_t *tree,
 
 	// pin without holding the lock
 	if (committed) {
-		ver_pin(tree->ver, mt_tree->ver);
+		ver_pin(ver_new, mt_tree->ver);
 
 		// run gc for versions before the pinned version
 		// if somebody else has the lock, just continue
 		if (spin_try_lock(&mtree->gc_lock)) {
-			ver_tree_gc(tree->ver);
+			ver_tree_gc(ver_new);
 			spin_unlock(&mtree->gc_lock);
 		}
 
-		vbpt_tree_dealloc(mt_tree);
+		vbpt_mtree_tree_release(mtree, mt_tree);
 	}
 	VBPT_STOP_TIMER(mtree_try_commit);
 
 	return committed;
 }
 
+/**
+ * lock-free version of vbpt_mtree_try_commit()
+ *
+ * The current tree is read within an epoch, and replaced trees are retired.
+ * Hence, the tree that we compare against (and copy to @mt_tree_dst) remains
+ * valid, even if it is concurrently replaced. Its version also remains in the
+ * version tree: the retired tree holds a reference to it, so ver_tree_gc()
+ * considers it a branch.
+ *
+ * Concurrent commits might pin their versions out of order. This is fine,
+ * since replaced versions keep a reference (via their trees) until the
+ * committers exit their epochs.
+ */
+bool
+vbpt_mtree_try_commit_cas(vbpt_mtree_t *mtree, vbpt_tree_t *tree,
+                          ver_t *b_ver, vbpt_tree_t *mt_tree_dst)
+{
+	VBPT_START_TIMER(mtree_try_commit);
+	assert(mtree->mt_mm == VBPT_MTREE_MM_EPOCH_CAS);
+	bool committed = false;
+	ver_t *ver_new = tree->ver;
+
+	vbpt_epoch_enter();
+	vbpt_tree_t *mt_tree = mtree->mt_tree;
+	if (ver_eq(mt_tree->ver, b_ver)) {
+		// the CAS is a full barrier: it publishes the tree's nodes (see
+		// vbpt_mtree_try_commit())
+		vbpt_tree_root_own(tree);
+		committed = __sync_bool_compare_and_swap(&mtree->mt_tree,
+		                                         mt_tree, tree);
+		if (!committed)
+			mt_tree = mtree->mt_tree;
+	}
+
+	if (committed) {
+		__sync_fetch_and_add(&mtree->mt_commits, 1);
+		ver_pin(ver_new, mt_tree->ver);
+		if (spin_try_lock(&mtree->gc_lock)) {
+			ver_tree_gc(ver_new);
+			spin_unlock(&mtree->gc_lock);
+		}
+		vbpt_mtree_tree_release(mtree, mt_tree);
+	} else if (mt_tree_dst) {
+		vbpt_tree_copy(mt_tree_dst, mt_tree);
+		ver_rebase_prepare(mt_tree->ver);
+	}
+	vbpt_epoch_exit();
+
+	VBPT_STOP_TIMER(mtree_try_commit);
+	return committed;
+}
+
 /**
  * try to commit a new version to @mtree
  *
@@ -134,8 +294,9 @@ vbpt_mtree_try_commit(vbpt_mtree_t *mtree, vbpt_tree_t *tree,
  *
  * if (un)successful true (false) is returned.
  *
- * caller should take mtree->mt_lock before calling
- * if successful, lock is released
+ * caller should take mtree->mt_lock before calling (vbpt_mtree_commit_lock())
+ * if successful, lock is released, and the caller should release the old tree
+ * using vbpt_mtree_tree_release()
  *
  * @tree's refcount is not increased
  */
@@ -146,25 +307,30 @@ vbpt_mtree_try_commit2(vbpt_mtree_t *mtree,
                        vbpt_tree_t **mt_tree_old_ptr)
 {
 	bool committed;
-	ver_t *ver_old;
+	ver_t *ver_old, *ver_new = tree->ver;
 
 	VBPT_START_TIMER(mtree_try_commit);
+	assert(mtree->mt_mm != VBPT_MTREE_MM_EPOCH_CAS);
 
 	*mt_tree_old_ptr = mtree->mt_tree;
 	ver_old          = mtree->mt_tree->ver;
 
 	committed = false;
 	if (ver_eq(ver_old, b_ver)) {
+		vbpt_tree_root_own(tree);
 		mtree->mt_tree = tree;
+		mtree->mt_commits++;
+		if (mtree->mt_irrevocable == tree)
+			mtree->mt_irrevocable = NULL;
 		// commit aftermath
 		committed = true;
 		spin_unlock(&mtree->mt_lock);
 		// pin new tree version in place of old
-		ver_pin(mtree->mt_tree->ver, ver_old);
+		ver_pin(ver_new, ver_old);
 		// try to run gc for versions before the pinned version
 		// if somebody else has the lock, just continue
 		if (spin_try_lock(&mtree->gc_lock)) {
-			ver_tree_gc(mtree->mt_tree->ver);
+			ver_tree_gc(ver_new);
 			spin_unlock(&mtree->gc_lock);
 		}
 	}
@@ -184,7 +350,8 @@ vbpt_mtree_try_commit2(vbpt_mtree_t *mtree,
  * if (un)successful true (false) is returned.
  *
  * caller should take mtree->tx_lock before calling
- * if successful, lock is released
+ * if successful, lock is released, and the caller should release the old tree
+ * using vbpt_mtree_tree_release()
  *
  * @tree's refcount is not increased
  */
@@ -195,15 +362,20 @@ vbpt_mtree_try_commit3(vbpt_mtree_t *mtree,
                        vbpt_tree_t **mt_tree_old_ptr)
 {
 	bool committed;
-	ver_t *ver_old;
+	ver_t *ver_old, *ver_new = tree->ver;
 
 	VBPT_START_TIMER(mtree_try_commit);
+	assert(mtree->mt_mm != VBPT_MTREE_MM_EPOCH_CAS);
 
-	spin_lock(&mtree->mt_lock);
+	vbpt_mtree_commit_lock(mtree, tree);
 	*mt_tree_old_ptr = mtree->mt_tree;
 	ver_old          = mtree->mt_tree->ver;
 	if (ver_eq(ver_old, b_ver)) {
+		vbpt_tree_root_own(tree);
 		mtree->mt_tree = tree;
+		mtree->mt_commits++;
+		if (mtree->mt_irrevocable == tree)
+			mtree->mt_irrevocable = NULL;
 		committed = true;
 	} else {
 		committed = false;
@@ -214,11 +386,11 @@ vbpt_mtree_try_commit3(vbpt_mtree_t *mtree,
 	if (committed){
 		spin_unlock(&mtree->tx_lock);
 		// pin new tree version in place of old
-		ver_pin(mtree->mt_tree->ver, ver_old);
+		ver_pin(ver_new, ver_old);
 		// try to run gc for versions before the pinned version
 		// if somebody else has the lock, just continue
 		if (spin_try_lock(&mtree->gc_lock)) {
-			ver_tree_gc(mtree->mt_tree->ver);
+			ver_tree_gc(ver_new);
 			spin_unlock(&mtree->gc_lock);
 		}
 	}
@@ -226,3 +398,270 @@ vbpt_mtree_try_commit3(vbpt_mtree_t *mtree,
 	VBPT_STOP_TIMER(mtree_try_commit);
 	return committed;
 }
+
+/*
+ * Snapshots
+ */
+
+/**
+ * estimate the memory reachable only via @hdr
+ *  We descend only on nodes with a refcount of 1, i.e., nodes that are
+ *  referenced only by their parent. This is racy, but good enough for an
+ *  estimate.
+ */
+static size_t
+vbpt_hdr_excl_bytes(vbpt_hdr_t *hdr)
+{
+	if (refcnt_(&hdr->h_refcnt) != 1)
+		return 0;
+
+	if (hdr->type == VBPT_LEAF) {
+		vbpt_leaf_t *leaf = hdr2leaf(hdr);
+		return sizeof(vbpt_leaf_t) + leaf->d_total_len;
+	}
+
+	vbpt_node_t *node = hdr2node(hdr);
+	size_t ret = VBPT_NODE_SIZE;
+	for (uint16_t i=0; i<node->items_nr; i++)
+		ret += vbpt_hdr_excl_bytes(node->kvp[i].val);
+	return ret;
+}
+
+static size_t
+vbpt_msnap_excl_bytes(vbpt_msnap_t *snap)
+{
+	vbpt_node_t *root = snap->ms_tree.root;
+	return root ? vbpt_hdr_excl_bytes(&root->n_hdr) : 0;
+}
+
+/**
+ * release a list of snapshots (linked via ->ms_next)
+ *  Unpinning happens under ->gc_lock, so that it won't race with
+ *  ver_tree_gc()
+ */
+static void
+vbpt_msnap_release(vbpt_mtree_t *mtree, vbpt_msnap_t *snaps)
+{
+	while (snaps != NULL) {
+		vbpt_msnap_t *snap = snaps;
+		snaps = snap->ms_next;
+
+		spin_lock(&mtree->gc_lock);
+		ver_snap_unpin(snap->ms_tree.ver);
+		vbpt_tree_destroy(&snap->ms_tree);
+		spin_unlock(&mtree->gc_lock);
+		free(snap);
+	}
+}
+
+/**
+ * apply retention policy
+ *  caller should hold ->snap_lock
+ *  expired snapshots are removed from the list and returned, so that they can
+ *  be released without holding the lock. The number of expired snapshots is
+ *  added to @expired_nr.
+ */
+static vbpt_msnap_t *
+vbpt_msnap_expire__(vbpt_mtree_t *mtree, unsigned *expired_nr)
+{
+	struct vbpt_msnap_policy *pol = &mtree->mt_snap_policy;
+	vbpt_msnap_t *expired = NULL, **expired_tail = &expired;
+	vbpt_msnap_t *snap;
+	uint64_t now = get_ticks();
+
+	#define EXPIRE_OLDEST()                           \
+	do {                                              \
+		mtree->mt_snaps = snap->ms_next;          \
+		mtree->mt_snaps_nr--;                     \
+		snap->ms_next = NULL;                     \
+		*expired_tail = snap;                     \
+		expired_tail = &snap->ms_next;            \
+		(*expired_nr)++;                          \
+	} while (0)
+
+	// count and age
+	while ((snap = mtree->mt_snaps) != NULL) {
+		bool expire = false;
+		if (pol->max_nr && mtree->mt_snaps_nr > pol->max_nr)
+			expire = true;
+		if (pol->max_ticks && now - snap->ms_ticks > pol->max_ticks)
+			expire = true;
+		if (!expire)
+			break;
+		EXPIRE_OLDEST();
+	}
+
+	// memory budget
+	if (pol->max_bytes) {
+		size_t total = 0;
+		for (snap = mtree->mt_snaps; snap; snap = snap->ms_next) {
+			snap->ms_bytes = vbpt_msnap_excl_bytes(snap);
+			total += snap->ms_bytes;
+		}
+
+		while (total > pol->max_bytes && (snap = mtree->mt_snaps)) {
+			total -= snap->ms_bytes;
+			EXPIRE_OLDEST();
+		}
+	}
+
+	#undef EXPIRE_OLDEST
+	return expired;
+}
+
+/**
+ * take a snapshot of the current version of @mtree
+ *
+ * @name: name of the snapshot (can be NULL). Names longer than
+ *        VBPT_MSNAP_NAME_LEN-1 are truncated.
+ *
+ * returns the commit number of the snapshot version, which can be used with
+ * vbpt_mtree_snap_branch_at(). The retention policy is applied after the
+ * snapshot is added.
+ */
+uint64_t
+vbpt_mtree_snap(vbpt_mtree_t *mtree, const char *name)
+{
+	vbpt_msnap_t *snap = xmalloc(sizeof(vbpt_msnap_t));
+	snap->ms_ticks = get_ticks();
+	snap->ms_bytes = 0;
+	snap->ms_name[0] = '\0';
+	if (name) {
+		strncpy(snap->ms_name, name, VBPT_MSNAP_NAME_LEN - 1);
+		snap->ms_name[VBPT_MSNAP_NAME_LEN - 1] = '\0';
+	}
+
+	// pin the version under the lock: while it is the current version, no
+	// ver_tree_gc() can remove it from the version tree. Lock-free commits
+	// do not take the lock, but the epoch keeps the tree (and its version)
+	// alive (see vbpt_mtree_try_commit_cas()). In that case, the commit
+	// number might be off by the concurrent commits.
+	vbpt_epoch_enter();
+	spin_lock(&mtree->mt_lock);
+	vbpt_tree_copy(&snap->ms_tree, mtree->mt_tree);
+	ver_snap_pin(snap->ms_tree.ver);
+	snap->ms_commit = mtree->mt_commits;
+	spin_unlock(&mtree->mt_lock);
+	vbpt_epoch_exit();
+
+	// keep the list sorted by commit number
+	uint64_t ret = snap->ms_commit;
+	unsigned expired_nr = 0;
+	vbpt_msnap_t *expired, **pos;
+	spin_lock(&mtree->snap_lock);
+	for (pos = &mtree->mt_snaps; *pos != NULL; pos = &(*pos)->ms_next)
+		if ((*pos)->ms_commit > snap->ms_commit)
+			break;
+	snap->ms_next = *pos;
+	*pos = snap;
+	mtree->mt_snaps_nr++;
+	expired = vbpt_msnap_expire__(mtree, &expired_nr);
+	spin_unlock(&mtree->snap_lock);
+
+	vbpt_msnap_release(mtree, expired);
+	return ret;
+}
+
+/**
+ * branch a tree off the newest snapshot named @name
+ *  @tree is initialized as in vbpt_tree_branch_init(), and should be released
+ *  using vbpt_tree_destroy().
+ *
+ * returns false if no such snapshot exists
+ */
+bool
+vbpt_mtree_snap_branch(vbpt_mtree_t *mtree, const char *name,
+                       vbpt_tree_t *tree)
+{
+	vbpt_msnap_t *found = NULL;
+
+	spin_lock(&mtree->snap_lock);
+	for (vbpt_msnap_t *s = mtree->mt_snaps; s != NULL; s = s->ms_next)
+		if (strncmp(s->ms_name, name, VBPT_MSNAP_NAME_LEN - 1) == 0)
+			found = s;
+	if (found)
+		vbpt_tree_branch_init(&found->ms_tree, tree);
+	spin_unlock(&mtree->snap_lock);
+
+	return found != NULL;
+}
+
+/**
+ * branch a tree off the newest snapshot taken at, or before, commit @commit
+ *  see vbpt_mtree_snap_branch()
+ */
+bool
+vbpt_mtree_snap_branch_at(vbpt_mtree_t *mtree, uint64_t commit,
+                          vbpt_tree_t *tree)
+{
+	vbpt_msnap_t *found = NULL;
+
+	spin_lock(&mtree->snap_lock);
+	for (vbpt_msnap_t *s = mtree->mt_snaps; s != NULL; s = s->ms_next) {
+		if (s->ms_commit > commit)
+			break;
+		found = s;
+	}
+	if (found)
+		vbpt_tree_branch_init(&found->ms_tree, tree);
+	spin_unlock(&mtree->snap_lock);
+
+	return found != NULL;
+}
+
+/**
+ * drop all snapshots named @name
+ *  returns false if no such snapshot exists
+ */
+bool
+vbpt_mtree_snap_drop(vbpt_mtree_t *mtree, const char *name)
+{
+	vbpt_msnap_t *dropped = NULL;
+
+	spin_lock(&mtree->snap_lock);
+	vbpt_msnap_t **pos = &mtree->mt_snaps;
+	while (*pos != NULL) {
+		vbpt_msnap_t *s = *pos;
+		if (strncmp(s->ms_name, name, VBPT_MSNAP_NAME_LEN - 1) != 0) {
+			pos = &s->ms_next;
+			continue;
+		}
+		*pos = s->ms_next;
+		mtree->mt_snaps_nr--;
+		s->ms_next = dropped;
+		dropped = s;
+	}
+	spin_unlock(&mtree->snap_lock);
+
+	vbpt_msnap_release(mtree, dropped);
+	return dropped != NULL;
+}
+
+void
+vbpt_mtree_snap_setpolicy(vbpt_mtree_t *mtree, struct vbpt_msnap_policy *pol)
+{
+	spin_lock(&mtree->snap_lock);
+	mtree->mt_snap_policy = *pol;
+	spin_unlock(&mtree->snap_lock);
+}
+
+/**
+ * apply the retention policy of @mtree
+ *  Snapshots are expired on vbpt_mtree_snap(), but age and memory limits need
+ *  to be periodically enforced by the user.
+ *
+ * returns the number of expired snapshots
+ */
+unsigned
+vbpt_mtree_snap_expire(vbpt_mtree_t *mtree)
+{
+	unsigned expired_nr = 0;
+	vbpt_msnap_t *expired;
+
+	spin_lock(&mtree->snap_lock);
+	expired = vbpt_msnap_expire__(mtree, &expired_nr);
+	spin_unlock(&mtree->snap_lock);
+
+	vbpt_msnap_release(mtree, expired);
+	return expired_nr;
+}
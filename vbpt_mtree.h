@@ -12,8 +12,10 @@
 #define VBPT_MTREE_H
 
 #include <stdbool.h>
+#include <sched.h>
 
 #include "vbpt.h"
+#include "vbpt_epoch.h"
 #include "vbpt_stats.h"
 #include "misc.h"
 
@@ -29,29 +31,166 @@
  *   . in an mtree
  */
 
+/**
+ * Named snapshots
+ *
+ * A snapshot keeps a committed version of the mtree readable after newer
+ * versions have been committed (e.g., "snapshot at commit N"). It holds a tree
+ * copy (i.e., references to the root and the version) and, additionally,
+ * snapshot-pins the version (see ver_snap_pin()) so that new trees can be
+ * branched off it via vbpt_tree_branch_init().
+ *
+ * @ms_tree:   tree copy
+ * @ms_commit: commit number of the mtree when the snapshot was taken
+ * @ms_ticks:  time of the snapshot (see get_ticks())
+ * @ms_name:   name of the snapshot (might be empty)
+ * @ms_bytes:  estimate of the memory reachable only from this snapshot
+ *             (updated by vbpt_mtree_snap_expire())
+ * @ms_next:   next (newer) snapshot
+ */
+#define VBPT_MSNAP_NAME_LEN 32
+struct vbpt_msnap {
+	vbpt_tree_t        ms_tree;
+	uint64_t           ms_commit;
+	uint64_t           ms_ticks;
+	char               ms_name[VBPT_MSNAP_NAME_LEN];
+	size_t             ms_bytes;
+	struct vbpt_msnap *ms_next;
+};
+typedef struct vbpt_msnap vbpt_msnap_t;
+
+/**
+ * Snapshot retention policy. Oldest snapshots are dropped first. A value of
+ * zero disables the corresponding limit.
+ * @max_nr:    maximum number of snapshots
+ * @max_ticks: maximum age of a snapshot in ticks
+ * @max_bytes: (estimated) memory budget for tree nodes that are reachable only
+ *             from the snapshots
+ */
+struct vbpt_msnap_policy {
+	unsigned max_nr;
+	uint64_t max_ticks;
+	size_t   max_bytes;
+};
+
+/**
+ * Memory management for trees branched off an mtree
+ *  VBPT_MTREE_MM_REFCNT:    branched trees grab a reference to the root
+ *  VBPT_MTREE_MM_EPOCH:     branched trees borrow the root under an epoch, and
+ *                           replaced trees are retired (see vbpt_epoch.h)
+ *  VBPT_MTREE_MM_EPOCH_CAS: same as VBPT_MTREE_MM_EPOCH, but
+ *                           vbpt_mtree_try_commit() replaces the tree with a
+ *                           CAS instead of taking ->mt_lock (see
+ *                           vbpt_mtree_try_commit_cas()). The lock-based
+ *                           commit functions (try_commit2/try_commit3) can't
+ *                           be used in this mode.
+ *
+ * In the epoch modes, branching is lock-free: the current tree is read within
+ * an epoch, so it (and its version) remain valid even if it is replaced.
+ */
+enum vbpt_mtree_mm {
+	VBPT_MTREE_MM_REFCNT    = 0,
+	VBPT_MTREE_MM_EPOCH     = 1,
+	VBPT_MTREE_MM_EPOCH_CAS = 2,
+};
+
 /**
  * Mutable trees:
  * @tree_current current tree version
  * @mt_lock  serialize access to mtree
  * @gc_lock  serialize gc on version chain
  * @tx_lock  to be used exclusively by transaction code
+ * @mt_commits  number of commits (protected by @mt_lock, or updated
+ *              atomically in VBPT_MTREE_MM_EPOCH_CAS mode)
+ * @mt_snaps    snapshot list, oldest first (protected by @snap_lock)
+ * @mt_snap_policy snapshot retention policy (protected by @snap_lock)
+ * @mt_mm    memory management mode (set before the mtree is shared)
+ * @mt_fc    queue of pending combining commits (see vbpt_txt_try_commit_fc())
+ * @mt_irrevocable tree of the transaction holding the irrevocable token
+ *                 (see vbpt_mtree_irrevocable_begin())
+ * @mt_abort_rate  estimated abort rate (see vbpt_txt_cm_update())
+ * @mt_iso   default isolation level of transactions (VBPT_LOG_ISO_*, set
+ *           before the mtree is shared, see vbpt_txt_set_iso())
  */
+struct vbpt_txt_fc;
 struct vbpt_mtree {
-	vbpt_tree_t *mt_tree;
+	vbpt_tree_t * volatile mt_tree;
 	spinlock_t   mt_lock;
 	spinlock_t   gc_lock;
 	spinlock_t   tx_lock;
+	uint64_t     mt_commits;
+	spinlock_t   snap_lock;
+	vbpt_msnap_t *mt_snaps;
+	unsigned     mt_snaps_nr;
+	struct vbpt_msnap_policy mt_snap_policy;
+	enum vbpt_mtree_mm mt_mm;
+	struct vbpt_txt_fc * volatile mt_fc;
+	vbpt_tree_t * volatile mt_irrevocable;
+	volatile uint32_t mt_abort_rate;
+	unsigned     mt_iso;
 };
 typedef struct vbpt_mtree vbpt_mtree_t;
 
 vbpt_mtree_t *vbpt_mtree_alloc(vbpt_tree_t *tree);
 void          vbpt_mtree_dealloc(vbpt_mtree_t *mtree, vbpt_tree_t **tree_ptr);
+void          vbpt_mtree_setmm(vbpt_mtree_t *mtree, enum vbpt_mtree_mm mm);
+void          vbpt_mtree_setiso(vbpt_mtree_t *mtree, unsigned iso);
+void          vbpt_mtree_tree_release(vbpt_mtree_t *mtree, vbpt_tree_t *tree);
+
+// irrevocable transactions
+void vbpt_mtree_irrevocable_begin(vbpt_mtree_t *mtree, vbpt_tree_t *tree);
+void vbpt_mtree_irrevocable_end(vbpt_mtree_t *mtree, vbpt_tree_t *tree);
+
+// snapshots
+uint64_t vbpt_mtree_snap(vbpt_mtree_t *mtree, const char *name);
+bool     vbpt_mtree_snap_branch(vbpt_mtree_t *mtree, const char *name,
+                                vbpt_tree_t *tree);
+bool     vbpt_mtree_snap_branch_at(vbpt_mtree_t *mtree, uint64_t commit,
+                                   vbpt_tree_t *tree);
+bool     vbpt_mtree_snap_drop(vbpt_mtree_t *mtree, const char *name);
+void     vbpt_mtree_snap_setpolicy(vbpt_mtree_t *mtree,
+                                   struct vbpt_msnap_policy *policy);
+unsigned vbpt_mtree_snap_expire(vbpt_mtree_t *mtree);
+
+/**
+ * take ->mt_lock to commit @tree
+ *  while a transaction holds the irrevocable token, commits of other trees
+ *  wait for it to commit
+ */
+static inline void
+vbpt_mtree_commit_lock(vbpt_mtree_t *mtree, vbpt_tree_t *tree)
+{
+	for (;;) {
+		spin_lock(&mtree->mt_lock);
+		vbpt_tree_t *irr = mtree->mt_irrevocable;
+		if (irr == NULL || irr == tree)
+			return;
+		spin_unlock(&mtree->mt_lock);
+		// the token is held for a whole transaction: don't spin
+		while (mtree->mt_irrevocable != NULL)
+			sched_yield();
+	}
+}
+
+static inline bool
+vbpt_mtree_epoch(const vbpt_mtree_t *mtree)
+{
+	return mtree->mt_mm != VBPT_MTREE_MM_REFCNT;
+}
 
 /* we do a branch (i.e., grab a references for the root and version) under a
- * lock, so that it won't dissapear */
+ * lock, so that it won't dissapear. In epoch modes, the root is borrowed, and
+ * the epoch keeps the tree alive, so no lock is needed. */
 static inline void
 vbpt_mtree_branch(vbpt_mtree_t *mtree, vbpt_tree_t *tree)
 {
+	if (vbpt_mtree_epoch(mtree)) {
+		vbpt_epoch_enter();
+		vbpt_tree_branch_epoch(mtree->mt_tree, tree);
+		vbpt_epoch_exit();
+		return;
+	}
+
 	spin_lock(&mtree->mt_lock);
 	vbpt_tree_branch_init(mtree->mt_tree, tree);
 	spin_unlock(&mtree->mt_lock);
@@ -62,6 +201,10 @@ bool vbpt_mtree_try_commit(vbpt_mtree_t *mtree,
                            vbpt_tree_t *tree, ver_t *b_ver,
                            vbpt_tree_t *mt_tree_dst);
 
+bool vbpt_mtree_try_commit_cas(vbpt_mtree_t *mtree,
+                               vbpt_tree_t *tree, ver_t *b_ver,
+                               vbpt_tree_t *mt_tree_dst);
+
 bool vbpt_mtree_try_commit2(vbpt_mtree_t *mtree,
                             vbpt_tree_t *tree,
                             ver_t *b_ver,
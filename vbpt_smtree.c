@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "vbpt.h"
+#include "vbpt_mtree.h"
+#include "vbpt_tx.h"
+#include "vbpt_smtree.h"
+
+/**
+ * allocate a sharded mtree, with @trees[i] as the initial tree of shard i
+ *
+ * @trees' refcounts are not increased
+ */
+vbpt_smtree_t *
+vbpt_smtree_alloc(vbpt_tree_t **trees, unsigned shards_nr, uint64_t shard_keys)
+{
+	assert(shards_nr > 0 && shard_keys > 0);
+	vbpt_smtree_t *ret = xmalloc(sizeof(vbpt_smtree_t));
+	ret->smt_shards_nr = shards_nr;
+	ret->smt_shard_keys = shard_keys;
+	ret->smt_shards = xmalloc(shards_nr*sizeof(vbpt_mtree_t *));
+	for (unsigned i=0; i<shards_nr; i++)
+		ret->smt_shards[i] = vbpt_mtree_alloc(trees[i]);
+	return ret;
+}
+
+void
+vbpt_smtree_dealloc(vbpt_smtree_t *smt)
+{
+	for (unsigned i=0; i<smt->smt_shards_nr; i++)
+		vbpt_mtree_dealloc(smt->smt_shards[i], NULL);
+	free(smt->smt_shards);
+	free(smt);
+}
+
+vbpt_stxtree_t *
+vbpt_stxtree_alloc(vbpt_smtree_t *smt)
+{
+	vbpt_stxtree_t *ret = xmalloc(sizeof(vbpt_stxtree_t));
+	ret->stx_smt = smt;
+	ret->stx_txts = xmalloc(smt->smt_shards_nr*sizeof(vbpt_txtree_t *));
+	memset(ret->stx_txts, 0, smt->smt_shards_nr*sizeof(vbpt_txtree_t *));
+	ret->stx_txts_nr = 0;
+	return ret;
+}
+
+// release a (non-committed) transaction
+static void
+txt_abort1(vbpt_txtree_t *txt)
+{
+	ver_detach(txt->tree->ver);
+	vbpt_tree_dealloc(txt->tree);
+	free(txt);
+}
+
+/**
+ * abort a (finalized) sharded transaction
+ */
+void
+vbpt_stxtree_dealloc(vbpt_stxtree_t *stx)
+{
+	for (unsigned i=0; i<stx->stx_smt->smt_shards_nr; i++) {
+		if (stx->stx_txts[i] != NULL)
+			txt_abort1(stx->stx_txts[i]);
+	}
+	free(stx->stx_txts);
+	free(stx);
+}
+
+void
+vbpt_stxt_finalize(vbpt_stxtree_t *stx)
+{
+	for (unsigned i=0; i<stx->stx_smt->smt_shards_nr; i++) {
+		if (stx->stx_txts[i] != NULL)
+			vbpt_logtree_finalize(stx->stx_txts[i]->tree);
+	}
+}
+
+/**
+ * prepare phase: make @txt's base version the current version of @mt,
+ * merging if needed
+ *  caller holds @mt->tx_lock, so the mtree's tree does not change
+ */
+static bool
+multi_prepare1(vbpt_txtree_t *txt, vbpt_mtree_t *mt, vbpt_txt_res_t *res)
+{
+	vbpt_tree_t *top = mt->mt_tree;
+	if (ver_eq(top->ver, txt->bver))
+		return true;
+
+	ver_rebase_prepare(top->ver);
+	if (!vbpt_txt_merge(txt, top, &txt->bver))
+		return false;
+	*res = VBPT_COMMIT_MERGED;
+	return true;
+}
+
+/**
+ * two-phase commit of the @nr transactions of @txts, in the order of @order
+ */
+static vbpt_txt_res_t
+multi_commit_2pc(vbpt_txtree_t **txts, vbpt_mtree_t **mts,
+                 const unsigned *order, unsigned nr)
+{
+	vbpt_txt_res_t res = VBPT_COMMIT_OK;
+	unsigned i;
+
+	for (i=0; i<nr; i++)
+		spin_lock(&mts[order[i]]->tx_lock);
+
+	for (i=0; i<nr; i++) {
+		unsigned x = order[i];
+		if (!multi_prepare1(txts[x], mts[x], &res)) {
+			// the failed merge released the rebase reference
+			res = VBPT_COMMIT_MERGE_FAILED;
+			break;
+		}
+	}
+
+	for (i=0; i<nr; i++) {
+		vbpt_txtree_t *txt = txts[order[i]];
+		vbpt_mtree_t *mt = mts[order[i]];
+
+		if (res == VBPT_COMMIT_MERGE_FAILED) {
+			spin_unlock(&mt->tx_lock);
+			txt_abort1(txt);
+			continue;
+		}
+
+		// releases ->tx_lock
+		vbpt_tree_t *old_tree;
+		if (!vbpt_mtree_try_commit3(mt, txt->tree, txt->bver,
+		                            &old_tree)) {
+			fprintf(stderr, "This should not happen\n");
+			abort();
+		}
+		vbpt_mtree_tree_release(mt, old_tree);
+		free(txt);
+	}
+
+	return res;
+}
+
+/**
+ * atomically commit transactions on multiple mtrees
+ *  @txts[i] is a (finalized) transaction on @mts[i], or NULL. The mtrees
+ *  should be distinct.
+ *
+ * The ->tx_lock of the mtrees is taken in address order (so that concurrent
+ * multi-commits do not deadlock), each transaction is merged on the current
+ * tree of its mtree if needed, and, if all merges succeed, all transactions
+ * are committed. Otherwise, none is. The transactions are released.
+ *
+ * As with vbpt_txt_try_commit2(), all committers of the mtrees need to use
+ * ->tx_lock.
+ */
+vbpt_txt_res_t
+vbpt_multi_commit(vbpt_txtree_t **txts, vbpt_mtree_t **mts, unsigned n)
+{
+	vbpt_txt_res_t res;
+	unsigned *order = xmalloc(n*sizeof(unsigned));
+	unsigned nr = 0;
+
+	// insertion sort of the accessed mtrees by address
+	for (unsigned i=0; i<n; i++) {
+		if (txts[i] == NULL)
+			continue;
+		uintptr_t mt = (uintptr_t)mts[i];
+		unsigned j;
+		for (j=nr; j>0 && (uintptr_t)mts[order[j-1]] > mt; j--)
+			order[j] = order[j-1];
+		assert(j == 0 || mts[order[j-1]] != mts[i]);
+		order[j] = i;
+		nr++;
+	}
+
+	if (nr == 0) {
+		res = VBPT_COMMIT_OK;
+	} else if (nr == 1) {
+		res = vbpt_txt_try_commit2(txts[order[0]], mts[order[0]]);
+	} else {
+		VBPT_START_TIMER(txt_try_commit);
+		res = multi_commit_2pc(txts, mts, order, nr);
+		vbpt_mm_reclaim(VBPT_MM_RECLAIM_BUDGET);
+		vbpt_txt_update_stats(res);
+		VBPT_STOP_TIMER(txt_try_commit);
+	}
+
+	free(order);
+	return res;
+}
+
+/**
+ * commit a sharded transaction
+ *  @stx is released
+ */
+vbpt_txt_res_t
+vbpt_stxt_try_commit(vbpt_stxtree_t *stx)
+{
+	vbpt_smtree_t *smt = stx->stx_smt;
+	vbpt_txt_res_t res;
+
+	res = vbpt_multi_commit(stx->stx_txts, smt->smt_shards,
+	                        smt->smt_shards_nr);
+	free(stx->stx_txts);
+	free(stx);
+	return res;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#ifndef VBPT_SMTREE_H
+#define VBPT_SMTREE_H
+
+#include <inttypes.h>
+
+#include "vbpt.h"
+#include "vbpt_mtree.h"
+#include "vbpt_tx.h"
+
+/**
+ * Sharded mtrees
+ *
+ * The key space is partitioned into ranges of @smt_shard_keys keys, and each
+ * range is stored in an independent mtree (i.e., with its own locks, version
+ * chain, and gc). The last shard holds all keys after its start.
+ *
+ * A sharded transaction (vbpt_stxtree_t) lazily branches a transaction for
+ * each shard it accesses. Transactions that access a single shard commit as
+ * normal transactions on that shard (vbpt_txt_try_commit2()). Transactions
+ * that access multiple shards use a two-phase commit (vbpt_multi_commit()):
+ * they take the ->tx_lock of all the accessed shards in a fixed order (so that
+ * concurrent commits do not deadlock), merge their changes on each shard if
+ * needed (prepare), and, if all merges succeed, commit each shard.
+ *
+ * Since the shard trees are branched at different times and the shards are
+ * committed one at a time, a transaction might observe a partially committed
+ * multi-shard transaction. If it commits, however, this is detected as a
+ * conflict when merging. Hence, committed transactions are serializable, but
+ * transactions that are not committed (e.g., read-only) might see
+ * inconsistent state across shards.
+ *
+ * As with vbpt_txt_try_commit2(), all committers of the shards need to use
+ * ->tx_lock (i.e., the shard mtrees should only be accessed via the smtree).
+ */
+struct vbpt_smtree {
+	unsigned      smt_shards_nr;
+	uint64_t      smt_shard_keys;
+	vbpt_mtree_t  **smt_shards;
+};
+typedef struct vbpt_smtree vbpt_smtree_t;
+
+/**
+ * sharded transaction
+ *  @stx_txts:    per-shard transactions (NULL for shards not accessed)
+ *  @stx_txts_nr: number of accessed shards
+ */
+struct vbpt_stxtree {
+	vbpt_smtree_t *stx_smt;
+	vbpt_txtree_t **stx_txts;
+	unsigned      stx_txts_nr;
+};
+typedef struct vbpt_stxtree vbpt_stxtree_t;
+
+vbpt_smtree_t *vbpt_smtree_alloc(vbpt_tree_t **trees, unsigned shards_nr,
+                                 uint64_t shard_keys);
+void           vbpt_smtree_dealloc(vbpt_smtree_t *smt);
+
+vbpt_stxtree_t *vbpt_stxtree_alloc(vbpt_smtree_t *smt);
+void            vbpt_stxtree_dealloc(vbpt_stxtree_t *stx);
+void            vbpt_stxt_finalize(vbpt_stxtree_t *stx);
+vbpt_txt_res_t  vbpt_stxt_try_commit(vbpt_stxtree_t *stx);
+
+// atomically commit transactions on independent mtrees (also used to commit
+// sharded transactions)
+vbpt_txt_res_t  vbpt_multi_commit(vbpt_txtree_t **txts, vbpt_mtree_t **mts,
+                                  unsigned n);
+
+static inline unsigned
+vbpt_smtree_shard(const vbpt_smtree_t *smt, uint64_t key)
+{
+	uint64_t shard = key / smt->smt_shard_keys;
+	return shard < smt->smt_shards_nr ? shard : smt->smt_shards_nr - 1;
+}
+
+/**
+ * return the transaction tree of the shard of @key, branching it if needed
+ */
+static inline vbpt_tree_t *
+vbpt_stxt_tree(vbpt_stxtree_t *stx, uint64_t key)
+{
+	unsigned shard = vbpt_smtree_shard(stx->stx_smt, key);
+	vbpt_txtree_t *txt = stx->stx_txts[shard];
+	if (txt == NULL) {
+		txt = vbpt_txtree_alloc(stx->stx_smt->smt_shards[shard]);
+		stx->stx_txts[shard] = txt;
+		stx->stx_txts_nr++;
+	}
+	return txt->tree;
+}
+
+static inline void
+vbpt_stxt_insert(vbpt_stxtree_t *stx, uint64_t key,
+                 vbpt_leaf_t *leaf, vbpt_leaf_t **o)
+{
+	vbpt_logtree_insert(vbpt_stxt_tree(stx, key), key, leaf, o);
+}
+
+static inline void
+vbpt_stxt_delete(vbpt_stxtree_t *stx, uint64_t key, vbpt_leaf_t **data)
+{
+	vbpt_logtree_delete(vbpt_stxt_tree(stx, key), key, data);
+}
+
+static inline vbpt_leaf_t *
+vbpt_stxt_get(vbpt_stxtree_t *stx, uint64_t key)
+{
+	return vbpt_logtree_get(vbpt_stxt_tree(stx, key), key);
+}
+
+#endif /* VBPT_SMTREE_H */
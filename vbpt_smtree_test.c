@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "vbpt.h"
+#include "vbpt_mm.h"
+#include "vbpt_log.h"
+#include "vbpt_mtree.h"
+#include "vbpt_smtree.h"
+#include "vbpt_tx.h"
+#include "vbpt_stats.h"
+#include "vbpt_test.h"
+
+// test sharded mtrees: threads transfer amounts between accounts spread over
+// all shards, so that most transactions use a two-phase commit. The total
+// amount should be preserved. Two transactions that read the same accounts
+// should conflict. Also, test atomic commits on independent mtrees: if one of
+// the transactions conflicts, none should be committed.
+
+#define NSHARDS       4
+#define SHARD_KEYS    16
+#define NACCOUNTS     (NSHARDS*SHARD_KEYS)
+#define INIT_BALANCE  1000
+#define NTHREADS      4
+#define NTXS          2000
+
+static vbpt_smtree_t *Smt;
+
+static uint64_t
+stx_read(vbpt_stxtree_t *stx, uint64_t acc)
+{
+	vbpt_leaf_t *leaf = vbpt_stxt_get(stx, acc);
+	if (leaf == NULL) {
+		fprintf(stderr, "account %" PRIu64 " not found\n", acc);
+		abort();
+	}
+	return leaf->val;
+}
+
+static void
+stx_write(vbpt_stxtree_t *stx, uint64_t acc, uint64_t val)
+{
+	vbpt_tree_t *tree = vbpt_stxt_tree(stx, acc);
+	vbpt_leaf_t *leaf = vbpt_leaf_alloc(0, tree->ver);
+	leaf->val = val;
+	vbpt_stxt_insert(stx, acc, leaf, NULL);
+}
+
+static vbpt_stxtree_t *
+stx_transfer(uint64_t from, uint64_t to, uint64_t amount)
+{
+	vbpt_stxtree_t *stx = vbpt_stxtree_alloc(Smt);
+	uint64_t b_from = stx_read(stx, from);
+	uint64_t b_to = stx_read(stx, to);
+	if (b_from >= amount) {
+		stx_write(stx, from, b_from - amount);
+		stx_write(stx, to, b_to + amount);
+	}
+	vbpt_stxt_finalize(stx);
+	return stx;
+}
+
+static void *
+transfer_thr(void *arg)
+{
+	unsigned seed = (uintptr_t)arg;
+	vbpt_mm_init();
+	vbpt_stats_init();
+	for (unsigned i=0; i<NTXS; i++) {
+		uint64_t from = rand_r(&seed) % NACCOUNTS;
+		uint64_t to = rand_r(&seed) % NACCOUNTS;
+		uint64_t amount = rand_r(&seed) % 10;
+		if (from == to)
+			continue;
+		for (;;) {
+			vbpt_stxtree_t *stx = stx_transfer(from, to, amount);
+			vbpt_txt_res_t ret = vbpt_stxt_try_commit(stx);
+			if (ret == VBPT_COMMIT_OK || ret == VBPT_COMMIT_MERGED)
+				break;
+		}
+	}
+	vbpt_epoch_thr_unregister();
+	return NULL;
+}
+
+static uint64_t
+balances_sum(void)
+{
+	vbpt_stxtree_t *stx = vbpt_stxtree_alloc(Smt);
+	uint64_t sum = 0;
+	for (uint64_t acc=0; acc<NACCOUNTS; acc++)
+		sum += stx_read(stx, acc);
+	vbpt_stxt_finalize(stx);
+	vbpt_stxtree_dealloc(stx);
+	return sum;
+}
+
+// a transaction on @mts that reads key 0 of the first mtree, and writes @key
+// of the second
+static void
+multi_tx(vbpt_mtree_t **mts, vbpt_txtree_t **txts, uint64_t key)
+{
+	txts[0] = vbpt_txtree_alloc(mts[0]);
+	txts[1] = vbpt_txtree_alloc(mts[1]);
+	vbpt_logtree_get(txts[0]->tree, 0);
+	vbpt_txt_write_val(txts[0], 0, key);
+	vbpt_txt_write_val(txts[1], key, key);
+	vbpt_logtree_finalize(txts[0]->tree);
+	vbpt_logtree_finalize(txts[1]->tree);
+}
+
+static void
+test_multi_commit(void)
+{
+	vbpt_mtree_t *mts[2];
+	for (unsigned i=0; i<2; i++) {
+		vbpt_tree_t *tree = vbpt_tree_create();
+		for (uint64_t k=0; k<SHARD_KEYS; k++) {
+			vbpt_leaf_t *leaf = vbpt_leaf_alloc(0, tree->ver);
+			leaf->val = 0;
+			vbpt_insert(tree, k, leaf, NULL);
+		}
+		mts[i] = vbpt_mtree_alloc(tree);
+	}
+
+	vbpt_txtree_t *txts1[2], *txts2[2];
+	multi_tx(mts, txts1, 1);
+	multi_tx(mts, txts2, 2);
+	if (vbpt_multi_commit(txts1, mts, 2) != VBPT_COMMIT_OK) {
+		fprintf(stderr, "first multi-commit failed\n");
+		abort();
+	}
+	if (vbpt_multi_commit(txts2, mts, 2) != VBPT_COMMIT_MERGE_FAILED) {
+		fprintf(stderr, "multi-commit conflict not detected\n");
+		abort();
+	}
+
+	vbpt_tree_t tree;
+	vbpt_rotx_begin(mts[1], &tree);
+	if (vbpt_get(&tree, 1)->val != 1 || vbpt_get(&tree, 2)->val != 0) {
+		fprintf(stderr, "multi-commit was not atomic\n");
+		abort();
+	}
+	vbpt_rotx_end(mts[1], &tree);
+
+	for (unsigned i=0; i<2; i++)
+		vbpt_mtree_dealloc(mts[i], NULL);
+}
+
+int main(int argc, const char *argv[])
+{
+	vbpt_mm_init();
+	vbpt_stats_init();
+
+	vbpt_tree_t *trees[NSHARDS];
+	for (unsigned s=0; s<NSHARDS; s++) {
+		trees[s] = vbpt_tree_create();
+		for (uint64_t k=s*SHARD_KEYS; k<(s+1)*SHARD_KEYS; k++) {
+			vbpt_leaf_t *leaf = vbpt_leaf_alloc(0, trees[s]->ver);
+			leaf->val = INIT_BALANCE;
+			vbpt_insert(trees[s], k, leaf, NULL);
+		}
+	}
+	Smt = vbpt_smtree_alloc(trees, NSHARDS, SHARD_KEYS);
+
+	// two conflicting cross-shard transactions
+	vbpt_stxtree_t *stx1 = stx_transfer(0, NACCOUNTS - 1, 10);
+	vbpt_stxtree_t *stx2 = stx_transfer(NACCOUNTS - 1, 0, 20);
+	if (vbpt_stxt_try_commit(stx1) != VBPT_COMMIT_OK) {
+		fprintf(stderr, "first transaction failed to commit\n");
+		abort();
+	}
+	if (vbpt_stxt_try_commit(stx2) != VBPT_COMMIT_MERGE_FAILED) {
+		fprintf(stderr, "conflict not detected\n");
+		abort();
+	}
+
+	pthread_t tids[NTHREADS];
+	for (unsigned i=0; i<NTHREADS; i++)
+		pthread_create(tids + i, NULL, transfer_thr, (void *)(uintptr_t)i);
+	for (unsigned i=0; i<NTHREADS; i++)
+		pthread_join(tids[i], NULL);
+
+	uint64_t sum = balances_sum();
+	if (sum != NACCOUNTS*INIT_BALANCE) {
+		fprintf(stderr, "sum: %" PRIu64 " expected: %u\n",
+		        sum, NACCOUNTS*INIT_BALANCE);
+		abort();
+	}
+
+	vbpt_smtree_dealloc(Smt);
+
+	test_multi_commit();
+	printf("DONE\n");
+	return 0;
+}
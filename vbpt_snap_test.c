@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "ver.h"
+#include "vbpt.h"
+#include "vbpt_mm.h"
+#include "vbpt_log.h"
+#include "vbpt_mtree.h"
+#include "vbpt_tx.h"
+#include "vbpt_kv.h"
+#include "vbpt_stats.h"
+
+// test named snapshots: commit one key per transaction, take a snapshot every
+// SNAP_EVERY commits, and verify time-travel reads and retention
+
+#define NCOMMITS    128
+#define SNAP_EVERY  8
+#define SNAP_KEEP   4
+
+static void
+commit_key(vbpt_mtree_t *mtree, uint64_t key)
+{
+	vbpt_txtree_t *txt = vbpt_txtree_alloc(mtree);
+	vbpt_logtree_kv_insert(txt->tree, key, key);
+	vbpt_logtree_finalize(txt->tree);
+	vbpt_txt_res_t ret = vbpt_txt_try_commit(txt, mtree, 0);
+	if (ret != VBPT_COMMIT_OK) {
+		fprintf(stderr, "commit failed: %s\n", vbpt_txt_res2str[ret]);
+		abort();
+	}
+}
+
+// a snapshot taken at commit @commit has all keys < @commit
+static void
+verify_snap(vbpt_tree_t *tree, uint64_t commit)
+{
+	for (uint64_t k=0; k<NCOMMITS; k++) {
+		uint64_t v = vbpt_kv_get(tree, k);
+		uint64_t v_exp = (k < commit) ? k : VBPT_KV_DEFVAL;
+		if (v != v_exp) {
+			fprintf(stderr, "snap:%" PRIu64 " key:%" PRIu64
+			        " val:%" PRIu64 " expected:%" PRIu64 "\n",
+			        commit, k, v, v_exp);
+			abort();
+		}
+	}
+}
+
+int main(int argc, const char *argv[])
+{
+	vbpt_mm_init();
+	vbpt_stats_init();
+
+	vbpt_tree_t *tree = vbpt_tree_create();
+	vbpt_kv_insert(tree, NCOMMITS, NCOMMITS); // avoid an empty root
+	vbpt_mtree_t *mtree = vbpt_mtree_alloc(tree);
+
+	struct vbpt_msnap_policy pol = { .max_nr = SNAP_KEEP };
+	vbpt_mtree_snap_setpolicy(mtree, &pol);
+
+	for (uint64_t i=0; i<NCOMMITS; i++) {
+		commit_key(mtree, i);
+		if ((i+1) % SNAP_EVERY == 0) {
+			char name[VBPT_MSNAP_NAME_LEN];
+			snprintf(name, sizeof(name), "snap-%" PRIu64, i+1);
+			if (vbpt_mtree_snap(mtree, name) != i+1)
+				abort();
+		}
+	}
+
+	if (mtree->mt_snaps_nr != SNAP_KEEP) {
+		fprintf(stderr, "expected %u snapshots, found %u\n",
+		        SNAP_KEEP, mtree->mt_snaps_nr);
+		abort();
+	}
+
+	// time-travel reads
+	for (uint64_t c=SNAP_EVERY; c<=NCOMMITS; c += SNAP_EVERY) {
+		vbpt_tree_t t;
+		bool expired = c <= NCOMMITS - SNAP_KEEP*SNAP_EVERY;
+		if (vbpt_mtree_snap_branch_at(mtree, c, &t)) {
+			if (expired) {
+				fprintf(stderr, "snap:%" PRIu64 " not expired\n", c);
+				abort();
+			}
+			verify_snap(&t, c);
+			vbpt_tree_destroy(&t);
+		} else if (!expired) {
+			fprintf(stderr, "snap:%" PRIu64 " not found\n", c);
+			abort();
+		}
+	}
+
+	// by name, and drop
+	vbpt_tree_t t;
+	if (!vbpt_mtree_snap_branch(mtree, "snap-120", &t))
+		abort();
+	verify_snap(&t, 120);
+	if (!vbpt_mtree_snap_drop(mtree, "snap-120"))
+		abort();
+	// the branch should remain valid after the snapshot is dropped
+	commit_key(mtree, NCOMMITS + 1);
+	verify_snap(&t, 120);
+	vbpt_tree_destroy(&t);
+
+	// memory budget: new commits make the snapshots own their old paths
+	pol.max_nr = 0;
+	pol.max_bytes = 1;
+	vbpt_mtree_snap_setpolicy(mtree, &pol);
+	if (vbpt_mtree_snap_expire(mtree) == 0) {
+		fprintf(stderr, "memory budget did not expire any snapshot\n");
+		abort();
+	}
+
+	vbpt_mtree_dealloc(mtree, NULL);
+	printf("DONE\n");
+	return 0;
+}
@@ -95,6 +95,33 @@ void vbpt_stats_do_report(char *prefix, vbpt_stats_t *st, uint64_t total_ticks)
 	pr_cnt(commit_fail);
 	pr_cnt(commit_merge_ok);
 	pr_cnt(commit_merge_fail);
+	if (st->merge_log_ok || st->merge_log_fail) {
+		pr_cnt(merge_tree_ok);
+		pr_cnt(merge_tree_fail);
+		pr_cnt(merge_log_ok);
+		pr_cnt(merge_log_fail);
+	}
+	if (st->m.swap_done || st->m.swap_partial) {
+		pr_cnt(m.swap_done);
+		pr_cnt(m.swap_partial);
+	}
+	if (st->fc_batches) {
+		pr_cnt(fc_batches);
+		pr_cnt(fc_txs);
+	}
+	if (st->cm_backoffs) {
+		pr_cnt(cm_backoffs);
+		pr_cnt(cm_irrevocable);
+	}
+	if (st->batch_flushes) {
+		pr_cnt(batch_flushes);
+		pr_cnt(batch_txs);
+		pr_cnt(batch_reexecs);
+	}
+	if (st->epoch_retired || st->epoch_reclaimed) {
+		pr_cnt(epoch_retired);
+		pr_cnt(epoch_reclaimed);
+	}
 	//pr_cnt(merge_ok);
 	//pr_cnt(merge_fail);
 	//pr_cnt(m.gc_old);
@@ -117,3 +144,73 @@ void vbpt_stats_report(uint64_t total_ticks)
 	tmsg("VBPT stats\n");
 	vbpt_stats_do_report("  ", &VbptStats, total_ticks);
 }
+
+unsigned VbptMergeHeatShift = 64 - VBPT_MERGE_HEAT_BITS;
+
+/**
+ * make the buckets of the conflict heat map span keys [0, @key_max]
+ *  should be called before the merges
+ */
+void
+vbpt_merge_heat_setup(uint64_t key_max)
+{
+	unsigned shift = 0;
+	while ((key_max >> shift) >= VBPT_MERGE_HEAT_BUCKETS)
+		shift++;
+	VbptMergeHeatShift = shift;
+}
+
+// add the conflict heat map (and join failures) of @src to @dst (e.g., to
+// aggregate threads)
+void
+vbpt_merge_heat_add(vbpt_stats_t *dst, const vbpt_stats_t *src)
+{
+	#if defined(VBPT_STATS)
+	for (unsigned b=0; b<VBPT_MERGE_HEAT_BUCKETS; b++)
+		for (unsigned r=0; r<VBPT_MERGE_CONFLICT_NR; r++)
+			dst->m.heat[b][r] += src->m.heat[b][r];
+	dst->m.join_failed += src->m.join_failed;
+	#endif
+}
+
+static const char *vbpt_merge_conflict_str[] = {
+	[VBPT_MERGE_CONFLICT_RS]        = "rs",
+	[VBPT_MERGE_CONFLICT_BOTH_NULL] = "both_null",
+	[VBPT_MERGE_CONFLICT_PC_NULL]   = "pc_null",
+	[VBPT_MERGE_CONFLICT_GC_NULL]   = "gc_null",
+	[VBPT_MERGE_CONFLICT_LEAF_RS]   = "leaf_rs",
+	[VBPT_MERGE_CONFLICT_REPLACE]   = "replace",
+	[VBPT_MERGE_CONFLICT_DELTAS]    = "deltas",
+	[VBPT_MERGE_CONFLICT_WW]        = "ww",
+	[VBPT_MERGE_CONFLICT_LOG]       = "log",
+};
+
+// print the non-empty buckets of the conflict heat map, and the number of
+// merges that failed before reaching do_merge() (no join point was found,
+// e.g., because it was more than VER_JOIN_LIMIT versions away)
+void
+vbpt_merge_heat_report(char *prefix, const vbpt_stats_t *st)
+{
+	#if defined(VBPT_STATS)
+	if (st->m.join_failed)
+		printf("%sno join point: %" PRIu64 "\n", prefix,
+		       st->m.join_failed);
+	for (unsigned b=0; b<VBPT_MERGE_HEAT_BUCKETS; b++) {
+		const uint64_t *heat = st->m.heat[b];
+		uint64_t total = 0;
+		for (unsigned r=0; r<VBPT_MERGE_CONFLICT_NR; r++)
+			total += heat[r];
+		if (total == 0)
+			continue;
+
+		uint64_t k0 = (uint64_t)b << VbptMergeHeatShift;
+		printf("%s[%#18" PRIx64 "...]: %" PRIu64, prefix, k0, total);
+		for (unsigned r=0; r<VBPT_MERGE_CONFLICT_NR; r++) {
+			if (heat[r])
+				printf(" %s:%" PRIu64,
+				       vbpt_merge_conflict_str[r], heat[r]);
+		}
+		printf("\n");
+	}
+	#endif
+}
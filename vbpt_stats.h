@@ -31,6 +31,45 @@ extern __thread vbpt_stats_t VbptStats;
 // should be declared in a single module
 #define DECLARE_VBPT_STATS() __thread vbpt_stats_t VbptStats
 
+/**
+ * Conflict heat map: merge conflicts (i.e., do_merge() returning -1, and
+ * vbpt_log_conflict() hits of log replay merges), per reason and per key
+ * bucket. A range is assigned to the bucket of its first key:
+ * bucket = key >> VbptMergeHeatShift, where keys past the last bucket are
+ * assigned to the last bucket. By default, the buckets span the whole key
+ * space. Use vbpt_merge_heat_setup() to make them span smaller key spaces.
+ * vbpt_merge_par() adds the conflicts found by its worker threads to the heat
+ * map of the calling thread.
+ */
+enum vbpt_merge_conflict {
+	VBPT_MERGE_CONFLICT_RS = 0,   // read set hit (global tree changed)
+	VBPT_MERGE_CONFLICT_BOTH_NULL,
+	VBPT_MERGE_CONFLICT_PC_NULL,
+	VBPT_MERGE_CONFLICT_GC_NULL,
+	VBPT_MERGE_CONFLICT_LEAF_RS,  // read set hit on a leaf (both changed)
+	VBPT_MERGE_CONFLICT_REPLACE,  // vbpt_cur_replace() failed
+	VBPT_MERGE_CONFLICT_DELTAS,   // vbpt_cur_merge_deltas() failed
+	VBPT_MERGE_CONFLICT_WW,       // write-write (snapshot isolation)
+	VBPT_MERGE_CONFLICT_LOG,      // read set hit in log replay
+	VBPT_MERGE_CONFLICT_NR
+};
+
+#define VBPT_MERGE_HEAT_BITS    6
+#define VBPT_MERGE_HEAT_BUCKETS (1UL << VBPT_MERGE_HEAT_BITS)
+
+extern unsigned VbptMergeHeatShift;
+
+void vbpt_merge_heat_setup(uint64_t key_max);
+void vbpt_merge_heat_add(vbpt_stats_t *dst, const vbpt_stats_t *src);
+void vbpt_merge_heat_report(char *prefix, const vbpt_stats_t *st);
+
+static inline unsigned
+vbpt_merge_heat_bucket(uint64_t key)
+{
+	uint64_t b = key >> VbptMergeHeatShift;
+	return b < VBPT_MERGE_HEAT_BUCKETS ? b : VBPT_MERGE_HEAT_BUCKETS - 1;
+}
+
 struct vbpt_merge_stats {
 	#if defined(VBPT_STATS)
 	uint64_t gc_old;
@@ -42,6 +81,11 @@ struct vbpt_merge_stats {
 	uint64_t merge_steps_max;
 	uint64_t merges;
 	uint64_t join_failed;
+	uint64_t par_tasks;
+	uint64_t deltas_merged;
+	uint64_t swap_done;     // merges completed by merge_swap()
+	uint64_t swap_partial;
+	uint64_t heat[VBPT_MERGE_HEAT_BUCKETS][VBPT_MERGE_CONFLICT_NR];
 	tsc_t    vbpt_merge;
 	tsc_t    cur_down;
 	tsc_t    cur_next;
@@ -79,6 +123,19 @@ struct vbpt_stats {
 	uint64_t                 commit_merge_fail;
 	uint64_t                 merge_ok;
 	uint64_t                 merge_fail;
+	uint64_t                 merge_tree_ok;   // vbpt_merge()
+	uint64_t                 merge_tree_fail;
+	uint64_t                 merge_log_ok;    // vbpt_log_merge()
+	uint64_t                 merge_log_fail;
+	uint64_t                 fc_batches;      // combining commits
+	uint64_t                 fc_txs;
+	uint64_t                 cm_backoffs;     // contention manager
+	uint64_t                 cm_irrevocable;
+	uint64_t                 batch_flushes;   // batched commits
+	uint64_t                 batch_txs;
+	uint64_t                 batch_reexecs;
+	uint64_t                 epoch_retired;
+	uint64_t                 epoch_reclaimed;
 	struct vbpt_merge_stats  m;
 	xcnt_t                   ver_tree_gc_iters;
 	xcnt_t                   merge_iters;
@@ -114,6 +171,7 @@ vbpt_stats_get(vbpt_stats_t *stats)
 	} while (0)
 
 #define VBPT_INC_COUNTER(_x)  ((VbptStats._x)++)
+#define VBPT_ADD_COUNTER(_x, v)  ((VbptStats._x) += v)
 
 #define VBPT_MERGE_START_TIMER(_x)                    \
 	do {                                          \
@@ -127,14 +185,18 @@ vbpt_stats_get(vbpt_stats_t *stats)
 
 #define VBPT_MERGE_INC_COUNTER(_x)     ((VbptStats.m._x)++)
 #define VBPT_MERGE_ADD_COUNTER(_x, v)  ((VbptStats.m._x) += v)
+#define VBPT_MERGE_HEAT_INC(_key, _reason) \
+	((VbptStats.m.heat[vbpt_merge_heat_bucket(_key)][_reason])++)
 #else // !VBPT_STATS
 #define VBPT_START_TIMER(_x)  do { ; } while (0)
 #define VBPT_STOP_TIMER(_x)   do { ; } while (0)
 #define VBPT_INC_COUNTER(_x)  do { ; } while (0)
+#define VBPT_ADD_COUNTER(_x, v)  do { ; } while (0)
 #define VBPT_MERGE_START_TIMER(_x) do {;} while (0)
 #define VBPT_MERGE_STOP_TIMER(_x)  do {;} while (0)
 #define VBPT_MERGE_INC_COUNTER(_x) do {;} while (0)
 #define VBPT_MERGE_ADD_COUNTER(_x, v)  do {;} while (0)
+#define VBPT_MERGE_HEAT_INC(_key, _reason)  do {;} while (0)
 #define VBPT_XCNT_ADD(_x, val)  do {;} while(0)
 #endif // VBPT_STATS
 
@@ -11,9 +11,13 @@
 #ifndef VBPT_TEST_H
 #define VBPT_TEST_H
 
+#include <stdio.h>
+
 #include "vbpt.h"
 #include "vbpt_log.h"
 #include "vbpt_kv.h"
+#include "vbpt_mtree.h"
+#include "vbpt_tx.h"
 #include "xdist.h" // needed for _rand() functions
 
 // vbpt helpers aimed mostly at running tests
@@ -104,4 +108,63 @@ vbpt_logtree_kv_inc_rand(vbpt_tree_t *t, struct xdist_desc *d)
 	}
 }
 
+// transaction helpers
+
+// create a tree with keys [0, @nkeys), each with its key as a value
+static inline vbpt_tree_t *
+vbpt_tree_create_seq(uint64_t nkeys)
+{
+	vbpt_tree_t *tree = vbpt_tree_create();
+	for (uint64_t k=0; k<nkeys; k++) {
+		vbpt_leaf_t *leaf = vbpt_leaf_alloc(0, tree->ver);
+		leaf->val = k;
+		vbpt_insert(tree, k, leaf, NULL);
+	}
+	return tree;
+}
+
+static inline void
+vbpt_txt_write_val(vbpt_txtree_t *txt, uint64_t key, uint64_t val)
+{
+	vbpt_leaf_t *leaf = vbpt_leaf_alloc(0, txt->tree->ver);
+	leaf->val = val;
+	vbpt_logtree_insert(txt->tree, key, leaf, NULL);
+}
+
+// finalize and commit @txt, and abort if the result is not @expected
+static inline void
+vbpt_txt_commit_expect(vbpt_txtree_t *txt, vbpt_mtree_t *mtree,
+                       unsigned merge_repeats, vbpt_txt_res_t expected)
+{
+	vbpt_logtree_finalize(txt->tree);
+	vbpt_txt_res_t ret = vbpt_txt_try_commit(txt, mtree, merge_repeats);
+	if (ret != expected) {
+		fprintf(stderr, "commit: %s (expected: %s)\n",
+		        vbpt_txt_res2str[ret], vbpt_txt_res2str[expected]);
+		abort();
+	}
+}
+
+// value of @key in the current version of @mtree (UINT64_MAX if not found)
+static inline uint64_t
+vbpt_mtree_get_val(vbpt_mtree_t *mtree, uint64_t key)
+{
+	vbpt_tree_t tree;
+	vbpt_rotx_begin(mtree, &tree);
+	vbpt_leaf_t *leaf = vbpt_get(&tree, key);
+	uint64_t ret = leaf ? leaf->val : UINT64_MAX;
+	vbpt_rotx_end(mtree, &tree);
+	return ret;
+}
+
+static inline uint64_t
+vbpt_mtree_kv_get(vbpt_mtree_t *mtree, uint64_t key)
+{
+	vbpt_tree_t tree;
+	vbpt_rotx_begin(mtree, &tree);
+	uint64_t ret = vbpt_kv_get(&tree, key);
+	vbpt_rotx_end(mtree, &tree);
+	return ret;
+}
+
 #endif
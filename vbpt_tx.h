@@ -11,9 +11,15 @@
 #ifndef VBPT_TX_
 #define VBPT_TX_
 
+#include <pthread.h>
+#include <sched.h>
+
 #include "vbpt.h"
 #include "vbpt_log.h"
+#include "vbpt_merge.h"
 #include "vbpt_mtree.h"
+#include "vbpt_mm.h"
+#include "processor.h"
 
 /**
  * a transaction on a vbpt tree
@@ -22,31 +28,76 @@
  *              via txt_tree and txt_depth, but we keep it for convience. Since
  *              it is redundant, we do not keep a reference to it
  *  @txt_tree: current tree
+ *  @parent:   parent transaction, for nested transactions (NULL otherwise)
+ *  @nlock:    serializes branching and committing of nested transactions
+ *  @nested:   number of open nested transactions (protected by @nlock)
  */
 struct vbpt_txtree {
 	ver_t       *bver;
 	unsigned    depth;
 	vbpt_tree_t *tree;
+	struct vbpt_txtree *parent;
+	spinlock_t  nlock;
+	unsigned    nested;
 };
 typedef struct vbpt_txtree vbpt_txtree_t;
 
 static inline vbpt_txtree_t *
-vbpt_txtree_alloc(vbpt_mtree_t *mtree)
+vbpt_txtree_alloc__(vbpt_mtree_t *mtree, bool irrevocable)
 {
 	//VBPT_START_TIMER(txtree_alloc);
 	vbpt_txtree_t *ret = xmalloc(sizeof(vbpt_txtree_t));
 
 	vbpt_tree_t *tree = vbpt_tree_alloc(NULL); // allocate a dummy tree
+	if (irrevocable)
+		vbpt_mtree_irrevocable_begin(mtree, tree);
 	vbpt_mtree_branch(mtree, tree);
 	vbpt_logtree_log_init(tree);
+	vbpt_log_set_iso(vbpt_tree_log(tree), mtree->mt_iso);
 
 	ret->tree = tree;
 	ret->depth = 1;
 	ret->bver = tree->ver->parent;
+	ret->parent = NULL;
+	spinlock_init(&ret->nlock);
+	ret->nested = 0;
 	//VBPT_STOP_TIMER(txtree_alloc);
 	return ret;
 }
 
+static inline vbpt_txtree_t *
+vbpt_txtree_alloc(vbpt_mtree_t *mtree)
+{
+	return vbpt_txtree_alloc__(mtree, false);
+}
+
+/**
+ * allocate an irrevocable transaction: it holds the irrevocable token of
+ * @mtree until it commits, so it will commit without merging (see
+ * vbpt_mtree_irrevocable_begin()). Other commits wait until then.
+ */
+static inline vbpt_txtree_t *
+vbpt_txtree_alloc_irrevocable(vbpt_mtree_t *mtree)
+{
+	return vbpt_txtree_alloc__(mtree, true);
+}
+
+/**
+ * set the isolation level of @txt (VBPT_LOG_ISO_*), overriding the default of
+ * its mtree (->mt_iso)
+ *  should be called before @txt performs any operation
+ *
+ * Under snapshot isolation (VBPT_LOG_ISO_SNAPSHOT), the transaction does not
+ * log its reads, and a commit fails only if a concurrent commit wrote or
+ * deleted a key that the transaction also wrote or deleted. Read-write
+ * conflicts (e.g., write skew) are not detected.
+ */
+static inline void
+vbpt_txt_set_iso(vbpt_txtree_t *txt, unsigned iso)
+{
+	vbpt_log_set_iso(vbpt_tree_log(txt->tree), iso);
+}
+
 
 static inline void
 vbpt_txtree_dealloc(vbpt_txtree_t *txt)
@@ -57,6 +108,48 @@ vbpt_txtree_dealloc(vbpt_txtree_t *txt)
 	//VBPT_STOP_TIMER(txtree_dealloc);
 }
 
+/**
+ * read-only transactions
+ *
+ * A read-only transaction reads a snapshot of the mtree's current tree. It
+ * does not need a version, a log, or a commit: the snapshot is consistent, and
+ * it has nothing to publish. vbpt_rotx_begin() initializes @tree to the
+ * snapshot, which should only be read using vbpt_get() (or vbpt_kv_get()),
+ * until vbpt_rotx_end() is called.
+ *
+ * In the epoch modes, the root is borrowed within an epoch. Otherwise, we grab
+ * a reference to the root under the mtree lock. In both cases, the snapshot
+ * does not hold a reference to the version, so @tree->ver is NULL.
+ */
+static inline void
+vbpt_rotx_begin(vbpt_mtree_t *mtree, vbpt_tree_t *tree)
+{
+	if (vbpt_mtree_epoch(mtree)) {
+		vbpt_epoch_enter();
+		vbpt_tree_t *mt_tree = mtree->mt_tree;
+		tree->root = mt_tree->root;
+		tree->height = mt_tree->height;
+	} else {
+		spin_lock(&mtree->mt_lock);
+		vbpt_node_t *root = mtree->mt_tree->root;
+		tree->root = root ? vbpt_node_getref(root) : NULL;
+		tree->height = mtree->mt_tree->height;
+		spin_unlock(&mtree->mt_lock);
+	}
+	tree->ver = NULL;
+	tree->root_epoch = false;
+}
+
+static inline void
+vbpt_rotx_end(vbpt_mtree_t *mtree, vbpt_tree_t *tree)
+{
+	if (vbpt_mtree_epoch(mtree))
+		vbpt_epoch_exit();
+	else if (tree->root != NULL)
+		vbpt_node_putref(tree->root);
+	tree->root = NULL;
+}
+
 /* transaction result */
 typedef enum {
 	VBPT_COMMIT_OK     =       0,
@@ -95,6 +188,285 @@ vbpt_txt_update_stats(vbpt_txt_res_t ret)
 	}
 }
 
+/**
+ * choose between a structural merge (vbpt_merge_vj()) and replaying the
+ * transaction's log on @gtree (vbpt_log_merge())
+ *
+ * Both merges visit (roughly) a path of the tree for each key they process.
+ * The structural merge processes the keys modified by either side since the
+ * join point, while the replay processes the keys modified by the transaction,
+ * but each of them is a COW insert, which we estimate to be
+ * VBPT_TXT_REPLAY_COST times more expensive than a cursor step. Replay also
+ * checks the transaction's logs against the @g_dist global logs for
+ * conflicts. Snapshot isolation transactions always use the structural merge.
+ */
+#define VBPT_TXT_REPLAY_COST 4
+
+static inline bool
+vbpt_txt_merge_replay(vbpt_txtree_t *txt, const vbpt_tree_t *gtree,
+                      uint16_t g_dist)
+{
+	vbpt_log_t *p_log = vbpt_tree_log(txt->tree);
+	vbpt_log_t *g_log = vbpt_tree_log((vbpt_tree_t *)gtree);
+	// vbpt_log_replay() keeps the keys of the replayed logs on the stack
+	if (g_dist == VER_DIST_FAIL || txt->depth > VER_JOIN_LIMIT ||
+	    vbpt_log_si(p_log) || !vbpt_log_replayable(p_log, txt->depth))
+		return false;
+
+	uint64_t height = gtree->height;
+	uint64_t p_wr = vbpt_log_wr_size(p_log, txt->depth);
+	uint64_t g_wr = vbpt_log_wr_size(g_log, g_dist);
+	uint64_t cost_tree = height*(g_wr + p_wr);
+	uint64_t cost_log  = height*p_wr*VBPT_TXT_REPLAY_COST
+	                     + (uint64_t)g_dist*txt->depth;
+	return cost_log < cost_tree;
+}
+
+/**
+ * merge the transaction's tree with @gtree, a newer version of the mtree
+ *  The join point is the transaction's base version (@bver), from which
+ *  @gtree's version descends. If the merge is successful @bver is updated to
+ *  @gtree's version, which is the join point for subsequent merges.
+ */
+static inline bool
+vbpt_txt_merge(vbpt_txtree_t *txt, const vbpt_tree_t *gtree, ver_t **bver)
+{
+	uint16_t g_dist = ver_dist_limit(*bver, gtree->ver, VER_JOIN_LIMIT);
+	bool ret;
+	if (vbpt_txt_merge_replay(txt, gtree, g_dist)) {
+		ret = vbpt_log_merge_vj(gtree, txt->tree, bver,
+		                        *bver, g_dist, txt->depth);
+		if (ret)
+			VBPT_INC_COUNTER(merge_log_ok);
+		else
+			VBPT_INC_COUNTER(merge_log_fail);
+	} else {
+		ret = vbpt_merge_vj(gtree, txt->tree, bver,
+		                    *bver, g_dist, txt->depth);
+		if (ret)
+			VBPT_INC_COUNTER(merge_tree_ok);
+		else
+			VBPT_INC_COUNTER(merge_tree_fail);
+	}
+	return ret;
+}
+
+/**
+ * copy the current tree of @mt to @gtree, and prepare a rebase on its version
+ * (so that it is not removed from the version chain while we use it)
+ *  caller should call ver_rebase_abort() on @gtree's version, if it does not
+ *  merge, and vbpt_tree_destroy() on @gtree.
+ */
+static inline void
+vbpt_txt_gtree(vbpt_mtree_t *mt, vbpt_tree_t *gtree)
+{
+	if (mt->mt_mm == VBPT_MTREE_MM_EPOCH_CAS) {
+		vbpt_epoch_enter();
+		vbpt_tree_copy(gtree, mt->mt_tree);
+		ver_rebase_prepare(gtree->ver);
+		vbpt_epoch_exit();
+	} else {
+		spin_lock(&mt->mt_lock);
+		vbpt_tree_copy(gtree, mt->mt_tree);
+		ver_rebase_prepare(gtree->ver);
+		spin_unlock(&mt->mt_lock);
+	}
+}
+
+/**
+ * Early conflict detection
+ *
+ * A transaction that is doomed to fail (i.e., it read something that was
+ * committed after its base version) finds out only when it tries to commit.
+ * Long transactions can call vbpt_txt_validate() while running, to check
+ * their reads so far against the logs of the versions committed since their
+ * base version, without merging. If the check fails, the transaction can be
+ * aborted early. Alternatively, vbpt_txt_rebase() merges the transaction with
+ * the current tree, so that later validations and the commit only need to
+ * consider newer commits. Snapshot isolation transactions do not log reads,
+ * so their validation succeeds unless they are too far behind (see below).
+ */
+
+/**
+ * returns false if @txt's reads conflict with commits on @mt after @txt's base
+ * version. If the distance to the current version exceeds VER_JOIN_LIMIT, the
+ * logs are not checked, and false is returned: the merge of the commit (or of
+ * vbpt_txt_rebase()) would not find the join point either.
+ *  (this is the conflict check of vbpt_log_merge())
+ */
+static inline bool
+vbpt_txt_validate(vbpt_txtree_t *txt, vbpt_mtree_t *mt)
+{
+	vbpt_tree_t gtree;
+	bool ret = true;
+
+	vbpt_txt_gtree(mt, &gtree);
+	if (!ver_eq(gtree.ver, txt->bver)) {
+		uint16_t g_dist;
+		g_dist = ver_dist_limit(txt->bver, gtree.ver, VER_JOIN_LIMIT);
+		ret = (g_dist != VER_DIST_FAIL) &&
+		      !vbpt_log_conflict(vbpt_tree_log(txt->tree), txt->depth,
+		                         vbpt_tree_log(&gtree), g_dist, NULL);
+	}
+	ver_rebase_abort(gtree.ver);
+	vbpt_tree_destroy(&gtree);
+	return ret;
+}
+
+/**
+ * merge @txt with the current tree of @mt, and make it its base version
+ *  On failure, @txt is finalized and released (as in vbpt_txt_try_commit()),
+ *  and false is returned.
+ */
+static inline bool
+vbpt_txt_rebase(vbpt_txtree_t *txt, vbpt_mtree_t *mt)
+{
+	vbpt_tree_t gtree;
+	bool ret = true;
+
+	vbpt_txt_gtree(mt, &gtree);
+	if (ver_eq(gtree.ver, txt->bver))
+		ver_rebase_abort(gtree.ver);
+	else
+		ret = vbpt_txt_merge(txt, &gtree, &txt->bver);
+	vbpt_tree_destroy(&gtree);
+
+	if (!ret) {
+		vbpt_logtree_finalize(txt->tree);
+		ver_detach(txt->tree->ver);
+		vbpt_tree_dealloc(txt->tree);
+		free(txt);
+	}
+	return ret;
+}
+
+/**
+ * Nested transactions
+ *
+ * A transaction (the parent) can fan out work to nested transactions, e.g.,
+ * running in parallel. Each nested transaction branches off the parent's tree,
+ * and, when it commits, it is merged into the parent's tree similarly to a
+ * commit on an mtree: if another nested transaction has committed since it
+ * branched, vbpt_txt_merge() merges it on top of the parent's tree, checking
+ * its log against the logs of the nested transactions that committed before
+ * it. The parent's tree then becomes the nested transaction's tree, so the
+ * parent's version chain (and its ->depth) grows by the versions of the
+ * nested transaction, and the logs of all of them are considered when the
+ * parent commits (see the @depth argument of vbpt_log_*_exists()).
+ *
+ * The parent's tree is shared with its nested transactions, so it is frozen
+ * while they run: vbpt_txt_begin_nested() finalizes its log. The parent may
+ * continue with its own operations after calling vbpt_txt_resume() (which
+ * branches a new version for them), and may commit only after all of its
+ * nested transactions have committed or aborted (see the note of
+ * vbpt_merge()).
+ *
+ * Nested transactions are begun by the parent's thread, but may run, and
+ * commit, on other threads. In the epoch modes, the parent's root might be
+ * borrowed within that thread's epoch, so vbpt_txt_begin_nested() grabs a
+ * reference to it.
+ */
+
+/**
+ * begin a transaction nested in @parent
+ *  The nested transaction inherits @parent's isolation level
+ */
+static inline vbpt_txtree_t *
+vbpt_txt_begin_nested(vbpt_txtree_t *parent)
+{
+	vbpt_txtree_t *ret = xmalloc(sizeof(vbpt_txtree_t));
+
+	spin_lock(&parent->nlock);
+	vbpt_log_t *plog = vbpt_tree_log(parent->tree);
+	if (plog->state == VBPT_LOG_STARTED)
+		vbpt_log_finalize(plog);
+	// a nested transaction committing on another thread releases the
+	// parent's tree, so its root cannot remain borrowed
+	vbpt_tree_root_own(parent->tree);
+	ret->tree = vbpt_logtree_branch(parent->tree);
+	parent->nested++;
+	spin_unlock(&parent->nlock);
+
+	vbpt_log_set_iso(vbpt_tree_log(ret->tree), plog->iso);
+	ret->depth = 1;
+	ret->bver = ret->tree->ver->parent;
+	ret->parent = parent;
+	spinlock_init(&ret->nlock);
+	ret->nested = 0;
+	return ret;
+}
+
+/**
+ * commit (finalized) nested transaction @txt to its parent
+ *  returns false if @txt conflicts with nested transactions that committed
+ *  after it began. In both cases, @txt is released.
+ */
+static inline bool
+vbpt_txt_commit_nested(vbpt_txtree_t *txt)
+{
+	vbpt_txtree_t *parent = txt->parent;
+	bool ret = true;
+
+	assert(txt->nested == 0);
+	spin_lock(&parent->nlock);
+	vbpt_tree_t *ptree = parent->tree;
+	if (!ver_eq(ptree->ver, txt->bver)) {
+		ver_rebase_prepare(ptree->ver);
+		ret = vbpt_txt_merge(txt, ptree, &txt->bver);
+	}
+	if (ret) {
+		parent->tree = txt->tree;
+		parent->depth += txt->depth;
+	}
+	parent->nested--;
+	spin_unlock(&parent->nlock);
+
+	if (ret) {
+		vbpt_tree_dealloc(ptree);
+	} else {
+		ver_detach(txt->tree->ver);
+		vbpt_tree_dealloc(txt->tree);
+	}
+	free(txt);
+	return ret;
+}
+
+/**
+ * abort nested transaction @txt
+ */
+static inline void
+vbpt_txt_abort_nested(vbpt_txtree_t *txt)
+{
+	vbpt_txtree_t *parent = txt->parent;
+
+	assert(txt->nested == 0);
+	vbpt_log_t *log = vbpt_tree_log(txt->tree);
+	if (log->state == VBPT_LOG_STARTED)
+		vbpt_log_finalize(log);
+	ver_detach(txt->tree->ver);
+	vbpt_tree_dealloc(txt->tree);
+	free(txt);
+
+	spin_lock(&parent->nlock);
+	parent->nested--;
+	spin_unlock(&parent->nlock);
+}
+
+/**
+ * resume operations on @txt after its nested transactions have finished
+ */
+static inline void
+vbpt_txt_resume(vbpt_txtree_t *txt)
+{
+	assert(txt->nested == 0);
+	assert(vbpt_tree_log(txt->tree)->state == VBPT_LOG_FINALIZED);
+	vbpt_tree_t *old = txt->tree;
+	txt->tree = vbpt_logtree_branch(old);
+	vbpt_log_set_iso(vbpt_tree_log(txt->tree), vbpt_tree_log(old)->iso);
+	vbpt_tree_dealloc(old);
+	txt->depth++;
+}
+
 // There are two, unimaginatively named, functions to commit
 //
 // -vbpt_tx_try_commit (using vbpt_mtree_try_commit):
@@ -127,10 +499,10 @@ vbpt_txt_try_commit(vbpt_txtree_t *txt,
 		}
 
 		ret = VBPT_COMMIT_MERGED;
-		// try to merge (TODO: we know Vj, implement better merge)
+		// try to merge (we know Vj: it's @bver)
 		//tmsg("trying to merge %zd to %zd\n",
 		//      tx_tree->ver->v_id, gtree.ver->v_id);
-		bool ret_merge = vbpt_merge(&gtree, tx_tree, &bver);
+		bool ret_merge = vbpt_txt_merge(txt, &gtree, &bver);
 		vbpt_tree_destroy(&gtree);
 		if (!ret_merge) {
 			ret = VBPT_COMMIT_MERGE_FAILED;
@@ -150,10 +522,14 @@ vbpt_txt_try_commit(vbpt_txtree_t *txt,
 	}
 
 	/* failure */
+	// the irrevocable token (if we hold it) is identified by @tx_tree
+	vbpt_mtree_irrevocable_end(mt, tx_tree);
 	ver_detach(tx_tree->ver);
 	vbpt_tree_dealloc(tx_tree);
 success:
 	VBPT_XCNT_ADD(merge_iters, cnt);
+	// release (part of) the nodes freed by this or previous transactions
+	vbpt_mm_reclaim(VBPT_MM_RECLAIM_BUDGET);
 	free(txt);
 	vbpt_txt_update_stats(ret);
 	VBPT_STOP_TIMER(txt_try_commit);
@@ -173,13 +549,13 @@ vbpt_txt_try_commit2(vbpt_txtree_t *txt, vbpt_mtree_t *mt)
 
 	// try to commit
 	if (vbpt_mtree_try_commit3(mt, tx_tree, bver, &old_tree)) {
-		vbpt_tree_dealloc(old_tree);
+		vbpt_mtree_tree_release(mt, old_tree);
 		result = VBPT_COMMIT_OK;
 		goto success;
 	}
 
 	// still holding the lock, try to merge
-	if (vbpt_merge(old_tree, tx_tree, &bver)) {
+	if (vbpt_txt_merge(txt, old_tree, &bver)) {
 		// merge succeeded
 		vbpt_tree_t *old_tree2;
 		bool ret;
@@ -193,7 +569,7 @@ vbpt_txt_try_commit2(vbpt_txtree_t *txt, vbpt_mtree_t *mt)
 		}
 		assert(old_tree == old_tree2);
 
-		vbpt_tree_dealloc(old_tree);
+		vbpt_mtree_tree_release(mt, old_tree);
 		result = VBPT_COMMIT_MERGED;
 		goto success;
 	}
@@ -205,11 +581,591 @@ vbpt_txt_try_commit2(vbpt_txtree_t *txt, vbpt_mtree_t *mt)
 	vbpt_tree_dealloc(tx_tree);
 
 success:
+	vbpt_mm_reclaim(VBPT_MM_RECLAIM_BUDGET);
 	free(txt);
 	vbpt_txt_update_stats(result);
 	VBPT_STOP_TIMER(txt_try_commit);
 	return result;
 }
 
-#endif /* VBPT_TX_ */
+// -vbpt_txt_try_commit_fc (flat combining):
+//     queues the transaction on the mtree, and tries to take tx_lock. The
+//     thread that takes the lock (the combiner) commits all queued
+//     transactions: it merges each of them on top of the previous one (or the
+//     mtree's tree for the first), and publishes the result as a single new
+//     version. Each waiting thread gets the result of its transaction.
+//
+//     Similarly to vbpt_txt_try_commit2(), it assumes that all committers
+//     hold tx_lock.
+
+/**
+ * a queued transaction
+ *  @done is set after the combiner has committed (or failed) the transaction,
+ *  and @res holds the result
+ */
+struct vbpt_txt_fc {
+	vbpt_txtree_t      *txt;
+	struct vbpt_txt_fc *next;
+	vbpt_txt_res_t     res;
+	volatile bool      done;
+};
+
+/**
+ * commit @txt on top of @top (either the mtree's tree, or the last combined
+ * transaction), without publishing it
+ *  on failure, the transaction's tree is released
+ */
+static inline vbpt_txt_res_t
+vbpt_txt_fc_commit1(vbpt_txtree_t *txt, vbpt_tree_t *top)
+{
+	if (ver_eq(top->ver, txt->bver))
+		return VBPT_COMMIT_OK;
+
+	ver_t *bver = txt->bver;
+	ver_rebase_prepare(top->ver);
+	if (vbpt_txt_merge(txt, top, &bver))
+		return VBPT_COMMIT_MERGED;
 
+	ver_detach(txt->tree->ver);
+	vbpt_tree_dealloc(txt->tree);
+	return VBPT_COMMIT_MERGE_FAILED;
+}
+
+/**
+ * commit all queued transactions of @mt
+ *  caller holds ->tx_lock
+ */
+static inline void
+vbpt_txt_fc_combine(vbpt_mtree_t *mt)
+{
+	struct vbpt_txt_fc *fc, *reqs = NULL;
+
+	// grab the queue, and reverse it to commit in arrival order
+	fc = __sync_lock_test_and_set(&mt->mt_fc, NULL);
+	while (fc != NULL) {
+		struct vbpt_txt_fc *next = fc->next;
+		fc->next = reqs;
+		reqs = fc;
+		fc = next;
+	}
+	if (reqs == NULL)
+		return;
+
+	assert(mt->mt_mm != VBPT_MTREE_MM_EPOCH_CAS);
+	vbpt_tree_t *top = mt->mt_tree; // stable: we hold tx_lock
+	vbpt_tree_t *cur = NULL;        // last combined transaction tree
+	unsigned committed = 0, txs = 0;
+	for (fc = reqs; fc != NULL; fc = fc->next) {
+		vbpt_txtree_t *txt = fc->txt;
+		txs++;
+		fc->res = vbpt_txt_fc_commit1(txt, cur ? cur : top);
+		if (fc->res == VBPT_COMMIT_MERGE_FAILED)
+			continue;
+		// the previous combined tree is now an ancestor of @txt's,
+		// and nobody else has seen it
+		if (cur)
+			vbpt_tree_dealloc(cur);
+		cur = txt->tree;
+		committed++;
+	}
+
+	if (cur) {
+		ver_t *ver_new = cur->ver;
+		vbpt_mtree_commit_lock(mt, cur);
+		assert(mt->mt_tree == top);
+		mt->mt_tree = cur;
+		mt->mt_commits += committed;
+		spin_unlock(&mt->mt_lock);
+
+		ver_pin(ver_new, top->ver);
+		if (spin_try_lock(&mt->gc_lock)) {
+			ver_tree_gc(ver_new);
+			spin_unlock(&mt->gc_lock);
+		}
+		vbpt_mtree_tree_release(mt, top);
+	}
+	VBPT_INC_COUNTER(fc_batches);
+	VBPT_ADD_COUNTER(fc_txs, txs);
+
+	// notify the waiters: they might return as soon as ->done is set, so we
+	// can't touch the requests afterwards
+	__sync_synchronize();
+	for (fc = reqs; fc != NULL; ) {
+		struct vbpt_txt_fc *next = fc->next;
+		free(fc->txt);
+		fc->done = true;
+		fc = next;
+	}
+}
+
+/**
+ * queue @fc's transaction on @mt
+ */
+static inline void
+vbpt_txt_fc_push(struct vbpt_txt_fc *fc, vbpt_mtree_t *mt)
+{
+	// epochs are per-thread: the combiner can't release a borrowed root
+	vbpt_tree_root_own(fc->txt->tree);
+
+	struct vbpt_txt_fc *head;
+	fc->done = false;
+	do {
+		head = mt->mt_fc;
+		fc->next = head;
+	} while (!__sync_bool_compare_and_swap(&mt->mt_fc, head, fc));
+}
+
+/**
+ * wait until @fc is done, combining if nobody else does
+ */
+static inline vbpt_txt_res_t
+vbpt_txt_fc_wait(struct vbpt_txt_fc *fc, vbpt_mtree_t *mt)
+{
+	while (!fc->done) {
+		if (spin_try_lock(&mt->tx_lock)) {
+			vbpt_txt_fc_combine(mt);
+			spin_unlock(&mt->tx_lock);
+		} else {
+			relax_cpu();
+		}
+	}
+	__sync_synchronize();
+
+	vbpt_mm_reclaim(VBPT_MM_RECLAIM_BUDGET);
+	vbpt_txt_update_stats(fc->res);
+	return fc->res;
+}
+
+static inline vbpt_txt_res_t
+vbpt_txt_try_commit_fc(vbpt_txtree_t *txt, vbpt_mtree_t *mt)
+{
+	VBPT_START_TIMER(txt_try_commit);
+	struct vbpt_txt_fc fc = {.txt = txt};
+	vbpt_txt_fc_push(&fc, mt);
+	vbpt_txt_res_t ret = vbpt_txt_fc_wait(&fc, mt);
+	VBPT_STOP_TIMER(txt_try_commit);
+	return ret;
+}
+
+// -vbpt_txt_commit_async (asynchronous commit):
+//     queues the transaction as vbpt_txt_try_commit_fc() does, but returns
+//     a handle instead of waiting. The caller can start its next transaction,
+//     and later poll (vbpt_txt_async_done()) or wait (vbpt_txt_async_wait())
+//     for the result.
+//
+//     The queue is processed by a committer thread (vbpt_txt_committer_start())
+//     that holds ->tx_lock for its whole lifetime, i.e., it owns the mtree's
+//     tree, and does all merges and version GC. Without a committer, the
+//     waiters combine.
+//
+//     As with flat combining, all committers of the mtree need to use
+//     ->tx_lock (i.e., vbpt_txt_try_commit_fc() or vbpt_txt_commit_async()).
+//     Note that a transaction started before the previous one of the same
+//     thread is committed does not see its changes, so it might need to merge
+//     with it.
+
+typedef struct vbpt_txt_fc vbpt_txt_handle_t;
+
+static inline vbpt_txt_handle_t *
+vbpt_txt_commit_async(vbpt_txtree_t *txt, vbpt_mtree_t *mt)
+{
+	vbpt_txt_handle_t *h = xmalloc(sizeof(*h));
+	h->txt = txt;
+	vbpt_txt_fc_push(h, mt);
+	return h;
+}
+
+static inline bool
+vbpt_txt_async_done(vbpt_txt_handle_t *h)
+{
+	return h->done;
+}
+
+/**
+ * wait for the result of an asynchronous commit, and release the handle
+ */
+static inline vbpt_txt_res_t
+vbpt_txt_async_wait(vbpt_txt_handle_t *h, vbpt_mtree_t *mt)
+{
+	VBPT_START_TIMER(txt_try_commit);
+	vbpt_txt_res_t ret = vbpt_txt_fc_wait(h, mt);
+	free(h);
+	VBPT_STOP_TIMER(txt_try_commit);
+	return ret;
+}
+
+/**
+ * committer thread of an mtree
+ */
+struct vbpt_txt_committer {
+	vbpt_mtree_t  *mt;
+	pthread_t     thread;
+	volatile bool stop;
+};
+typedef struct vbpt_txt_committer vbpt_txt_committer_t;
+
+// number of empty polls before the committer yields the cpu
+#define VBPT_TXT_COMMITTER_SPINS 1024
+
+static inline void *
+vbpt_txt_committer_thr(void *arg)
+{
+	vbpt_txt_committer_t *c = (vbpt_txt_committer_t *)arg;
+	vbpt_mtree_t *mt = c->mt;
+
+	vbpt_mm_init();
+	spin_lock(&mt->tx_lock);
+	unsigned idle = 0;
+	for (;;) {
+		if (mt->mt_fc != NULL) {
+			vbpt_txt_fc_combine(mt);
+			vbpt_mm_reclaim(VBPT_MM_RECLAIM_BUDGET);
+			idle = 0;
+		} else if (c->stop) {
+			break;
+		} else if (++idle < VBPT_TXT_COMMITTER_SPINS) {
+			relax_cpu();
+		} else {
+			sched_yield();
+			idle = 0;
+		}
+	}
+	spin_unlock(&mt->tx_lock);
+
+	vbpt_mm_shut();
+	vbpt_epoch_thr_unregister();
+	return NULL;
+}
+
+static inline vbpt_txt_committer_t *
+vbpt_txt_committer_start(vbpt_mtree_t *mt)
+{
+	vbpt_txt_committer_t *c = xmalloc(sizeof(*c));
+	c->mt = mt;
+	c->stop = false;
+	if (pthread_create(&c->thread, NULL, vbpt_txt_committer_thr, c) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+	return c;
+}
+
+/**
+ * stop the committer, after it has processed all queued transactions
+ *  (transactions queued afterwards are combined by their waiters)
+ */
+static inline void
+vbpt_txt_committer_stop(vbpt_txt_committer_t *c)
+{
+	c->stop = true;
+	pthread_join(c->thread, NULL);
+	free(c);
+}
+
+/**
+ * Contention manager
+ *
+ * Transactions that fail to commit are re-executed by the caller. Under
+ * contention, re-executing immediately mostly leads to more failures, and
+ * long transactions might never commit. The contention manager:
+ *  - backs off exponentially: after the n-th consecutive failure, it spins for
+ *    a random number of ticks in [0, VBPT_TXT_CM_BACKOFF << n). The exponent
+ *    is increased by up to VBPT_TXT_CM_RATE_EXP, depending on the estimated
+ *    abort rate of the mtree.
+ *  - after VBPT_TXT_CM_IRREVOCABLE consecutive failures, executes the
+ *    transaction irrevocably (see vbpt_txtree_alloc_irrevocable()). Lock-free
+ *    commits ignore the irrevocable token, so in VBPT_MTREE_MM_EPOCH_CAS mode
+ *    the contention manager only backs off.
+ *
+ * Usage:
+ *	vbpt_txt_cm_init(&cm, seed);
+ *	do {
+ *		txt = vbpt_txt_cm_begin(&cm, mt);
+ *		... operations on txt->tree ...
+ *		vbpt_logtree_finalize(txt->tree);
+ *	} while (!vbpt_txt_cm_commit(&cm, txt, mt, merge_repeats));
+ */
+#define VBPT_TXT_CM_BACKOFF      256 // ticks
+#define VBPT_TXT_CM_BACKOFF_MAX  16  // maximum exponent
+#define VBPT_TXT_CM_IRREVOCABLE  8
+#define VBPT_TXT_CM_RATE_ONE     1024
+#define VBPT_TXT_CM_RATE_SHIFT   4   // EWMA weight: 1/16
+#define VBPT_TXT_CM_RATE_EXP     4
+
+struct vbpt_txt_cm {
+	unsigned fails;       // consecutive failures of the current transaction
+	unsigned seed;
+	bool     irrevocable; // current transaction is irrevocable
+};
+
+static inline void
+vbpt_txt_cm_init(struct vbpt_txt_cm *cm, unsigned seed)
+{
+	cm->fails = 0;
+	cm->seed = seed;
+	cm->irrevocable = false;
+}
+
+/**
+ * update the abort rate estimate of @mt (an EWMA, in 1/VBPT_TXT_CM_RATE_ONE
+ * units). Concurrent updates might be lost, which is fine for an estimate.
+ */
+static inline void
+vbpt_txt_cm_update(vbpt_mtree_t *mt, bool aborted)
+{
+	uint32_t rate = mt->mt_abort_rate;
+	uint32_t rate_new = rate - (rate >> VBPT_TXT_CM_RATE_SHIFT);
+	if (aborted)
+		rate_new += VBPT_TXT_CM_RATE_ONE >> VBPT_TXT_CM_RATE_SHIFT;
+	if (rate_new != rate)
+		mt->mt_abort_rate = rate_new;
+}
+
+static inline void
+vbpt_txt_cm_backoff(struct vbpt_txt_cm *cm, vbpt_mtree_t *mt)
+{
+	unsigned exp = cm->fails - 1;
+	exp += (mt->mt_abort_rate*VBPT_TXT_CM_RATE_EXP) / VBPT_TXT_CM_RATE_ONE;
+	if (exp > VBPT_TXT_CM_BACKOFF_MAX)
+		exp = VBPT_TXT_CM_BACKOFF_MAX;
+	uint64_t window = (uint64_t)VBPT_TXT_CM_BACKOFF << exp;
+	tsc_spinticks(rand_r(&cm->seed) % window);
+	VBPT_INC_COUNTER(cm_backoffs);
+}
+
+static inline vbpt_txtree_t *
+vbpt_txt_cm_begin(struct vbpt_txt_cm *cm, vbpt_mtree_t *mt)
+{
+	cm->irrevocable = (cm->fails >= VBPT_TXT_CM_IRREVOCABLE &&
+	                   mt->mt_mm != VBPT_MTREE_MM_EPOCH_CAS);
+	if (!cm->irrevocable)
+		return vbpt_txtree_alloc(mt);
+
+	VBPT_INC_COUNTER(cm_irrevocable);
+	return vbpt_txtree_alloc_irrevocable(mt);
+}
+
+/**
+ * try to commit a transaction started with vbpt_txt_cm_begin()
+ *  returns true if the transaction committed. Otherwise, it backs off, and the
+ *  caller should re-execute the transaction.
+ */
+static inline bool
+vbpt_txt_cm_commit(struct vbpt_txt_cm *cm, vbpt_txtree_t *txt,
+                   vbpt_mtree_t *mt, unsigned merge_repeats)
+{
+	vbpt_txt_res_t ret = vbpt_txt_try_commit(txt, mt, merge_repeats);
+	bool committed = (ret == VBPT_COMMIT_OK || ret == VBPT_COMMIT_MERGED);
+
+	vbpt_txt_cm_update(mt, !committed);
+	if (committed) {
+		cm->fails = 0;
+		return true;
+	}
+
+	// an irrevocable transaction should not fail, but if it does,
+	// vbpt_txt_try_commit() has released the token
+	cm->fails++;
+	vbpt_txt_cm_backoff(cm, mt);
+	return false;
+}
+
+/**
+ * Batched commits
+ *
+ * A thread that commits many small transactions can batch them, trading
+ * commit latency for fewer commits (and merges) on the mtree: each small
+ * transaction runs as a nested transaction of a batch transaction on the
+ * mtree (see vbpt_txt_begin_nested()), so committing it just makes its tree
+ * the batch's tree, without any synchronization. Every @max_txs transactions,
+ * or when @max_ticks have passed since the batch started (if not zero), the
+ * batch is committed on the mtree, with a single merge if needed.
+ *
+ * To be able to re-execute them, small transactions are given as closures
+ * (@fn, @arg). @fn performs the transaction's operations on @txt->tree, and
+ * returns false to abort it. If the batch conflicts when it is committed, the
+ * contention manager backs off, and the transactions of the batch (but not of
+ * previous batches) are re-executed in a new batch. All of them are
+ * re-executed, even those whose reads did not hit the conflicting writes: a
+ * transaction might have read the writes of an earlier one in the batch, and
+ * replaying the writes of the others would lose their read sets. A batch that
+ * keeps failing is split: after VBPT_TXT_CM_IRREVOCABLE failures, each of its
+ * transactions is committed on its own, using the contention manager.
+ *
+ * Each transaction adds a version to the batch's version chain, and the
+ * merge checks the logs of all of them. The chain needs to be within
+ * VER_JOIN_LIMIT versions for the merge to find its join point, so @max_txs
+ * is clamped to VBPT_TXT_BATCH_MAX. The versions of a committed batch are
+ * also added to the mtree's chain, which moves the base versions of
+ * concurrent transactions closer to that limit, so @max_txs should still be
+ * moderate.
+ *
+ * Usage:
+ *	vbpt_txt_batch_init(&b, mt, max_txs, max_ticks, seed);
+ *	... vbpt_txt_batch_run(&b, fn, arg) ...
+ *	vbpt_txt_batch_flush(&b);
+ *	vbpt_txt_batch_destroy(&b);
+ */
+typedef bool (*vbpt_txt_fn_t)(vbpt_txtree_t *txt, void *arg);
+
+struct vbpt_txt_batch_op {
+	vbpt_txt_fn_t fn;
+	void          *arg;
+};
+
+struct vbpt_txt_batch {
+	vbpt_mtree_t  *mt;
+	vbpt_txtree_t *txt;   // batch transaction (NULL if the batch is empty)
+	struct vbpt_txt_batch_op *ops; // committed transactions of the batch
+	unsigned      ops_nr, ops_size;
+	unsigned      max_txs;
+	uint64_t      max_ticks;
+	uint64_t      start;  // ticks when the batch started
+	struct vbpt_txt_cm cm;
+};
+
+// the batch's tree is one version (see vbpt_txtree_alloc()) plus one version
+// per transaction
+#define VBPT_TXT_BATCH_MAX (VER_JOIN_LIMIT - 1)
+
+static inline void
+vbpt_txt_batch_init(struct vbpt_txt_batch *b, vbpt_mtree_t *mt,
+                    unsigned max_txs, uint64_t max_ticks, unsigned seed)
+{
+	assert(max_txs > 0);
+	b->mt = mt;
+	b->txt = NULL;
+	b->ops = NULL;
+	b->ops_nr = b->ops_size = 0;
+	b->max_txs = (max_txs < VBPT_TXT_BATCH_MAX) ? max_txs
+	                                            : VBPT_TXT_BATCH_MAX;
+	b->max_ticks = max_ticks;
+	b->start = 0;
+	vbpt_txt_cm_init(&b->cm, seed);
+}
+
+static inline void
+vbpt_txt_batch_destroy(struct vbpt_txt_batch *b)
+{
+	assert(b->txt == NULL);
+	free(b->ops);
+}
+
+/**
+ * execute @op as a nested transaction of the batch
+ *  returns false if @op aborted
+ */
+static inline bool
+vbpt_txt_batch_exec1(struct vbpt_txt_batch *b, struct vbpt_txt_batch_op *op)
+{
+	vbpt_txtree_t *txt = vbpt_txt_begin_nested(b->txt);
+	if (!op->fn(txt, op->arg)) {
+		vbpt_txt_abort_nested(txt);
+		return false;
+	}
+	vbpt_logtree_finalize(txt->tree);
+	// there are no concurrent nested transactions, so there is no merge
+	if (!vbpt_txt_commit_nested(txt)) {
+		fprintf(stderr, "This should not happen\n");
+		abort();
+	}
+	return true;
+}
+
+/**
+ * commit each transaction of the batch on its own
+ */
+static inline void
+vbpt_txt_batch_split(struct vbpt_txt_batch *b)
+{
+	for (unsigned i=0; i<b->ops_nr; i++) {
+		struct vbpt_txt_batch_op *op = b->ops + i;
+		vbpt_txtree_t *txt;
+		do {
+			txt = vbpt_txt_cm_begin(&b->cm, b->mt);
+			if (!op->fn(txt, op->arg)) {
+				if (b->cm.irrevocable)
+					vbpt_mtree_irrevocable_end(b->mt,
+					                           txt->tree);
+				vbpt_logtree_finalize(txt->tree);
+				ver_detach(txt->tree->ver);
+				vbpt_tree_dealloc(txt->tree);
+				free(txt);
+				b->cm.fails = 0;
+				break;
+			}
+			vbpt_logtree_finalize(txt->tree);
+		} while (!vbpt_txt_cm_commit(&b->cm, txt, b->mt, 1));
+	}
+}
+
+/**
+ * commit the batch on its mtree, re-executing it if needed
+ */
+static inline void
+vbpt_txt_batch_flush(struct vbpt_txt_batch *b)
+{
+	if (b->txt == NULL)
+		return;
+
+	VBPT_INC_COUNTER(batch_flushes);
+	VBPT_ADD_COUNTER(batch_txs, b->ops_nr);
+	// the batch is never irrevocable: the irrevocable token is held by a
+	// tree, while the batch's tree changes with each transaction.
+	b->cm.irrevocable = false;
+	for (;;) {
+		vbpt_log_t *log = vbpt_tree_log(b->txt->tree);
+		if (log->state == VBPT_LOG_STARTED)
+			vbpt_log_finalize(log);
+		if (vbpt_txt_cm_commit(&b->cm, b->txt, b->mt, 1))
+			break;
+
+		VBPT_INC_COUNTER(batch_reexecs);
+		if (b->cm.fails >= VBPT_TXT_CM_IRREVOCABLE) {
+			vbpt_txt_batch_split(b);
+			break;
+		}
+
+		b->txt = vbpt_txtree_alloc(b->mt);
+		unsigned nr = b->ops_nr;
+		b->ops_nr = 0;
+		for (unsigned i=0; i<nr; i++) {
+			if (vbpt_txt_batch_exec1(b, b->ops + i))
+				b->ops[b->ops_nr++] = b->ops[i];
+		}
+	}
+
+	b->txt = NULL;
+	b->ops_nr = 0;
+}
+
+/**
+ * run transaction (@fn, @arg) in the batch, and commit the batch if it is due
+ *  returns false if the transaction aborted. Note that a transaction that
+ *  committed in the batch might still abort if it is re-executed.
+ */
+static inline bool
+vbpt_txt_batch_run(struct vbpt_txt_batch *b, vbpt_txt_fn_t fn, void *arg)
+{
+	if (b->txt == NULL) {
+		b->txt = vbpt_txtree_alloc(b->mt);
+		b->start = get_ticks();
+	}
+
+	struct vbpt_txt_batch_op op = {.fn = fn, .arg = arg};
+	bool ret = vbpt_txt_batch_exec1(b, &op);
+	if (ret) {
+		if (b->ops_nr == b->ops_size) {
+			b->ops_size = b->ops_size ? 2*b->ops_size : 64;
+			b->ops = xrealloc(b->ops, b->ops_size*sizeof(*b->ops));
+		}
+		b->ops[b->ops_nr++] = op;
+	}
+
+	if (b->ops_nr >= b->max_txs ||
+	    (b->max_ticks && get_ticks() - b->start >= b->max_ticks))
+		vbpt_txt_batch_flush(b);
+	return ret;
+}
+
+#endif /* VBPT_TX_ */
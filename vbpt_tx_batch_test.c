@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "vbpt.h"
+#include "vbpt_mm.h"
+#include "vbpt_log.h"
+#include "vbpt_mtree.h"
+#include "vbpt_tx.h"
+#include "vbpt_stats.h"
+
+// test batched commits: threads increment a few shared counters, each
+// increment being a transaction in a batch. Batches conflict and are
+// re-executed, but no increment should be lost or repeated.
+
+#define NCOUNTERS  8
+#define NTHREADS   4
+#define NTXS       4000
+#define BATCH_TXS  32
+
+static vbpt_mtree_t *Mt;
+
+static bool
+incr_fn(vbpt_txtree_t *txt, void *arg)
+{
+	uint64_t key = (uintptr_t)arg;
+	vbpt_leaf_t *leaf = vbpt_logtree_get(txt->tree, key);
+	vbpt_leaf_t *new = vbpt_leaf_alloc(0, txt->tree->ver);
+	new->val = leaf->val + 1;
+	vbpt_logtree_insert(txt->tree, key, new, NULL);
+	return true;
+}
+
+static void *
+batch_thr(void *arg)
+{
+	unsigned seed = (uintptr_t)arg;
+	struct vbpt_txt_batch b;
+
+	vbpt_mm_init();
+	vbpt_stats_init();
+	// half of the threads also flush on time, and half of them ask for
+	// unbounded batches (clamped to VBPT_TXT_BATCH_MAX)
+	unsigned max_txs = (seed / 2 % 2) ? UINT_MAX : BATCH_TXS;
+	vbpt_txt_batch_init(&b, Mt, max_txs, (seed % 2) ? 100000 : 0, seed);
+	for (unsigned i=0; i<NTXS; i++) {
+		uint64_t key = rand_r(&seed) % NCOUNTERS;
+		if (!vbpt_txt_batch_run(&b, incr_fn, (void *)(uintptr_t)key)) {
+			fprintf(stderr, "transaction aborted\n");
+			abort();
+		}
+	}
+	vbpt_txt_batch_flush(&b);
+	vbpt_txt_batch_destroy(&b);
+	vbpt_epoch_thr_unregister();
+	return NULL;
+}
+
+int main(int argc, const char *argv[])
+{
+	vbpt_mm_init();
+	vbpt_stats_init();
+
+	vbpt_tree_t *tree = vbpt_tree_create();
+	for (uint64_t k=0; k<NCOUNTERS; k++) {
+		vbpt_leaf_t *leaf = vbpt_leaf_alloc(0, tree->ver);
+		leaf->val = 0;
+		vbpt_insert(tree, k, leaf, NULL);
+	}
+	Mt = vbpt_mtree_alloc(tree);
+
+	pthread_t tids[NTHREADS];
+	for (unsigned i=0; i<NTHREADS; i++)
+		pthread_create(tids + i, NULL, batch_thr, (void *)(uintptr_t)i);
+	for (unsigned i=0; i<NTHREADS; i++)
+		pthread_join(tids[i], NULL);
+
+	vbpt_tree_t t;
+	uint64_t sum = 0;
+	vbpt_rotx_begin(Mt, &t);
+	for (uint64_t k=0; k<NCOUNTERS; k++)
+		sum += vbpt_get(&t, k)->val;
+	vbpt_rotx_end(Mt, &t);
+	if (sum != NTHREADS*NTXS) {
+		fprintf(stderr, "sum: %" PRIu64 " expected: %u\n",
+		        sum, NTHREADS*NTXS);
+		abort();
+	}
+
+	vbpt_mtree_dealloc(Mt, NULL);
+	printf("DONE\n");
+	return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "ver.h"
+#include "vbpt.h"
+#include "vbpt_mm.h"
+#include "vbpt_log.h"
+#include "vbpt_mtree.h"
+#include "vbpt_tx.h"
+#include "vbpt_stats.h"
+#include "vbpt_test.h"
+
+// test the contention manager: a transaction that keeps conflicting should
+// become irrevocable after VBPT_TXT_CM_IRREVOCABLE failures, and then commit
+// without a merge, releasing the irrevocable token. An irrevocable
+// transaction that fails to commit (possible if it branched before taking the
+// token) should release the token as well.
+
+#define NKEYS 1024
+
+int main(int argc, const char *argv[])
+{
+	vbpt_mm_init();
+	vbpt_stats_init();
+
+	vbpt_tree_t *tree = vbpt_tree_create_seq(NKEYS);
+	vbpt_mtree_t *mtree = vbpt_mtree_alloc(tree);
+
+	// each try reads key 1, which a concurrent transaction writes
+	struct vbpt_txt_cm cm;
+	vbpt_txt_cm_init(&cm, 42);
+	vbpt_txtree_t *txt;
+	unsigned tries;
+	for (tries = 0; ; tries++) {
+		txt = vbpt_txt_cm_begin(&cm, mtree);
+		if (cm.irrevocable)
+			break;
+		vbpt_logtree_get(txt->tree, 1);
+		vbpt_txt_write_val(txt, 2, 200 + tries);
+		vbpt_logtree_finalize(txt->tree);
+
+		vbpt_txtree_t *txc = vbpt_txtree_alloc(mtree);
+		vbpt_txt_write_val(txc, 1, 100 + tries);
+		vbpt_txt_commit_expect(txc, mtree, 0, VBPT_COMMIT_OK);
+
+		if (vbpt_txt_cm_commit(&cm, txt, mtree, 1)) {
+			fprintf(stderr, "conflicting transaction committed\n");
+			abort();
+		}
+	}
+	if (tries != VBPT_TXT_CM_IRREVOCABLE ||
+	    mtree->mt_irrevocable != txt->tree) {
+		fprintf(stderr, "transaction did not become irrevocable\n");
+		abort();
+	}
+	vbpt_logtree_get(txt->tree, 1);
+	vbpt_txt_write_val(txt, 2, 200);
+	vbpt_logtree_finalize(txt->tree);
+	if (!vbpt_txt_cm_commit(&cm, txt, mtree, 0)) {
+		fprintf(stderr, "irrevocable transaction failed\n");
+		abort();
+	}
+	if (mtree->mt_irrevocable != NULL || cm.fails != 0) {
+		fprintf(stderr, "irrevocable token not released\n");
+		abort();
+	}
+	if (vbpt_mtree_get_val(mtree, 2) != 200) {
+		fprintf(stderr, "unexpected value\n");
+		abort();
+	}
+
+	// @txa takes the token after a conflicting commit
+	vbpt_txtree_t *txa = vbpt_txtree_alloc(mtree);
+	vbpt_txtree_t *txb = vbpt_txtree_alloc(mtree);
+	vbpt_logtree_get(txa->tree, 1);
+	vbpt_txt_write_val(txa, 2, 300);
+	vbpt_txt_write_val(txb, 1, 300);
+	vbpt_txt_commit_expect(txb, mtree, 0, VBPT_COMMIT_OK);
+	vbpt_mtree_irrevocable_begin(mtree, txa->tree);
+	vbpt_txt_commit_expect(txa, mtree, 1, VBPT_COMMIT_MERGE_FAILED);
+	if (mtree->mt_irrevocable != NULL) {
+		fprintf(stderr, "failed transaction holds the token\n");
+		abort();
+	}
+
+	// commits proceed
+	vbpt_txtree_t *txc = vbpt_txtree_alloc(mtree);
+	vbpt_txt_write_val(txc, 2, 400);
+	vbpt_txt_commit_expect(txc, mtree, 0, VBPT_COMMIT_OK);
+	if (vbpt_mtree_get_val(mtree, 1) != 300 ||
+	    vbpt_mtree_get_val(mtree, 2) != 400) {
+		fprintf(stderr, "unexpected values\n");
+		abort();
+	}
+
+	vbpt_mtree_dealloc(mtree, NULL);
+	printf("DONE\n");
+	return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "ver.h"
+#include "vbpt.h"
+#include "vbpt_mm.h"
+#include "vbpt_log.h"
+#include "vbpt_mtree.h"
+#include "vbpt_tx.h"
+#include "vbpt_stats.h"
+#include "vbpt_test.h"
+
+// test nested transactions: a nested transaction that read a key written by a
+// sibling that committed before it should fail. Nested transactions that run
+// in parallel on disjoint keys should all commit, and their changes should be
+// committed (merging with a concurrent commit) along with the parent's.
+
+#define NKEYS        1024
+#define NTHREADS     4
+#define THREAD_KEYS  64
+#define THREAD_BASE  256
+
+static vbpt_txtree_t *Parent;
+
+struct nested_arg {
+	vbpt_txtree_t *txt;
+	uint64_t      base;
+};
+
+static void *
+nested_thr(void *arg_)
+{
+	struct nested_arg *arg = arg_;
+	vbpt_txtree_t *txt = arg->txt;
+	uint64_t base = arg->base;
+	vbpt_mm_init();
+	vbpt_stats_init();
+	for (uint64_t k=base; k<base + THREAD_KEYS; k++)
+		vbpt_txt_write_val(txt, k, 2*k);
+	vbpt_logtree_finalize(txt->tree);
+	if (!vbpt_txt_commit_nested(txt)) {
+		fprintf(stderr, "nested transaction failed to commit\n");
+		abort();
+	}
+	vbpt_epoch_thr_unregister();
+	return NULL;
+}
+
+static void
+nested_test(enum vbpt_mtree_mm mm)
+{
+	vbpt_tree_t *tree = vbpt_tree_create_seq(NKEYS);
+	vbpt_mtree_t *mtree = vbpt_mtree_alloc(tree);
+	vbpt_mtree_setmm(mtree, mm);
+
+	// the parent does not write before its nested transactions begin, so
+	// (except in VBPT_MTREE_MM_REFCNT mode) its root is still borrowed, and
+	// the first nested transactions commit on other threads
+	Parent = vbpt_txtree_alloc(mtree);
+
+	// parallel nested transactions on disjoint keys (they are begun by the
+	// parent's thread)
+	pthread_t tids[NTHREADS];
+	struct nested_arg args[NTHREADS];
+	for (unsigned i=0; i<NTHREADS; i++) {
+		args[i].txt = vbpt_txt_begin_nested(Parent);
+		args[i].base = THREAD_BASE + i*THREAD_KEYS;
+	}
+	for (unsigned i=0; i<NTHREADS; i++)
+		pthread_create(tids + i, NULL, nested_thr, args + i);
+	for (unsigned i=0; i<NTHREADS; i++)
+		pthread_join(tids[i], NULL);
+
+	// conflict: @txa reads a key that @txb writes
+	vbpt_txtree_t *txa = vbpt_txt_begin_nested(Parent);
+	vbpt_txtree_t *txb = vbpt_txt_begin_nested(Parent);
+	vbpt_logtree_get(txa->tree, 1);
+	vbpt_txt_write_val(txa, 2, 200);
+	vbpt_txt_write_val(txb, 1, 100);
+	vbpt_logtree_finalize(txa->tree);
+	vbpt_logtree_finalize(txb->tree);
+	if (!vbpt_txt_commit_nested(txb)) {
+		fprintf(stderr, "first nested transaction failed to commit\n");
+		abort();
+	}
+	if (vbpt_txt_commit_nested(txa)) {
+		fprintf(stderr, "nested conflict not detected\n");
+		abort();
+	}
+
+	// the parent continues, and a concurrent transaction commits
+	vbpt_txt_resume(Parent);
+	vbpt_txt_write_val(Parent, 0, 1000);
+	vbpt_txt_write_val(Parent, 3, 300);
+
+	vbpt_txtree_t *txc = vbpt_txtree_alloc(mtree);
+	vbpt_txt_write_val(txc, NKEYS - 1, 400);
+	vbpt_txt_commit_expect(txc, mtree, 0, VBPT_COMMIT_OK);
+	vbpt_txt_commit_expect(Parent, mtree, 1, VBPT_COMMIT_MERGED);
+
+	if (vbpt_mtree_get_val(mtree, 0) != 1000 ||
+	    vbpt_mtree_get_val(mtree, 1) != 100 ||
+	    vbpt_mtree_get_val(mtree, 2) != 2 ||
+	    vbpt_mtree_get_val(mtree, 3) != 300 ||
+	    vbpt_mtree_get_val(mtree, NKEYS - 1) != 400) {
+		fprintf(stderr, "unexpected values\n");
+		abort();
+	}
+	uint64_t keys_end = THREAD_BASE + NTHREADS*THREAD_KEYS;
+	for (uint64_t k=THREAD_BASE; k<keys_end; k++) {
+		if (vbpt_mtree_get_val(mtree, k) != 2*k) {
+			fprintf(stderr, "unexpected value for key %" PRIu64 "\n",
+			        k);
+			abort();
+		}
+	}
+
+	vbpt_mtree_dealloc(mtree, NULL);
+}
+
+int main(int argc, const char *argv[])
+{
+	vbpt_mm_init();
+	vbpt_stats_init();
+
+	nested_test(VBPT_MTREE_MM_REFCNT);
+	nested_test(VBPT_MTREE_MM_EPOCH);
+	nested_test(VBPT_MTREE_MM_EPOCH_CAS);
+
+	printf("DONE\n");
+	return 0;
+}
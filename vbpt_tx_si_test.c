@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "ver.h"
+#include "vbpt.h"
+#include "vbpt_mm.h"
+#include "vbpt_log.h"
+#include "vbpt_mtree.h"
+#include "vbpt_tx.h"
+#include "vbpt_stats.h"
+#include "vbpt_test.h"
+
+// test snapshot isolation: a transaction that read a key written by a
+// concurrent commit should commit, while a transaction that wrote (or deleted)
+// a key written by a concurrent commit should fail. Under serializability, the
+// opposite holds for blind writes.
+
+#define NKEYS 1024
+
+int main(int argc, const char *argv[])
+{
+	vbpt_mm_init();
+	vbpt_stats_init();
+
+	vbpt_tree_t *tree = vbpt_tree_create_seq(NKEYS);
+	vbpt_mtree_t *mtree = vbpt_mtree_alloc(tree);
+	vbpt_mtree_setiso(mtree, VBPT_LOG_ISO_SNAPSHOT);
+
+	// read-write: no conflict under SI
+	vbpt_txtree_t *txa = vbpt_txtree_alloc(mtree);
+	vbpt_txtree_t *txb = vbpt_txtree_alloc(mtree);
+	if (vbpt_logtree_get(txa->tree, 1)->val != 1) {
+		fprintf(stderr, "unexpected value\n");
+		abort();
+	}
+	vbpt_txt_write_val(txa, 2, 200);
+	vbpt_txt_write_val(txb, 1, 100);
+	vbpt_txt_commit_expect(txb, mtree, 1, VBPT_COMMIT_OK);
+	if (!vbpt_txt_validate(txa, mtree)) {
+		fprintf(stderr, "SI validation failed\n");
+		abort();
+	}
+	vbpt_txt_commit_expect(txa, mtree, 1, VBPT_COMMIT_MERGED);
+
+	// write-write: conflict under SI
+	vbpt_txtree_t *txc = vbpt_txtree_alloc(mtree);
+	vbpt_txtree_t *txd = vbpt_txtree_alloc(mtree);
+	vbpt_txt_write_val(txc, 3, 300);
+	vbpt_txt_write_val(txd, 3, 301);
+	vbpt_txt_commit_expect(txd, mtree, 1, VBPT_COMMIT_OK);
+	vbpt_txt_commit_expect(txc, mtree, 1, VBPT_COMMIT_MERGE_FAILED);
+
+	// write-delete: conflict under SI
+	vbpt_txtree_t *txe = vbpt_txtree_alloc(mtree);
+	vbpt_txtree_t *txf = vbpt_txtree_alloc(mtree);
+	vbpt_txt_write_val(txe, 4, 400);
+	vbpt_logtree_delete(txf->tree, 4, NULL);
+	vbpt_txt_commit_expect(txf, mtree, 1, VBPT_COMMIT_OK);
+	vbpt_txt_commit_expect(txe, mtree, 1, VBPT_COMMIT_MERGE_FAILED);
+
+	// blind write-write: no conflict for a serializable transaction
+	vbpt_txtree_t *txg = vbpt_txtree_alloc(mtree);
+	vbpt_txtree_t *txh = vbpt_txtree_alloc(mtree);
+	vbpt_txt_set_iso(txg, VBPT_LOG_ISO_SERIALIZABLE);
+	vbpt_txt_write_val(txg, 5, 500);
+	vbpt_txt_write_val(txh, 5, 501);
+	vbpt_txt_commit_expect(txh, mtree, 1, VBPT_COMMIT_OK);
+	vbpt_txt_commit_expect(txg, mtree, 1, VBPT_COMMIT_MERGED);
+
+	if (vbpt_mtree_get_val(mtree, 1) != 100 ||
+	    vbpt_mtree_get_val(mtree, 2) != 200 ||
+	    vbpt_mtree_get_val(mtree, 3) != 301 ||
+	    vbpt_mtree_get_val(mtree, 4) != UINT64_MAX ||
+	    vbpt_mtree_get_val(mtree, 5) != 500) {
+		fprintf(stderr, "unexpected values\n");
+		abort();
+	}
+
+	vbpt_mtree_dealloc(mtree, NULL);
+	printf("DONE\n");
+	return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2012-2015, ETH Zurich.
+ *
+ * Released under a dual BSD 3-clause/GPL 2 license. When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * http://opensource.org/licenses/BSD-3-Clause
+ * http://opensource.org/licenses/GPL-2.0
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "ver.h"
+#include "vbpt.h"
+#include "vbpt_mm.h"
+#include "vbpt_log.h"
+#include "vbpt_mtree.h"
+#include "vbpt_tx.h"
+#include "vbpt_stats.h"
+#include "vbpt_test.h"
+
+// test early conflict detection: a transaction that read a key written by a
+// later commit should fail validation before committing. A transaction that
+// did not, should pass validation, and after rebasing it should commit
+// without a merge. A transaction that is too far behind to be merged should
+// fail validation, even without conflicts.
+
+#define NKEYS 1024
+
+int main(int argc, const char *argv[])
+{
+	vbpt_mm_init();
+	vbpt_stats_init();
+
+	vbpt_tree_t *tree = vbpt_tree_create_seq(NKEYS);
+	vbpt_mtree_t *mtree = vbpt_mtree_alloc(tree);
+
+	// conflict: @txa reads a key that @txb writes
+	vbpt_txtree_t *txa = vbpt_txtree_alloc(mtree);
+	vbpt_txtree_t *txb = vbpt_txtree_alloc(mtree);
+	vbpt_logtree_get(txa->tree, 1);
+	vbpt_txt_write_val(txa, 2, 200);
+	if (!vbpt_txt_validate(txa, mtree)) {
+		fprintf(stderr, "validation failed without commits\n");
+		abort();
+	}
+	vbpt_txt_write_val(txb, 1, 100);
+	vbpt_txt_commit_expect(txb, mtree, 0, VBPT_COMMIT_OK);
+	if (vbpt_txt_validate(txa, mtree)) {
+		fprintf(stderr, "validation did not detect conflict\n");
+		abort();
+	}
+	if (vbpt_txt_rebase(txa, mtree)) {
+		fprintf(stderr, "rebase did not detect conflict\n");
+		abort();
+	}
+	if (vbpt_mtree_get_val(mtree, 1) != 100 ||
+	    vbpt_mtree_get_val(mtree, 2) != 2) {
+		fprintf(stderr, "unexpected values\n");
+		abort();
+	}
+
+	// no conflict: @txc reads a key that nobody writes
+	// (bloom logs answer range queries conservatively, so the structural
+	// merge of the rebase might fail)
+	#if !defined(VBPT_LOG_BLOOM)
+	vbpt_txtree_t *txc = vbpt_txtree_alloc(mtree);
+	vbpt_txtree_t *txd = vbpt_txtree_alloc(mtree);
+	vbpt_logtree_get(txc->tree, 3);
+	vbpt_txt_write_val(txd, NKEYS - 1, 400);
+	vbpt_txt_commit_expect(txd, mtree, 0, VBPT_COMMIT_OK);
+	if (!vbpt_txt_validate(txc, mtree) || !vbpt_txt_rebase(txc, mtree)) {
+		fprintf(stderr, "false conflict\n");
+		abort();
+	}
+	vbpt_txt_write_val(txc, 5, 500);
+	vbpt_txt_commit_expect(txc, mtree, 0, VBPT_COMMIT_OK);
+
+	if (vbpt_mtree_get_val(mtree, 5) != 500 ||
+	    vbpt_mtree_get_val(mtree, NKEYS - 1) != 400) {
+		fprintf(stderr, "unexpected values\n");
+		abort();
+	}
+	#endif
+
+	// too far behind: more than VER_JOIN_LIMIT commits after @txe's base
+	vbpt_txtree_t *txe = vbpt_txtree_alloc(mtree);
+	vbpt_logtree_get(txe->tree, 7);
+	for (unsigned i=0; i<VER_JOIN_LIMIT + 1; i++) {
+		vbpt_txtree_t *txf = vbpt_txtree_alloc(mtree);
+		vbpt_txt_write_val(txf, NKEYS - 2, i);
+		vbpt_txt_commit_expect(txf, mtree, 0, VBPT_COMMIT_OK);
+	}
+	if (vbpt_txt_validate(txe, mtree)) {
+		fprintf(stderr, "validation passed without a join point\n");
+		abort();
+	}
+	if (vbpt_txt_rebase(txe, mtree)) {
+		fprintf(stderr, "rebase succeeded without a join point\n");
+		abort();
+	}
+
+	vbpt_mtree_dealloc(mtree, NULL);
+	printf("DONE\n");
+	return 0;
+}
@@ -109,6 +109,14 @@
  * and all branches happen on this version (or in the case of nesting, on one
  * of its children).
  *
+ * Snapshots (see vbpt_msnap_t) need to keep older versions around as branch
+ * points. Hence, besides the pinned blessed version, a number of versions
+ * might be snapshot-pinned using ver_snap_pin(). A snapshot-pinned version
+ * holds an additional child reference, so ver_tree_gc() considers it a branch
+ * and stops there: versions older than the snapshot are collected as usual,
+ * while the versions between the snapshot and the blessed version stay in the
+ * chain until the snapshot is unpinned.
+ *
  * NOTE: The following are currently deprecated, since we end up serializing
  * ver_tree_gc() anyway.
  * There are two possible implementations for pinning a version:
@@ -126,8 +134,14 @@
  * To avoid keeping old versions around for too long, we could apply another
  * optimization where we update stale version references to the pinned version.
  * We could for example, keep a set of stale versions and check against it when
- * iterating the tree. Another possible optimization would be to  set ->ver ==
- * NULL for nodes that have the same version as their parent on the tree.
+ * iterating the tree.
+ *
+ * Another optimization, which we implement (see VBPT_VREF_ELIDE in vbpt.h), is
+ * to set ->ver == NULL for nodes that have the same version as their parent on
+ * the tree. Such nodes do not hold a version reference, and the version is
+ * resolved from the parent when the tree is traversed. The version reference
+ * is materialized (vbpt_hdr_vref_set()) before a node can be reached from a
+ * parent of a different version.
  */
 
 #define VERS_VERSIONED
@@ -464,6 +478,22 @@ ver_unpin(ver_t *ver)
 	ver_putref(ver);
 }
 
+/**
+ * snapshot-pin a version: keep @ver in the version tree, so that new versions
+ * can be branched off it. See comment at begining of file for details.
+ */
+static inline void
+ver_snap_pin(ver_t *ver)
+{
+	ver_get_child_ref(ver);
+}
+
+static inline void
+ver_snap_unpin(ver_t *ver)
+{
+	ver_put_child_ref(ver);
+}
+
 
 /**
  * set parent without checking for previous parent
@@ -627,6 +657,23 @@ ver_ancestor_strict_limit(ver_t *v_p, ver_t *v_ch, uint16_t max_d)
 
 #define VER_JOIN_FAIL ((ver_t *)(~((uintptr_t)0)))
 #define VER_JOIN_LIMIT 64
+#define VER_DIST_FAIL  ((uint16_t)~0)
+
+/**
+ * return the distance of @v_ch from its ancestor @v_p, assuming it is no more
+ * than @max_d. If @v_p is not found, VER_DIST_FAIL is returned.
+ *  if @v_p == @v_ch the function returns 0
+ */
+static inline uint16_t
+ver_dist_limit(ver_t *v_p, ver_t *v_ch, uint16_t max_d)
+{
+	ver_t *v = v_ch;
+	for (uint16_t i=0; v != NULL && i < max_d + 1; v = v->parent, i++) {
+		if (v == v_p)
+			return i;
+	}
+	return VER_DIST_FAIL;
+}
 
 ver_t *
 ver_join_slow(ver_t *gver, ver_t *pver, ver_t **prev_pver,
@@ -787,12 +834,83 @@ vref_get__(ver_t *ver)
 	return ret;
 }
 
+// a NULL version reference: the version is the same as the parent's
+static inline vref_t
+vref_null(void)
+{
+	vref_t ret;
+	ret.ver_ = NULL;
+	#if defined(VERS_VERSIONED)
+	ret.ver_seq = 0;
+	#endif
+	#if !defined(NDEBUG)
+	ret.vid = 0;
+	#endif
+	return ret;
+}
+
+static inline bool
+vref_isnull(vref_t vref)
+{
+	return vref.ver_ == NULL;
+}
+
 static inline void
 vref_put(vref_t vref)
 {
 	#if !defined(VERS_VERSIONED)
-	ver_putref(vref.ver_);
+	if (vref.ver_ != NULL)
+		ver_putref(vref.ver_);
+	#endif
+}
+
+// duplicate a version reference
+static inline vref_t
+vref_dup(vref_t vref)
+{
+	#if !defined(VERS_VERSIONED)
+	if (vref.ver_ != NULL)
+		ver_getref(vref.ver_);
+	#endif
+	return vref;
+}
+
+/**
+ * read a version reference that might be concurrently set by vref_set_null()
+ *  ->ver_ is read first, so if it is not NULL the rest of the fields are valid
+ */
+static inline vref_t
+vref_load(const vref_t *src)
+{
+	vref_t ret;
+	ret.ver_ = *(struct ver * volatile *)&src->ver_;
+	__asm__ __volatile__("" ::: "memory");
+	#if defined(VERS_VERSIONED)
+	ret.ver_seq = src->ver_seq;
+	#endif
+	#if !defined(NDEBUG)
+	ret.vid = src->vid;
+	#endif
+	return ret;
+}
+
+/**
+ * set a NULL version reference (*@dst) to @vref
+ *  Nodes are shared between trees, so more than one thread might try to set the
+ *  same reference. All of them set it to the same value, so the remaining
+ *  fields are written first and ->ver_ is set last atomically.
+ *  Returns false if the reference was already set (@vref is not consumed)
+ */
+static inline bool
+vref_set_null(vref_t *dst, vref_t vref)
+{
+	#if defined(VERS_VERSIONED)
+	dst->ver_seq = vref.ver_seq;
+	#endif
+	#if !defined(NDEBUG)
+	dst->vid = vref.vid;
 	#endif
+	return __sync_bool_compare_and_swap(&dst->ver_, NULL, vref.ver_);
 }
 
 static inline bool